@@ -13,6 +13,15 @@ void Screen::clear() { u8g2.clearBuffer(); }
 
 void Screen::display() { u8g2.sendBuffer(); }
 
+void Screen::displayArea(int x, int y, int w, int h) {
+    // Only send the 8x8 tiles covering the given pixel rectangle
+    int tileX = x / 8;
+    int tileY = y / 8;
+    int tileW = (x + w + 7) / 8 - tileX;
+    int tileH = (y + h + 7) / 8 - tileY;
+    u8g2.updateDisplayArea(tileX, tileY, tileW, tileH);
+}
+
 void Screen::drawStr(int x, int y, const char* str) { u8g2.drawStr(x, y, str); }
 
 // u8g2_font_pixzillav1_tr, u8g2_font_doomalpha04_tr
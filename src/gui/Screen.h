@@ -9,6 +9,7 @@ class Screen {
     void begin();
     void clear();
     void display();
+    void displayArea(int x, int y, int w, int h);
     U8G2_SH1106_128X64_NONAME_F_2ND_HW_I2C* getDisplay();
 
     int getWidth();
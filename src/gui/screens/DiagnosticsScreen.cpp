@@ -0,0 +1,84 @@
+#include "DiagnosticsScreen.h"
+
+#include <Audio.h>
+
+#include "../../helper/AudioDiagnostics.h"
+
+// Counters are redrawn once a second while the screen is open
+static const long DIAGNOSTICS_UPDATE_INTERVAL_US = 1000000;
+
+DiagnosticsScreen::DiagnosticsScreen(Controls *keyboard, Screen *screen,
+                                     NavigationCallback navCallback) {
+    _keyboard = keyboard;
+    _screen = screen;
+    _navCallback = navCallback;
+}
+
+long DiagnosticsScreen::receiveTimerTick() {
+    refresh();
+    return DIAGNOSTICS_UPDATE_INTERVAL_US;
+}
+
+void DiagnosticsScreen::refresh() {
+    char line[32];
+
+    _screen->clear();
+    _screen->setHeaderFont();
+    _screen->drawStr(0, 10, "DIAGNOSTICS");
+    _screen->setNormalFont();
+
+    snprintf(line, sizeof(line), "CPU %.1f%%  max %.1f%%",
+             AudioProcessorUsage(), AudioProcessorUsageMax());
+    _screen->drawStr(0, 19, line);
+
+    snprintf(line, sizeof(line), "MEM %u  max %u blocks",
+             (unsigned)AudioMemoryUsage(), (unsigned)AudioMemoryUsageMax());
+    _screen->drawStr(0, 26, line);
+
+    snprintf(line, sizeof(line), "REC OVERRUN %lu",
+             (unsigned long)audioDiagnostics.getQueueOverruns());
+    _screen->drawStr(0, 33, line);
+
+    snprintf(line, sizeof(line), "RING %lu  DROP %lu",
+             (unsigned long)audioDiagnostics.getRingHighWater(),
+             (unsigned long)audioDiagnostics.getBlocksDropped());
+    _screen->drawStr(0, 40, line);
+
+    snprintf(line, sizeof(line), "SD %lu  WORST %lu us",
+             (unsigned long)audioDiagnostics.getSdWriteCount(),
+             (unsigned long)audioDiagnostics.getSdWriteMaxMicros());
+    _screen->drawStr(0, 47, line);
+
+    // Writes slower than 16 ms are the ones that put the ring to work
+    uint32_t slowWrites = 0;
+    for (int i = 0; i < AudioDiagnostics::LATENCY_BUCKETS; i++) {
+        uint32_t limit = AudioDiagnostics::bucketLimitMicros(i);
+        if (limit == 0 || limit > 16000) {
+            slowWrites += audioDiagnostics.getSdWriteBucket(i);
+        }
+    }
+    snprintf(line, sizeof(line), "SD >16ms %lu",
+             (unsigned long)slowWrites);
+    _screen->drawStr(0, 54, line);
+
+    snprintf(line, sizeof(line), "PLAY UNDERRUN %lu",
+             (unsigned long)audioDiagnostics.getPlayerUnderruns());
+    _screen->drawStr(0, 61, line);
+
+    _screen->display();
+}
+
+void DiagnosticsScreen::handleEvent(Controls::ButtonEvent event) {
+    if (event.buttonId == 1 && event.state == PRESSED) {
+        if (_navCallback) {
+            _navCallback(AppContext::HOME);
+            return;
+        }
+    }
+
+    // Button 2 clears all counters and high-water marks
+    if (event.buttonId == 2 && event.state == PRESSED) {
+        audioDiagnostics.reset();
+        refresh();
+    }
+}
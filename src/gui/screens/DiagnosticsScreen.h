@@ -0,0 +1,27 @@
+#ifndef DiagnosticsScreen_h
+#define DiagnosticsScreen_h
+
+#include <Arduino.h>
+
+#include "../../hardware/Controls.h"
+#include "../../main.h"
+#include "../Screen.h"
+
+class DiagnosticsScreen {
+   public:
+    typedef void (*NavigationCallback)(AppContext newContext);
+
+    DiagnosticsScreen(Controls *keyboard, Screen *screen,
+                      NavigationCallback navCallback = nullptr);
+
+    long receiveTimerTick();
+    void handleEvent(Controls::ButtonEvent);
+    void refresh();
+
+   private:
+    NavigationCallback _navCallback;
+    Controls *_keyboard;
+    Screen *_screen;
+};
+
+#endif
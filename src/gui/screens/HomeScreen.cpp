@@ -9,14 +9,16 @@ HomeScreen::HomeScreen(Controls *keyboard, Screen *screen,
     _navCallback = navCallback;
 }
 
+static const char *menuItems[] = {"Recorder", "Live", "Diagnostics",
+                                  nullptr};
+static const AppContext menuTargets[] = {AppContext::RECORDER, AppContext::LIVE,
+                                         AppContext::DIAGNOSTICS};
+
 void HomeScreen::refresh() {
-    const char *menuItems[] = {"Recorder", "Live", nullptr};
     _screen->drawItemList(0, 20, menuItems, _selectedIndex);
 }
 
 void HomeScreen::handleEvent(Controls::ButtonEvent event) {
-    const char *menuItems[] = {"Recorder", "Live", nullptr};
-
     int itemCount = 0;
     while (menuItems[itemCount] != nullptr) itemCount++;
 
@@ -26,9 +28,7 @@ void HomeScreen::handleEvent(Controls::ButtonEvent event) {
     } else if (event.buttonId == 2 &&
                event.state == PRESSED) {  // Button 1 - Select
         if (_navCallback) {
-            AppContext targetContext =
-                (_selectedIndex == 0) ? AppContext::RECORDER : AppContext::LIVE;
-            _navCallback(targetContext);
+            _navCallback(menuTargets[_selectedIndex]);
             return;
         }
     }
@@ -1,5 +1,15 @@
 #include "LiveScreen.h"
 
+// Encoder detents: a jump while playing, a scrub step while paused
+static const int32_t SEEK_STEP_MS = 250;
+static const int32_t SCRUB_STEP_MS = 20;
+
+// Samples are only cached at this rate, see SampleCache
+static const uint32_t CACHED_SAMPLE_RATE = 44100;
+
+// Button 3 + encoder: varispeed in semitones, two octaves either way
+static const int MAX_SEMITONES = 24;
+
 LiveScreen::LiveScreen(Controls *keyboard, Screen *screen,
                        NavigationCallback navCallback) {
     _keyboard = keyboard;
@@ -15,6 +25,7 @@ LiveScreen::~LiveScreen() {
 void LiveScreen::refresh() {
     currentState = LIVE_HOME;
     loadFileList();
+    updateSamplePool();
     
     _screen->clear();
     _screen->drawStr(0, 8, "Live Samples");
@@ -40,6 +51,8 @@ void LiveScreen::setAudioResources(AudioResources* audioResources) {
 void LiveScreen::handleEvent(Controls::ButtonEvent event) {
     if (event.buttonId == 1 && event.state == PRESSED) {
         // Back button - return to home
+        _scrubber.close();
+        _samplePool.clear();
         if (_navCallback) {
             _navCallback(AppContext::HOME);
             return;
@@ -51,12 +64,9 @@ void LiveScreen::handleEvent(Controls::ButtonEvent event) {
         if (currentState == LIVE_HOME && _fileCount > 0) {
             playSelectedFile();
         } else if (currentState == LIVE_PLAYING) {
-            // Pause playback
-            currentState = LIVE_PAUSED;
+            pausePlayback();
         } else if (currentState == LIVE_PAUSED) {
-            // Resume playback
-            currentState = LIVE_PLAYING;
-            _playbackStartTime = millis();
+            resumePlayback();
         }
         return;
     }
@@ -66,6 +76,7 @@ void LiveScreen::handleEvent(Controls::ButtonEvent event) {
         if (event.encoderValue != 0) {
             _selectedIndex += event.encoderValue;
             _selectedIndex = constrain(_selectedIndex, 0, _fileCount - 1);
+            updateSamplePool();
             
             // Redraw file list with new selection
             _screen->clear();
@@ -86,11 +97,26 @@ void LiveScreen::handleEvent(Controls::ButtonEvent event) {
         return;
     }
 
+    // Encoder while a sample plays: skip through it, or scrub when paused.
+    // With button 3 held it changes the speed instead.
+    if (event.buttonId == 0 && event.encoderValue != 0) {
+        if (event.button3Held) {
+            changeSpeed(event.encoderValue);
+        } else {
+            moveWithinSample(event.encoderValue);
+        }
+        return;
+    }
+
     // Note: Volume control removed for USB audio - controlled by host system
 
-    // Handle stop playback (button 3 or long press on button 2)
-    if (event.buttonId == 3 && event.state == PRESSED) {
-        if (currentState == LIVE_PLAYING || currentState == LIVE_PAUSED) {
+    // Button 3 stops playback when let go, unless it was held to change
+    // the speed
+    if (event.buttonId == 3) {
+        if (event.state == PRESSED) {
+            _speedChanged = false;
+        } else if (!_speedChanged && (currentState == LIVE_PLAYING ||
+                                      currentState == LIVE_PAUSED)) {
             stopPlayback();
         }
         return;
@@ -101,6 +127,9 @@ void LiveScreen::handleEvent(Controls::ButtonEvent event) {
 
 void LiveScreen::loadFileList() {
     _fileCount = 0;
+
+    // A take may be recording in the background
+    SdCardLock cardLock;
     
     // Check if RECORDINGS directory exists
     if (!SD.exists("/RECORDINGS")) {
@@ -122,7 +151,7 @@ void LiveScreen::loadFileList() {
     
     Serial.println("Scanning RECORDINGS directory...");
     
-    // Read all .WAV files
+    // Read all .WAV and lossless .NMC files
     while (true && _fileCount < 20) {
         File entry = recordingsDir.openNextFile();
         if (!entry) {
@@ -134,12 +163,14 @@ void LiveScreen::loadFileList() {
         Serial.println("Found entry: " + filename + " (isDir: " + String(entry.isDirectory()) + ")");
         
         if (!entry.isDirectory()) {
-            if (filename.endsWith(".WAV") || filename.endsWith(".wav")) {
+            String extension = filename.substring(filename.lastIndexOf('.'));
+            extension.toLowerCase();
+            if (extension == ".wav" || extension == ".nmc") {
                 _fileList[_fileCount] = filename;
                 _fileCount++;
                 Serial.println("Added to list: " + filename);
             } else {
-                Serial.println("Skipped (not WAV): " + filename);
+                Serial.println("Skipped (not audio): " + filename);
             }
         } else {
             Serial.println("Skipped directory: " + filename);
@@ -164,11 +195,17 @@ void LiveScreen::playSelectedFile() {
     
     _currentPlayingFile = _fileList[_selectedIndex];
     currentState = LIVE_PLAYING;
+    _semitones = 0;
     _playbackStartTime = millis();
     
     // Start playing the WAV file
     String fullPath = "/RECORDINGS/" + _currentPlayingFile;
-    if (_audioResources->playWav1.play(fullPath.c_str())) {
+    // Short samples come from RAM once they've been played and sound on
+    // top of each other, everything else streams from the card
+    _note = _sampleCache.play(_audioResources->sampler, fullPath);
+    bool started =
+        _note || _samplePool.play(_audioResources->playWav1, fullPath);
+    if (started) {
         _screen->clear();
         _screen->drawStr(0, 8, "Playing:");
         _screen->drawStr(0, 20, _currentPlayingFile.c_str());
@@ -189,12 +226,15 @@ void LiveScreen::playSelectedFile() {
 
 void LiveScreen::stopPlayback() {
     // Stop audio playback
+    _scrubber.close();
     if (_audioResources) {
         _audioResources->playWav1.stop();
+        _audioResources->sampler.stopAll();
     }
     
     currentState = LIVE_HOME;
     _currentPlayingFile = "";
+    _note = 0;
     
     _screen->clear();
     _screen->drawStr(0, 8, "Live Samples");
@@ -202,13 +242,118 @@ void LiveScreen::stopPlayback() {
     _screen->display();
 }
 
+// Then the sample can be scrubbed. Streamed samples pause where they are,
+// a note playing from RAM is stopped and restarted on resume.
+void LiveScreen::pausePlayback() {
+    AudioPlaySdWavExtended &player = _audioResources->playWav1;
+    AudioSamplerVoices &sampler = _audioResources->sampler;
+    uint32_t position;
+    if (_note) {
+        if (!sampler.isPlaying(_note)) return;
+        position = _pausedFrame = sampler.position(_note);
+        sampler.stop(_note);
+    } else {
+        if (!player.isPlaying()) return;
+        player.togglePlayPause();
+        position = player.positionSamples();
+    }
+    currentState = LIVE_PAUSED;
+    if (_scrubber.open(sampler, "/RECORDINGS/" + _currentPlayingFile)) {
+        _scrubber.setPosition(position);
+    }
+}
+
+// Picks up from wherever the sample was scrubbed to
+void LiveScreen::resumePlayback() {
+    currentState = LIVE_PLAYING;
+    _playbackStartTime = millis();
+    if (_note) {
+        uint32_t frame =
+            _scrubber.isOpen() ? _scrubber.getPosition() : _pausedFrame;
+        _scrubber.close();
+        if (!restartNote(frame)) stopPlayback();
+        return;
+    }
+    AudioPlaySdWavExtended &player = _audioResources->playWav1;
+    if (!player.isPaused()) return;
+    if (_scrubber.isOpen() &&
+        _scrubber.getPosition() != player.positionSamples()) {
+        player.seekSamples(_scrubber.getPosition());
+    }
+    _scrubber.close();
+    player.togglePlayPause();
+}
+
+// A new note for the sample playing from RAM, `frame` frames in. The old
+// one fades out as it starts. False if the sample has left the cache.
+bool LiveScreen::restartNote(uint32_t frame) {
+    AudioSamplerVoices &sampler = _audioResources->sampler;
+    uint32_t note = _sampleCache.play(
+        sampler, "/RECORDINGS/" + _currentPlayingFile, 1.0, speed(), frame);
+    if (!note) return false;
+    sampler.stop(_note);
+    _note = note;
+    return true;
+}
+
+void LiveScreen::moveWithinSample(int encoderValue) {
+    if (currentState == LIVE_PAUSED && _scrubber.isOpen()) {
+        int32_t step = _scrubber.getSampleRate() * SCRUB_STEP_MS / 1000;
+        _scrubber.scrubBy(encoderValue * step);
+        return;
+    }
+    if (currentState != LIVE_PLAYING) return;
+    if (_note) {
+        AudioSamplerVoices &sampler = _audioResources->sampler;
+        if (!sampler.isPlaying(_note)) return;
+        int32_t target = (int32_t)sampler.position(_note) +
+                         encoderValue * SEEK_STEP_MS *
+                             (int32_t)CACHED_SAMPLE_RATE / 1000;
+        restartNote(max(target, (int32_t)0));
+        return;
+    }
+    AudioPlaySdWavExtended &player = _audioResources->playWav1;
+    if (!player.isPlaying()) return;
+    int32_t target =
+        (int32_t)player.positionMillis() + encoderValue * SEEK_STEP_MS;
+    player.seekMillis(max(target, (int32_t)0));
+}
+
+// Every play starts at the sample's own speed, see playSelectedFile(). A
+// note from RAM changes pitch, a paused one takes the speed on resume.
+void LiveScreen::changeSpeed(int encoderValue) {
+    _speedChanged = true;
+    if (currentState != LIVE_PLAYING && currentState != LIVE_PAUSED) return;
+    _semitones = constrain(_semitones + encoderValue, -MAX_SEMITONES,
+                           MAX_SEMITONES);
+    if (_note) {
+        _audioResources->sampler.setPitch(_note, speed());
+    } else {
+        _audioResources->playWav1.setSpeed(speed());
+    }
+}
+
+float LiveScreen::speed() { return powf(2.0f, _semitones / 12.0f); }
+
+bool LiveScreen::isSamplePlaying() {
+    return _audioResources->playWav1.isPlaying() ||
+           _audioResources->sampler.isPlaying();
+}
+
+// Reads missed samples into the cache a piece at a time, and the audio
+// around the scrub position once it's been moved away from what's in RAM
+void LiveScreen::continueLoading() {
+    _sampleCache.update();
+    _scrubber.update();
+}
+
 void LiveScreen::updatePlayback() {
     if (currentState != LIVE_PLAYING && currentState != LIVE_PAUSED) {
         return;
     }
     
     // Check if playback finished
-    if (currentState == LIVE_PLAYING && _audioResources && !_audioResources->playWav1.isPlaying()) {
+    if (currentState == LIVE_PLAYING && _audioResources && !isSamplePlaying()) {
         stopPlayback();
         return;
     }
@@ -218,13 +363,28 @@ void LiveScreen::updatePlayback() {
     _screen->drawStr(0, 8, currentState == LIVE_PLAYING ? "Playing:" : "Paused:");
     _screen->drawStr(0, 20, _currentPlayingFile.c_str());
     
-    // Show playback time
-    unsigned long elapsed = millis() - _playbackStartTime;
+    // Show playback time, streamed samples and notes know where they are
+    AudioPlaySdWavExtended &player = _audioResources->playWav1;
+    unsigned long elapsed;
+    if (_note) {
+        uint32_t frame = currentState == LIVE_PAUSED
+                             ? _pausedFrame
+                             : _audioResources->sampler.position(_note);
+        elapsed = (uint64_t)frame * 1000 / CACHED_SAMPLE_RATE;
+    } else {
+        elapsed = player.isStopped() ? millis() - _playbackStartTime
+                                     : player.positionMillis();
+    }
     int seconds = (elapsed / 1000) % 60;
     int minutes = (elapsed / 1000) / 60;
     
     String timeStr = String(minutes) + ":" + (seconds < 10 ? "0" : "") + String(seconds);
     _screen->drawStr(0, 35, timeStr.c_str());
+    if (_semitones != 0) {
+        String speedStr =
+            String(_semitones > 0 ? "+" : "") + String(_semitones) + " st";
+        _screen->drawStr(64, 35, speedStr.c_str());
+    }
     
     // Show USB audio info
     _screen->drawStr(0, 50, "USB Audio");
@@ -232,12 +392,31 @@ void LiveScreen::updatePlayback() {
     _screen->display();
 }
 
+void LiveScreen::visibleRange(int &startIndex, int &endIndex) {
+    startIndex = max(0, _selectedIndex - 2);
+    endIndex = min(_fileCount, startIndex + 3); // Reduced to fit with debug text
+}
+
+// Keeps the files on screen open and their headers parsed, so pressing
+// play doesn't wait for the card
+void LiveScreen::updateSamplePool() {
+    int startIndex, endIndex;
+    visibleRange(startIndex, endIndex);
+
+    String paths[SAMPLE_POOL_HANDLES];
+    int count = 0;
+    for (int i = startIndex; i < endIndex && count < SAMPLE_POOL_HANDLES; i++) {
+        paths[count++] = "/RECORDINGS/" + _fileList[i];
+    }
+    _samplePool.setPage(paths, count);
+}
+
 void LiveScreen::drawFileList() {
     if (_fileCount == 0) return;
     
     // Calculate which files to show (scrollable list)
-    int startIndex = max(0, _selectedIndex - 2);
-    int endIndex = min(_fileCount, startIndex + 3); // Reduced to fit with debug text
+    int startIndex, endIndex;
+    visibleRange(startIndex, endIndex);
     
     int yPos = 30; // Start below debug text
     for (int i = startIndex; i < endIndex; i++) {
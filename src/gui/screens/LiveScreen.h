@@ -6,6 +6,10 @@
 
 #include "../../hardware/Controls.h"
 #include "../../helper/AudioResources.h"
+#include "../../helper/SampleCache.hpp"
+#include "../../helper/SamplePool.hpp"
+#include "../../helper/Scrubber.hpp"
+#include "../../helper/WavFileWriter.hpp"
 #include "../../main.h"
 #include "../Screen.h"
 
@@ -21,6 +25,7 @@ class LiveScreen {
     void refresh();
     void setAudioResources(AudioResources* audioResources);
     void updatePlayback();
+    void continueLoading();
 
     enum LiveState {
         LIVE_HOME = 0,
@@ -42,10 +47,26 @@ class LiveScreen {
     String _fileList[20]; // Max 20 files
     String _currentPlayingFile = "";
     unsigned long _playbackStartTime = 0;
+    SamplePool _samplePool;
+    SampleCache _sampleCache;
+    Scrubber _scrubber;  // open while a sample is paused
+    uint32_t _note = 0;  // sampler note of a sample playing from RAM
+    uint32_t _pausedFrame = 0;  // where that note was paused
+    int _semitones = 0;  // varispeed of the sample playing
+    bool _speedChanged = false;  // while button 3 is held
     
     void loadFileList();
+    void visibleRange(int &startIndex, int &endIndex);
+    void updateSamplePool();
     void playSelectedFile();
     void stopPlayback();
+    void pausePlayback();
+    void resumePlayback();
+    bool restartNote(uint32_t frame);
+    void moveWithinSample(int encoderValue);
+    void changeSpeed(int encoderValue);
+    float speed();
+    bool isSamplePlaying();
     void drawFileList();
 };
 
@@ -2,9 +2,28 @@
 
 // Timer interval constants (in microseconds)
 static const long VOLUME_UPDATE_INTERVAL_US = 70000;     // ~14 Hz
-static const long WAVEFORM_UPDATE_INTERVAL_US = 500000;  // 2 Hz
+static const long WAVEFORM_UPDATE_INTERVAL_US = 100000;  // 10 Hz
 static const long DEFAULT_TICK_INTERVAL_US = 1000000;    // 1 Hz
 
+// Audio blocks per live waveform column (~50 ms at 44.1 kHz). The waveform
+// starts at this resolution and zooms out as the take grows.
+static const uint32_t LIVE_COLUMN_BLOCKS = 17;
+
+// Rate and channel layouts the encoder steps through on the home screen.
+// Lower rates are decimated on the way in and use less of the card.
+struct InputMode {
+    unsigned int sampleRate;
+    unsigned int channels;
+    const char* label;
+};
+static const InputMode INPUT_MODES[] = {
+    {44100, 1, "Input: mono 44.1k"},  {44100, 2, "Input: stereo 44.1k"},
+    {22050, 1, "Input: mono 22k"},    {22050, 2, "Input: stereo 22k"},
+    {11025, 1, "Input: mono 11k"},    {11025, 2, "Input: stereo 11k"},
+};
+static const int INPUT_MODE_COUNT =
+    sizeof(INPUT_MODES) / sizeof(INPUT_MODES[0]);
+
 RecorderScreen::RecorderScreen(Controls* keyboard, Screen* screen,
                                NavigationCallback navCallback) {
     _keyboard = keyboard;
@@ -37,24 +56,44 @@ long RecorderScreen::receiveTimerTick() {
 }
 
 void RecorderScreen::refresh() {
+    closeEditFile();
     currentState = RECORDER_HOME;
     _screen->clear();
     _screen->setHeaderFont();
     _screen->drawStr(0, 10, "RECORDER");
     _screen->setNormalFont();
     _screen->drawStr(0, 20, "Click to start");
+    _screen->drawStr(0, 30, _format == WavFileWriter::FORMAT_LOSSLESS
+                                ? "Format: lossless"
+                                : "Format: WAV");
+    const InputMode& mode = INPUT_MODES[_inputMode];
+    _screen->drawStr(0, 40, mode.label);
     _volumeBar.drawVolumeBar();
     _screen->display();
+
+    // Keep the last few seconds of input around, so a take includes what
+    // happened just before record was pressed
+    if (_wavWriter && _audioResources) {
+        _audioResources->setRecordChannels(mode.channels);
+        _audioResources->unmuteInput();
+        _wavWriter->arm(mode.sampleRate, mode.channels);
+    }
 }
 
 void RecorderScreen::setAudioResources(AudioResources* audioResources) {
     _audioResources = audioResources;
-    // Create WavFileWriter with the audio queue
-    _wavWriter = new WavFileWriter(_audioResources->queue1);
+    // The writer takes its audio from the record sink
+    _wavWriter = new WavFileWriter(_audioResources->recordSink);
+    _wavWriter->setDisplayResolution(LIVE_COLUMN_BLOCKS);
 }
 
 void RecorderScreen::handleEvent(Controls::ButtonEvent event) {
     if (event.buttonId == 1 && event.state == PRESSED) {
+        closeEditFile();
+        if (currentState == RECORDER_HOME && _wavWriter) {
+            _wavWriter->disarm();
+            _audioResources->muteInput();
+        }
         if (_navCallback) {
             _navCallback(AppContext::HOME);
             return;
@@ -67,24 +106,25 @@ void RecorderScreen::handleEvent(Controls::ButtonEvent event) {
         } else if (currentState == RECORDER_RECORDING) {
             stopRecording();
         } else if (currentState == RECORDER_EDITING) {
-            String path = getFilePath(_recordedFileName);
-            const int WAV_HEADER_SIZE = 44;
-            uint32_t startByte =
-                _waveformSelector.getSelectStart() * 2 + WAV_HEADER_SIZE;
-            uint32_t endByte =
-                _waveformSelector.getSelectEnd() * 2 + WAV_HEADER_SIZE;
-            _audioResources->playWav1.play(path.c_str(), startByte, endByte,
-                                           1.0);
-
-            // refresh();
+            auditionSelection();
         }
         return;
     }
 
     if (event.buttonId == 3 && event.state == PRESSED) {
-        if (!event.button1Held && !event.button2Held) {
+        // Button 2 + Button 3 = Audition direction
+        if (event.button2Held && !event.button1Held &&
+            currentState == RECORDER_EDITING) {
+            cycleAuditionDirection();
+        } else if (!event.button1Held && !event.button2Held) {
             if (currentState == RECORDER_EDITING) {
                 _waveformSelector.changeSide();
+            } else if (currentState == RECORDER_HOME) {
+                // Toggle the format used for the next take
+                _format = _format == WavFileWriter::FORMAT_LOSSLESS
+                              ? WavFileWriter::FORMAT_WAV
+                              : WavFileWriter::FORMAT_LOSSLESS;
+                refresh();
             }
         }
     }
@@ -104,6 +144,15 @@ void RecorderScreen::handleEvent(Controls::ButtonEvent event) {
                 _waveformSelector.updateSelection(event.encoderValue);
                 _waveformSelector.draw();
                 _screen->display();
+                scrubSelectionEdge();
+            } else if (currentState == RECORDER_HOME && _wavWriter) {
+                // Step through the input modes. The pre-roll is captured
+                // in one layout, so start it over.
+                _inputMode = (_inputMode + (event.encoderValue > 0 ? 1 : -1) +
+                              INPUT_MODE_COUNT) %
+                             INPUT_MODE_COUNT;
+                _wavWriter->disarm();
+                refresh();
             }
         }
     }
@@ -131,12 +180,66 @@ void RecorderScreen::showEditScreen() {
     _screen->drawStr(0, 10, _recordedFileName.c_str());
 
     _waveform.clear();
-    String path = getFilePath(_recordedFileName);
-    _waveform.loadWaveformFile(path.c_str(), 100);
+    {
+        // The player's refill may be running off the card meanwhile
+        SdCardLock cardLock;
+        String peakPath = PeakFileWriter::sidecarPath(_recordedPath);
+        if (!_waveform.loadPeakFile(peakPath.c_str(), 100)) {
+            // No usable sidecar, scan the audio itself
+            _waveform.loadWaveformFile(_recordedPath.c_str(), 100);
+        }
+    }
     _waveform.drawCachedWaveform(0, 0);
     _waveformSelector = WaveformSelector(&_waveform);
     _waveformSelector.draw();
     _screen->display();
+
+    // Stays open for auditioning, so a press doesn't go through the header
+    {
+        SdCardLock cardLock;
+        _editFile = SD.open(_recordedPath.c_str());
+        if (_editFile &&
+            !AudioPlaySdWavExtended::readInfo(_editFile, _editInfo)) {
+            _editFile = File();
+        }
+    }
+    _scrubber.open(_audioResources->sampler, _recordedPath);
+}
+
+// Loops the selection, a second press stops it
+void RecorderScreen::auditionSelection() {
+    AudioPlaySdWavExtended& player = _audioResources->playWav1;
+    if (player.isLooping()) {
+        player.stop();
+        return;
+    }
+    if (!_editFile) return;
+    player.setDirection(_auditionDirection);
+    if (!player.playRegion(_editFile, _editInfo,
+                           _waveformSelector.getSelectStart(),
+                           _waveformSelector.getSelectEnd(), true, 1.0) &&
+        _editInfo.lossless) {
+        Serial.println("Lossless takes only play forwards");
+    }
+}
+
+// Forwards, backwards, ping-pong, and the selection loops in the new
+// direction straight away
+void RecorderScreen::cycleAuditionDirection() {
+    _auditionDirection = (AudioPlaySdWavExtended::Direction)(
+        (_auditionDirection + 1) % 3);
+    _audioResources->playWav1.stop();
+    auditionSelection();
+}
+
+void RecorderScreen::closeEditFile() {
+    _scrubber.close();
+    if (!_editFile) return;
+    _audioResources->playWav1.stop();
+    // The player's refill may still hold a copy of the handle, it drops
+    // it in its own interrupt, which the card lock keeps out
+    SdCardLock cardLock;
+    _editFile = File();
 }
 
 void RecorderScreen::startRecording() {
@@ -145,21 +248,33 @@ void RecorderScreen::startRecording() {
         return;
     }
 
+    const InputMode& mode = INPUT_MODES[_inputMode];
+    _audioResources->setRecordChannels(mode.channels);
     _audioResources->unmuteInput();
 
     _recordedFileName = "";
 
-    // Create RECORDINGS folder if it doesn't exist
-    if (!SD.exists("/RECORDINGS")) {
-        SD.mkdir("/RECORDINGS");
+    // Create RECORDINGS folder if it doesn't exist. The player may be
+    // reading the card from its interrupt.
+    {
+        SdCardLock cardLock;
+        if (!SD.exists("/RECORDINGS")) {
+            SD.mkdir("/RECORDINGS");
+        }
     }
 
     String name = gen.generateAudioFilename();
 
-    // Start WAV recording
-    String path = getFilePath(name);
-    if (_wavWriter->open(path.c_str(), 44100, 1)) {
+    // Start recording in the selected format
+    String path = getFilePath(name, WavFileWriter::fileExtension(_format));
+    _wavWriter->setFormat(_format);
+    // Keep the live columns about as long whatever the rate and layout
+    uint32_t decimation = 44100 / mode.sampleRate;
+    _wavWriter->setDisplayResolution(
+        max(LIVE_COLUMN_BLOCKS * mode.channels / decimation, (uint32_t)1));
+    if (_wavWriter->open(path.c_str(), mode.sampleRate, mode.channels)) {
         _recordedFileName = name;
+        _recordedPath = path;
         _recordingStartTime = millis();
     }
 }
@@ -169,19 +284,19 @@ void RecorderScreen::updateWaveform() {
         return;
     }
 
-    size_t sampleCount;
-    const int16_t* samples = _wavWriter->getAccumulatedBuffer(sampleCount);
-
-    if (sampleCount > 0) {
-        // Add all accumulated audio data to waveform
-        _waveform.addAudioData(samples, sampleCount);
-
-        // Clear the accumulated buffer for next update cycle
-        _wavWriter->clearAccumulatedBuffer();
+    // Pick up every column the writer has finished since the last tick
+    bool added = false;
+    PeakColumn column;
+    while (_wavWriter->readDisplayColumn(column)) {
+        _waveform.addColumn(column.min, column.max);
+        added = true;
+    }
 
-        // Draw the updated waveform
-        _waveform.drawWaveform();
-        _screen->display();
+    if (added) {
+        // Only the newly added bars are drawn and sent to the display,
+        // unless the view just zoomed out
+        _waveform.drawNewColumns();
+        _waveform.displayChanges();
     }
 }
 
@@ -190,10 +305,26 @@ void RecorderScreen::continueRecording() {
     if (!_wavWriter || !_wavWriter->isWriting()) {
         return;
     }
-    // Update the WAV file
+    // The writer normally runs off the audio interrupt, this only does
+    // work when it's built for polling
     _wavWriter->update();
+
+    // The pre-allocated extent is used up, end the take
+    if (_wavWriter->isFull()) stopRecording();
 }
 
+// Moving a selection edge plays a snippet from there, unless the selection
+// is looping anyway
+void RecorderScreen::scrubSelectionEdge() {
+    if (_audioResources->playWav1.isLooping()) return;
+    _scrubber.scrubTo(_waveformSelector.isSelectingLeft()
+                          ? _waveformSelector.getSelectStart()
+                          : _waveformSelector.getSelectEnd());
+}
+
+// Reads the audio around the edge once it has moved out of what's in RAM
+void RecorderScreen::continueScrubbing() { _scrubber.update(); }
+
 void RecorderScreen::stopRecording() {
     if (!_wavWriter || !_wavWriter->isWriting()) {
         return;
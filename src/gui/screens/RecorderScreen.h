@@ -7,6 +7,7 @@
 #include "../../hardware/Controls.h"
 #include "../../helper/AudioResources.h"
 #include "../../helper/NameGenerator.hpp"
+#include "../../helper/Scrubber.hpp"
 #include "../../helper/WavFileWriter.hpp"
 #include "../../main.h"
 #include "../Screen.h"
@@ -33,8 +34,13 @@ class RecorderScreen {
 
     void startRecording();
     void continueRecording();
+    void continueScrubbing();
     void stopRecording();
     void updateVolumeBar();
+    void auditionSelection();
+    void cycleAuditionDirection();
+    void closeEditFile();
+    void scrubSelectionEdge();
 
     enum RecorderState {
         RECORDER_HOME = 0,
@@ -42,8 +48,9 @@ class RecorderScreen {
         RECORDER_EDITING = 2
     };
 
-    static String getFilePath(const String& fileName) {
-        return "/RECORDINGS/" + fileName + ".wav";
+    static String getFilePath(const String& fileName,
+                              const char* extension = ".wav") {
+        return "/RECORDINGS/" + fileName + extension;
     }
 
     RecorderState currentState = RECORDER_HOME;
@@ -61,6 +68,14 @@ class RecorderScreen {
     WavFileWriter* _wavWriter;
     unsigned long _recordingStartTime = 0;
     String _recordedFileName;
+    String _recordedPath;
+    File _editFile;  // the take being edited, open while on the edit screen
+    AudioSampleInfo _editInfo;
+    Scrubber _scrubber;
+    AudioPlaySdWavExtended::Direction _auditionDirection =
+        AudioPlaySdWavExtended::FORWARD;
+    WavFileWriter::Format _format = WavFileWriter::FORMAT_WAV;
+    int _inputMode = 0;  // index into the rate/channel table
     NameGenerator gen;
 };
 
@@ -1,5 +1,8 @@
 #include "Waveform.h"
 
+#include "../../../../helper/LosslessCodec.hpp"
+#include "../../../../helper/PeakFileWriter.hpp"
+
 Waveform::Waveform() : _screen(nullptr) { clear(); }
 
 Waveform::Waveform(Screen* screen) : _screen(screen) { clear(); }
@@ -23,6 +26,19 @@ void Waveform::freeCacheMemory() {
     _cacheSize = 0;
 }
 
+bool Waveform::allocateCache(int cacheSize) {
+    _cacheSize = cacheSize;
+    _minCache = new int16_t[_cacheSize];
+    _maxCache = new int16_t[_cacheSize];
+
+    if (!_minCache || !_maxCache) {
+        Serial.println("Failed to allocate cache memory");
+        freeCacheMemory();
+        return false;
+    }
+    return true;
+}
+
 void Waveform::drawWaveformFrame() {
     if (!_screen) return;
 
@@ -63,6 +79,26 @@ void Waveform::drawWaveformBar(int x, int16_t minSample, int16_t maxSample,
     display->drawLine(_x + 1 + x, yMin, _x + 1 + x, yMax);
 }
 
+// Walks the RIFF chunk list and leaves the file positioned at the first
+// audio byte. Returns the size of the data chunk, or 0 if there is none.
+// The channel count is taken from the fmt chunk on the way.
+static uint32_t seekToDataChunk(File& file, uint16_t& channels) {
+    uint8_t chunk[8];
+    uint32_t position = 12;  // skip "RIFF" <size> "WAVE"
+
+    while (file.seek(position) && file.read(chunk, 8) == 8) {
+        uint32_t chunkSize = chunk[4] | (chunk[5] << 8) | (chunk[6] << 16) |
+                             ((uint32_t)chunk[7] << 24);
+        if (memcmp(chunk, "data", 4) == 0) return chunkSize;
+        if (memcmp(chunk, "fmt ", 4) == 0 && chunkSize >= 4 &&
+            file.read(chunk, 4) == 4) {
+            channels = chunk[2] | (chunk[3] << 8);
+        }
+        position += 8 + chunkSize + (chunkSize & 1);
+    }
+    return 0;
+}
+
 bool Waveform::loadWaveformFile(const char* fileName, int maxMemoryKB) {
     // Free existing cache
     freeCacheMemory();
@@ -74,8 +110,30 @@ bool Waveform::loadWaveformFile(const char* fileName, int maxMemoryKB) {
         return false;
     }
 
-    const int WAV_HEADER_SIZE = 44;
-    _totalSamples = (wavFile.size() - WAV_HEADER_SIZE) / sizeof(int16_t);
+    // Lossless takes are decoded on the fly
+    LosslessDecoder decoder;
+    LosslessHeader header;
+    bool compressed =
+        wavFile.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+        LosslessCodec::isHeader((const uint8_t*)&header);
+
+    uint32_t dataSize, dataOffset;
+    uint16_t channels = 1;
+    if (compressed) {
+        channels = header.channels;
+        dataSize = header.totalFrames * header.channels * sizeof(int16_t);
+        dataOffset = LosslessCodec::HEADER_BYTES;
+        decoder.begin(header.channels, header.dataBytes);
+    } else {
+        // Recordings have a 512 byte header, older takes and imported files
+        // don't, so look the data chunk up instead of assuming its offset.
+        dataSize = seekToDataChunk(wavFile, channels);
+        dataOffset = wavFile.position();
+    }
+
+    // Positions are in frames, a stereo bar covers both channels
+    _channels = channels == 2 ? 2 : 1;
+    _totalSamples = dataSize / (_channels * sizeof(int16_t));
 
     if (_totalSamples == 0) {
         wavFile.close();
@@ -87,24 +145,20 @@ bool Waveform::loadWaveformFile(const char* fileName, int maxMemoryKB) {
     int maxCachePoints = (maxMemoryKB * 1024) / 4;
 
     // Determine cache size and downsampling ratio
+    int cacheSize;
     if (_totalSamples <= maxCachePoints) {
         // Can store all samples
-        _cacheSize = _totalSamples;
+        cacheSize = _totalSamples;
         _samplesPerCachePoint = 1;
     } else {
         // Need to downsample
-        _cacheSize = maxCachePoints;
+        cacheSize = maxCachePoints;
         _samplesPerCachePoint =
             (_totalSamples + maxCachePoints - 1) / maxCachePoints;
     }
 
     // Allocate cache memory
-    _minCache = new int16_t[_cacheSize];
-    _maxCache = new int16_t[_cacheSize];
-
-    if (!_minCache || !_maxCache) {
-        Serial.println("Failed to allocate cache memory");
-        freeCacheMemory();
+    if (!allocateCache(cacheSize)) {
         wavFile.close();
         return false;
     }
@@ -117,12 +171,12 @@ bool Waveform::loadWaveformFile(const char* fileName, int maxMemoryKB) {
     const int READ_BUFFER_SIZE = 512;  // Read in chunks for efficiency
     int16_t readBuffer[READ_BUFFER_SIZE];
 
-    wavFile.seek(WAV_HEADER_SIZE);
+    wavFile.seek(dataOffset);
 
     for (int cacheIdx = 0; cacheIdx < _cacheSize; cacheIdx++) {
         int sampleStart = cacheIdx * _samplesPerCachePoint;
         int sampleEnd = min(sampleStart + _samplesPerCachePoint, _totalSamples);
-        int samplesToRead = sampleEnd - sampleStart;
+        int samplesToRead = (sampleEnd - sampleStart) * _channels;
 
         int16_t minVal = 32767;
         int16_t maxVal = -32768;
@@ -131,9 +185,13 @@ bool Waveform::loadWaveformFile(const char* fileName, int maxMemoryKB) {
         int samplesRead = 0;
         while (samplesRead < samplesToRead) {
             int chunkSize = min(READ_BUFFER_SIZE, samplesToRead - samplesRead);
+            size_t chunkBytes = chunkSize * sizeof(int16_t);
             int bytesRead =
-                wavFile.read((uint8_t*)readBuffer, chunkSize * sizeof(int16_t));
+                compressed
+                    ? decoder.read(wavFile, (uint8_t*)readBuffer, chunkBytes)
+                    : wavFile.read((uint8_t*)readBuffer, chunkBytes);
             int actualSamples = bytesRead / sizeof(int16_t);
+            if (actualSamples <= 0) break;  // file shorter than its header says
 
             // Find min/max in this chunk
             for (int i = 0; i < actualSamples; i++) {
@@ -155,6 +213,79 @@ bool Waveform::loadWaveformFile(const char* fileName, int maxMemoryKB) {
 
     return true;
 }
+bool Waveform::loadPeakFile(const char* fileName, int maxMemoryKB) {
+    freeCacheMemory();
+
+    File peakFile = SD.open(fileName);
+    if (!peakFile) return false;
+
+    // The footer says where each level lives. A take that was cut off
+    // mid-recording has no valid footer and is rejected here.
+    PeakFileFooter footer;
+    uint32_t fileSize = peakFile.size();
+    if (fileSize < sizeof(footer) || !peakFile.seek(fileSize - sizeof(footer)) ||
+        peakFile.read(&footer, sizeof(footer)) != sizeof(footer) ||
+        memcmp(footer.magic, "NMPK", 4) != 0 ||
+        footer.version != PeakFileWriter::VERSION ||
+        (footer.channels != 1 && footer.channels != 2) ||
+        (footer.peakCount + footer.overviewCount) * 4 * footer.channels +
+                sizeof(footer) !=
+            fileSize) {
+        peakFile.close();
+        return false;
+    }
+
+    // Use level 0 when it fits the budget, otherwise the overview. Either
+    // way at most maxMemoryKB is read, however long the take is.
+    int maxCachePoints = (maxMemoryKB * 1024) / 4;
+    uint32_t offset, count, samplesPerPeak;
+    if (footer.peakCount <= (uint32_t)maxCachePoints) {
+        offset = 0;
+        count = footer.peakCount;
+        samplesPerPeak = footer.samplesPerPeak;
+    } else {
+        offset = footer.peakCount * 4 * footer.channels;
+        count = min(footer.overviewCount, (uint32_t)maxCachePoints);
+        samplesPerPeak = footer.overviewSamplesPerPeak;
+    }
+
+    if (count == 0 || !allocateCache(count)) {
+        peakFile.close();
+        return false;
+    }
+    _channels = footer.channels;
+    _totalSamples = footer.totalSamples;
+    _samplesPerCachePoint = samplesPerPeak;
+
+    // Stereo peaks are merged into one envelope covering both channels
+    const int READ_PAIRS = 128;
+    int16_t readBuffer[READ_PAIRS * 2];
+    const int peaksPerRead = READ_PAIRS / _channels;
+    peakFile.seek(offset);
+    for (uint32_t i = 0; i < count;) {
+        int peaks = min((uint32_t)peaksPerRead, count - i);
+        int bytes = peaks * 4 * _channels;
+        if (peakFile.read(readBuffer, bytes) != bytes) break;
+        for (int j = 0; j < peaks; j++, i++) {
+            const int16_t* peak = readBuffer + j * 2 * _channels;
+            int16_t minVal = peak[0];
+            int16_t maxVal = peak[1];
+            if (_channels == 2) {
+                minVal = min(minVal, peak[2]);
+                maxVal = max(maxVal, peak[3]);
+            }
+            _minCache[i] = minVal;
+            _maxCache[i] = maxVal;
+        }
+    }
+
+    peakFile.close();
+
+    Serial.printf("Loaded peaks: %d points (ratio: %d:1)\n", _cacheSize,
+                  _samplesPerCachePoint);
+    return true;
+}
+
 void Waveform::drawCachedWaveform(int startSample, int endSample) {
     if (!_screen || !_minCache || !_maxCache) return;
 
@@ -245,30 +376,53 @@ void Waveform::clear() {
         _liveMaxData[i] = 0;
     }
     _writeIndex = 0;
+    _drawnIndex = 0;
+    _liveStride = 1;
+    _pendingColumns = 0;
+    _needsFullRedraw = true;
+    _dirtyX = 0;
+    _dirtyWidth = 0;
 }
 
-void Waveform::addAudioData(const int16_t* audioBuffer, int bufferSize) {
-    if (!audioBuffer || bufferSize == 0) return;
-
-    int displayWidth = _width - 2;  // Account for border
-
-    // Only add data if we haven't filled the display yet
-    if (_writeIndex >= displayWidth) return;
-
-    // Find min and max values from the entire buffer
-    int16_t minVal = 32767;
-    int16_t maxVal = -32768;
+int Waveform::liveWidth() const {
+    return min(_width - 2, MAX_WAVEFORM_POINTS);  // Account for border
+}
 
-    for (int i = 0; i < bufferSize; i++) {
-        int16_t sample = audioBuffer[i];
-        if (sample < minVal) minVal = sample;
-        if (sample > maxVal) maxVal = sample;
+void Waveform::addColumn(int16_t minSample, int16_t maxSample) {
+    // Several incoming columns make up one bar once the view has zoomed out
+    if (_pendingColumns == 0) {
+        _pendingMin = minSample;
+        _pendingMax = maxSample;
+    } else {
+        if (minSample < _pendingMin) _pendingMin = minSample;
+        if (maxSample > _pendingMax) _pendingMax = maxSample;
     }
+    if (++_pendingColumns < _liveStride) return;
+    _pendingColumns = 0;
 
     // Store min/max values at current write position
-    _liveMinData[_writeIndex] = minVal;
-    _liveMaxData[_writeIndex] = maxVal;
+    _liveMinData[_writeIndex] = _pendingMin;
+    _liveMaxData[_writeIndex] = _pendingMax;
     _writeIndex++;
+
+    if (_writeIndex < liveWidth()) return;
+
+    // Display is full: halve the timeline so the take keeps fitting on
+    // screen, however long it runs.
+    int half = _writeIndex / 2;
+    for (int i = 0; i < half; i++) {
+        _liveMinData[i] = min(_liveMinData[i * 2], _liveMinData[i * 2 + 1]);
+        _liveMaxData[i] = max(_liveMaxData[i * 2], _liveMaxData[i * 2 + 1]);
+    }
+    if (_writeIndex & 1) {
+        // Odd width: the last bar starts the next pair
+        _pendingMin = _liveMinData[_writeIndex - 1];
+        _pendingMax = _liveMaxData[_writeIndex - 1];
+        _pendingColumns = _liveStride;
+    }
+    _writeIndex = half;
+    _liveStride *= 2;
+    _needsFullRedraw = true;
 }
 
 void Waveform::drawSelection(int selectStart, int selectEnd, int startSample,
@@ -312,27 +466,69 @@ void Waveform::drawSelection(int selectStart, int selectEnd, int startSample,
 void Waveform::drawWaveform() {
     if (!_screen) return;
 
-    int displayWidth = _width - 2;
-
     // Draw frame, border, and center line using shared helper
     drawWaveformFrame();
 
-    // Amplification gain for live recording (same as cached waveform)
-    float amplificationGain = 3.0;
-
     // Draw waveform data using the same rendering logic as cached waveform
-    for (int i = 0; i < displayWidth && i < MAX_WAVEFORM_POINTS; i++) {
-        int16_t minSample = _liveMinData[i];
-        int16_t maxSample = _liveMaxData[i];
+    for (int i = 0; i < _writeIndex; i++) {
+        drawWaveformBar(i, _liveMinData[i], _liveMaxData[i],
+                        LIVE_AMPLIFICATION_GAIN);
+    }
 
-        // Draw the waveform bar using shared helper
-        drawWaveformBar(i, minSample, maxSample, amplificationGain);
+    drawWriteIndicator();
+
+    _drawnIndex = _writeIndex;
+    _needsFullRedraw = false;
+    _dirtyX = _x;
+    _dirtyWidth = _width;
+}
+
+void Waveform::drawNewColumns() {
+    if (!_screen) return;
+
+    // After a rezoom every bar has moved
+    if (_needsFullRedraw) {
+        drawWaveform();
+        return;
+    }
+
+    _dirtyWidth = 0;
+    if (_drawnIndex == _writeIndex) return;
+
+    auto* display = _screen->getDisplay();
+    int centerY = _y + (_height / 2);
+
+    for (int i = _drawnIndex; i < _writeIndex; i++) {
+        // Wipe the column (including the old indicator line) back to the
+        // empty background before drawing the bar into it
+        int columnX = _x + 1 + i;
+        display->setDrawColor(0);
+        display->drawVLine(columnX, _y + 1, _height - 2);
+        display->setDrawColor(1);
+        display->drawPixel(columnX, centerY);
+
+        drawWaveformBar(i, _liveMinData[i], _liveMaxData[i],
+                        LIVE_AMPLIFICATION_GAIN);
     }
 
+    drawWriteIndicator();
+
+    _dirtyX = _x + 1 + _drawnIndex;
+    _dirtyWidth = _writeIndex - _drawnIndex + 1;  // plus the indicator
+    _drawnIndex = _writeIndex;
+}
+
+void Waveform::displayChanges() {
+    if (!_screen || _dirtyWidth == 0) return;
+    _screen->displayArea(_dirtyX, _y, _dirtyWidth, _height);
+    _dirtyWidth = 0;
+}
+
+void Waveform::drawWriteIndicator() {
     // Draw current write index indicator line
-    if (_writeIndex < displayWidth) {
+    if (_writeIndex < liveWidth()) {
         auto* display = _screen->getDisplay();
         int indicatorX = _x + 1 + _writeIndex;
         display->drawVLine(indicatorX, _y + 1, _height - 2);
     }
-}
\ No newline at end of file
+}
@@ -16,36 +16,60 @@ class Waveform {
     void setPosition(int x, int y);
     void setSize(int width, int height);
     void clear();
-    void addAudioData(const int16_t* audioBuffer, int bufferSize);
+    void addColumn(int16_t minSample, int16_t maxSample);
 
     bool loadWaveformFile(const char* fileName, int maxMemoryKB = 100);
+    bool loadPeakFile(const char* fileName, int maxMemoryKB = 100);
     void drawCachedWaveform(int startSample, int endSample = 0);
 
     void drawSelection(int selectStart, int selectEnd, int startSample,
                        int endSample);
     void drawWaveform();
+    void drawNewColumns();
+    void displayChanges();
+    // Sample positions are in frames, whatever the channel count
     int getTotalSamples() const { return _totalSamples; }
+    int getChannels() const { return _channels; }
 
    private:
     Screen* _screen;
     int _x = 0, _y = 0;
     int _width = 128, _height = 47;
     int _totalSamples = 0;
+    int _channels = 1;
 
     int16_t* _minCache = nullptr;
     int16_t* _maxCache = nullptr;
     int _cacheSize = 0;
     int _samplesPerCachePoint = 1;
 
+    bool allocateCache(int cacheSize);
     void freeCacheMemory();
     void drawWaveformFrame();
     void drawWaveformBar(int x, int16_t minSample, int16_t maxSample,
                          float amplificationGain);
 
+    // Amplification gain for live recording (same as cached waveform)
+    static constexpr float LIVE_AMPLIFICATION_GAIN = 3.0f;
+
+    int liveWidth() const;
+    void drawWriteIndicator();
+
     // Live recording waveform data (min/max pairs)
     int16_t _liveMinData[MAX_WAVEFORM_POINTS];
     int16_t _liveMaxData[MAX_WAVEFORM_POINTS];
     int _writeIndex = 0;
+    int _drawnIndex = 0;  // bars already on screen
+
+    // Incoming columns per bar, doubles every time the display fills up
+    uint32_t _liveStride = 1;
+    uint32_t _pendingColumns = 0;
+    int16_t _pendingMin = 0;
+    int16_t _pendingMax = 0;
+
+    bool _needsFullRedraw = true;
+    int _dirtyX = 0;
+    int _dirtyWidth = 0;
 };
 
 #endif
\ No newline at end of file
@@ -112,6 +112,7 @@ class WaveformSelector {
     }
 
     void changeSide() { selectingLeft = !selectingLeft; }
+    bool isSelectingLeft() const { return selectingLeft; }
 
     void draw() {
         if (!_waveform) return;
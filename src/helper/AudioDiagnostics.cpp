@@ -0,0 +1,84 @@
+#include "AudioDiagnostics.h"
+
+#include <Audio.h>
+
+AudioDiagnostics audioDiagnostics;
+
+AudioDiagnostics::AudioDiagnostics() { clearCounters(); }
+
+void AudioDiagnostics::reset() {
+    clearCounters();
+    AudioProcessorUsageMaxReset();
+    AudioMemoryUsageMaxReset();
+}
+
+void AudioDiagnostics::clearCounters() {
+    _queueOverruns = 0;
+    _ringHighWater = 0;
+    _blocksDropped = 0;
+    _sdWriteCount = 0;
+    _sdWriteMaxMicros = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) _sdWriteHistogram[i] = 0;
+    _playerUnderruns = 0;
+    _playerCommandsDropped = 0;
+    _resamplerMaxCycles = 0;
+    _samplerMaxCycles = 0;
+    _sampleCacheHits = 0;
+    _sampleCacheMisses = 0;
+}
+
+void AudioDiagnostics::recordRingDepth(uint32_t blocks) {
+    if (blocks > _ringHighWater) _ringHighWater = blocks;
+}
+
+void AudioDiagnostics::recordSdWrite(uint32_t micros) {
+    _sdWriteCount++;
+    if (micros > _sdWriteMaxMicros) _sdWriteMaxMicros = micros;
+
+    int bucket = 0;
+    uint32_t limit = FIRST_BUCKET_US;
+    while (bucket < LATENCY_BUCKETS - 1 && micros >= limit) {
+        bucket++;
+        limit *= 2;
+    }
+    _sdWriteHistogram[bucket]++;
+}
+
+uint32_t AudioDiagnostics::bucketLimitMicros(int bucket) {
+    if (bucket >= LATENCY_BUCKETS - 1) return 0;
+    return FIRST_BUCKET_US << bucket;
+}
+
+void AudioDiagnostics::printTo(Print& out) {
+    out.printf("Audio CPU: %.1f%% (max %.1f%%)\n", AudioProcessorUsage(),
+               AudioProcessorUsageMax());
+    out.printf("Audio memory: %u blocks (max %u)\n",
+               (unsigned)AudioMemoryUsage(), (unsigned)AudioMemoryUsageMax());
+    out.printf("Record sink overruns: %lu updates\n",
+               (unsigned long)_queueOverruns);
+    out.printf("Record ring: high-water %lu slots, dropped %lu slots\n",
+               (unsigned long)_ringHighWater, (unsigned long)_blocksDropped);
+    out.printf("SD writes: %lu, worst %lu us\n", (unsigned long)_sdWriteCount,
+               (unsigned long)_sdWriteMaxMicros);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        uint32_t limit = bucketLimitMicros(i);
+        if (limit > 0) {
+            out.printf("  < %6lu us: %lu\n", (unsigned long)limit,
+                       (unsigned long)_sdWriteHistogram[i]);
+        } else {
+            out.printf("  >=%6lu us: %lu\n",
+                       (unsigned long)bucketLimitMicros(i - 1),
+                       (unsigned long)_sdWriteHistogram[i]);
+        }
+    }
+    out.printf("Player underruns: %lu\n", (unsigned long)_playerUnderruns);
+    out.printf("Player commands dropped: %lu\n",
+               (unsigned long)_playerCommandsDropped);
+    out.printf("Resampler: worst %lu cycles/block\n",
+               (unsigned long)_resamplerMaxCycles);
+    out.printf("Sampler: worst %lu cycles/block\n",
+               (unsigned long)_samplerMaxCycles);
+    out.printf("Sample cache: %lu hits, %lu misses\n",
+               (unsigned long)_sampleCacheHits,
+               (unsigned long)_sampleCacheMisses);
+}
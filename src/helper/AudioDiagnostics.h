@@ -0,0 +1,78 @@
+#ifndef AudioDiagnostics_h
+#define AudioDiagnostics_h
+
+#include <Arduino.h>
+
+// Always-on health counters for the recording and playback pipelines. They
+// are bumped from the audio ISR and the recorder alike and only ever read
+// as a snapshot, so plain volatile words are enough.
+class AudioDiagnostics {
+   public:
+    // SD write latency buckets: <250us, <500us, <1ms, ... <256ms, >=256ms
+    static const int LATENCY_BUCKETS = 12;
+    static const uint32_t FIRST_BUCKET_US = 250;
+
+    AudioDiagnostics();
+
+    void reset();
+
+    // One audio update the record sink had no room for
+    void recordQueueOverrun() { _queueOverruns++; }
+    // Ring depth and drops are in ring slots of AUDIO_BLOCK_SAMPLES samples
+    void recordRingDepth(uint32_t blocks);
+    void recordDroppedBlocks(uint32_t blocks) { _blocksDropped += blocks; }
+    void recordSdWrite(uint32_t micros);
+    void recordPlayerUnderrun() { _playerUnderruns++; }
+    // A player control call that found the command ring full
+    void recordPlayerCommandDropped() { _playerCommandsDropped++; }
+    void recordResamplerBlock(uint32_t cycles) {
+        if (cycles > _resamplerMaxCycles) _resamplerMaxCycles = cycles;
+    }
+    void recordSamplerBlock(uint32_t cycles) {
+        if (cycles > _samplerMaxCycles) _samplerMaxCycles = cycles;
+    }
+    void recordSampleCacheHit() { _sampleCacheHits++; }
+    void recordSampleCacheMiss() { _sampleCacheMisses++; }
+
+    uint32_t getQueueOverruns() const { return _queueOverruns; }
+    uint32_t getRingHighWater() const { return _ringHighWater; }
+    uint32_t getBlocksDropped() const { return _blocksDropped; }
+    uint32_t getSdWriteCount() const { return _sdWriteCount; }
+    uint32_t getSdWriteMaxMicros() const { return _sdWriteMaxMicros; }
+    uint32_t getSdWriteBucket(int bucket) const {
+        return _sdWriteHistogram[bucket];
+    }
+    uint32_t getPlayerUnderruns() const { return _playerUnderruns; }
+    uint32_t getPlayerCommandsDropped() const {
+        return _playerCommandsDropped;
+    }
+    uint32_t getResamplerMaxCycles() const { return _resamplerMaxCycles; }
+    uint32_t getSamplerMaxCycles() const { return _samplerMaxCycles; }
+    uint32_t getSampleCacheHits() const { return _sampleCacheHits; }
+    uint32_t getSampleCacheMisses() const { return _sampleCacheMisses; }
+
+    // Upper bound of a latency bucket in microseconds (0 = unbounded)
+    static uint32_t bucketLimitMicros(int bucket);
+
+    void printTo(Print& out);
+
+   private:
+    void clearCounters();
+
+    volatile uint32_t _queueOverruns;
+    volatile uint32_t _ringHighWater;
+    volatile uint32_t _blocksDropped;
+    volatile uint32_t _sdWriteCount;
+    volatile uint32_t _sdWriteMaxMicros;
+    volatile uint32_t _sdWriteHistogram[LATENCY_BUCKETS];
+    volatile uint32_t _playerUnderruns;
+    volatile uint32_t _playerCommandsDropped;
+    volatile uint32_t _resamplerMaxCycles;  // per output block
+    volatile uint32_t _samplerMaxCycles;  // per output block
+    volatile uint32_t _sampleCacheHits;
+    volatile uint32_t _sampleCacheMisses;
+};
+
+extern AudioDiagnostics audioDiagnostics;
+
+#endif
@@ -5,7 +5,7 @@
 #include <Audio.h>
 
 AudioResources::AudioResources()
-    : patchCord1(audioInput, 0, queue1, 0),
+    : patchCord1(recordRightMixer, 0, recordSink, 1),
       patchCord2(audioInput, 0, peak1, 0),
       patchCord3(audioInput, 1, peak2, 0),
       patchCord4(playWav1, 0, mixer1, 0),
@@ -16,8 +16,10 @@ AudioResources::AudioResources()
       patchCord8(audioInput, 0, recordInputMixer, 0),
       patchCord9(audioInput, 1, recordInputMixer, 1),
       patchCord10(recordInputMixer, 0, recordMixer, 0),
-      patchCord11(recordMixer, 0, queue1, 0),
-      patchCord12(recordMixer, 0, peak1, 0) {}
+      patchCord11(recordMixer, 0, recordSink, 0),
+      patchCord12(recordMixer, 0, peak1, 0),
+      patchCord13(audioInput, 1, recordRightMixer, 0),
+      patchCord14(sampler, 0, mixer1, 2) {}
 
 AudioResources::~AudioResources() {
     // Destructor - no cleanup needed for member objects
@@ -26,11 +28,19 @@ AudioResources::~AudioResources() {
 void AudioResources::muteInput() {
     recordInputMixer.gain(0, 0.0);
     recordInputMixer.gain(1, 0.0);
+    recordRightMixer.gain(0, 0.0);
     mixer1.gain(1, 0.0);
 };
 
 void AudioResources::unmuteInput() {
-    recordInputMixer.gain(0, 0.6);
-    recordInputMixer.gain(1, 0.6);
+    if (_recordChannels == 2) {
+        recordInputMixer.gain(0, 1.0);
+        recordInputMixer.gain(1, 0.0);
+        recordRightMixer.gain(0, 1.0);
+    } else {
+        recordInputMixer.gain(0, 0.6);
+        recordInputMixer.gain(1, 0.6);
+        recordRightMixer.gain(0, 0.0);
+    }
     mixer1.gain(1, 0.6);
 };
@@ -6,6 +6,8 @@
 
 #include "SD.h"
 #include "audio-extensions/play_sd_wav_extended.h"
+#include "audio-extensions/record_sink.h"
+#include "audio-extensions/sampler_voices.h"
 
 class AudioResources {
    public:
@@ -14,6 +16,9 @@ class AudioResources {
 
     void muteInput();
     void unmuteInput();
+    // Mono records both inputs summed, stereo keeps them apart. Takes
+    // effect on the next unmuteInput().
+    void setRecordChannels(int channels) { _recordChannels = channels; }
 
     AudioInputI2S audioInput;
     AudioOutputUSB audioOutput;
@@ -21,12 +26,14 @@ class AudioResources {
     AudioAnalyzePeak peak1;
     AudioAnalyzePeak peak2;
     AudioPlaySdWavExtended playWav1;
+    AudioSamplerVoices sampler;  // samples cached in RAM, polyphonic
 
     AudioMixer4 mixer1;
 
-    AudioRecordQueue queue1;
+    AudioRecordSink recordSink;
     AudioMixer4 recordMixer;
-    AudioMixer4 recordInputMixer;
+    AudioMixer4 recordInputMixer;  // mono sum, or the left channel
+    AudioMixer4 recordRightMixer;  // right channel of a stereo take
     // Audio connections
     AudioConnection patchCord1;
     AudioConnection patchCord2;
@@ -40,6 +47,11 @@ class AudioResources {
     AudioConnection patchCord10;
     AudioConnection patchCord11;
     AudioConnection patchCord12;
+    AudioConnection patchCord13;
+    AudioConnection patchCord14;
+
+   private:
+    int _recordChannels = 1;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,316 @@
+#include "LosslessCodec.hpp"
+
+static_assert(sizeof(LosslessHeader) == 24, "Header layout changed");
+
+namespace {
+
+// MSB-first bit packer. Stops writing once `end` is reached so a badly
+// predicted subframe can be detected and re-sent verbatim.
+struct BitWriter {
+    uint8_t* out;
+    uint8_t* end;
+    uint32_t acc = 0;
+    int bits = 0;
+
+    BitWriter(uint8_t* start, uint8_t* limit) : out(start), end(limit) {}
+
+    bool overflowed() const { return out >= end; }
+
+    // n <= 24
+    void put(uint32_t value, int n) {
+        acc = (acc << n) | value;
+        bits += n;
+        while (bits >= 8) {
+            bits -= 8;
+            if (out < end) *out = (uint8_t)(acc >> bits);
+            out++;
+        }
+    }
+
+    void putRice(uint32_t value, int k) {
+        uint32_t q = value >> k;
+        while (q >= 16) {
+            put(0, 16);
+            q -= 16;
+            if (overflowed()) return;
+        }
+        put(1, q + 1);
+        if (k > 0) put(value & ((1u << k) - 1), k);
+    }
+
+    void flush() {
+        if (bits > 0) put(0, 8 - bits);
+    }
+};
+
+// MSB-first bit reader, the accumulator holds `bits` valid bits at the top
+struct BitReader {
+    const uint8_t* in;
+    const uint8_t* end;
+    uint32_t acc = 0;
+    int bits = 0;
+
+    BitReader(const uint8_t* start, const uint8_t* limit)
+        : in(start), end(limit) {}
+
+    void fill() {
+        while (bits <= 24) {
+            uint32_t byte = in < end ? *in : 0;
+            in++;
+            acc |= byte << (24 - bits);
+            bits += 8;
+        }
+    }
+
+    bool exhausted() const { return in > end + 4; }
+
+    // n <= 16
+    uint32_t get(int n) {
+        if (n == 0) return 0;
+        fill();
+        uint32_t value = acc >> (32 - n);
+        acc <<= n;
+        bits -= n;
+        return value;
+    }
+
+    uint32_t getUnary() {
+        uint32_t q = 0;
+        for (;;) {
+            fill();
+            if (acc == 0) {
+                q += bits;
+                bits = 0;
+                if (exhausted()) return q;
+                continue;
+            }
+            int zeros = __builtin_clz(acc);
+            acc <<= zeros + 1;
+            bits -= zeros + 1;
+            return q + zeros;
+        }
+    }
+};
+
+inline uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+inline int32_t unzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+inline int32_t residual(const int16_t* s, uint16_t stride, size_t i,
+                        int order) {
+    int32_t x0 = s[i * stride];
+    switch (order) {
+        case 1:
+            return x0 - s[(i - 1) * stride];
+        case 2:
+            return x0 - 2 * s[(i - 1) * stride] + s[(i - 2) * stride];
+        case 3:
+            return x0 - 3 * s[(i - 1) * stride] + 3 * s[(i - 2) * stride] -
+                   s[(i - 3) * stride];
+        default:
+            return x0;
+    }
+}
+
+inline void putInt16(uint8_t* out, int16_t value) {
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)((uint16_t)value >> 8);
+}
+
+inline int16_t getInt16(const uint8_t* in) {
+    return (int16_t)(in[0] | (in[1] << 8));
+}
+
+}  // namespace
+
+size_t LosslessCodec::encodeSubframe(const int16_t* samples, uint16_t stride,
+                                     uint8_t* out) {
+    const size_t n = AUDIO_BLOCK_SAMPLES;
+    const size_t verbatimBytes = 1 + n * sizeof(int16_t);
+
+    // Residual magnitude of every fixed predictor in a single pass
+    uint32_t sums[4] = {0, 0, 0, 0};
+    int32_t x1 = samples[2 * stride];
+    int32_t x2 = samples[stride];
+    int32_t x3 = samples[0];
+    for (size_t i = 3; i < n; i++) {
+        int32_t x0 = samples[i * stride];
+        int32_t e1 = x0 - x1;
+        int32_t e2 = e1 - (x1 - x2);
+        int32_t e3 = e2 - ((x1 - x2) - (x2 - x3));
+        sums[0] += abs(x0);
+        sums[1] += abs(e1);
+        sums[2] += abs(e2);
+        sums[3] += abs(e3);
+        x3 = x2;
+        x2 = x1;
+        x1 = x0;
+    }
+
+    int order = 0;
+    for (int i = 1; i < 4; i++) {
+        if (sums[i] < sums[order]) order = i;
+    }
+
+    // Rice parameter close to log2 of the mean zigzagged residual
+    uint32_t mean = (sums[order] * 2) / (n - 3);
+    int k = 0;
+    while (k < VERBATIM - 1 && (1u << (k + 1)) <= mean) k++;
+
+    out[0] = (uint8_t)((order << 4) | k);
+    uint8_t* p = out + 1;
+    for (int i = 0; i < order; i++, p += 2) {
+        putInt16(p, samples[i * stride]);
+    }
+
+    BitWriter writer(p, out + verbatimBytes);
+    for (size_t i = order; i < n && !writer.overflowed(); i++) {
+        writer.putRice(zigzag(residual(samples, stride, i, order)), k);
+    }
+    writer.flush();
+
+    if (!writer.overflowed()) return writer.out - out;
+
+    // Prediction didn't pay off, store the samples as they are
+    out[0] = VERBATIM;
+    for (size_t i = 0; i < n; i++) {
+        putInt16(out + 1 + i * 2, samples[i * stride]);
+    }
+    return verbatimBytes;
+}
+
+size_t LosslessCodec::encodeFrame(const int16_t* samples, uint16_t channels,
+                                  uint8_t* out) {
+    size_t length = 0;
+    for (uint16_t c = 0; c < channels; c++) {
+        length += encodeSubframe(samples + c, channels, out + 2 + length);
+    }
+    out[0] = (uint8_t)length;
+    out[1] = (uint8_t)(length >> 8);
+    return 2 + length;
+}
+
+bool LosslessCodec::decodeFrame(const uint8_t* payload, size_t length,
+                                uint16_t channels, int16_t* samples) {
+    const size_t n = AUDIO_BLOCK_SAMPLES;
+    const uint8_t* end = payload + length;
+    const uint8_t* p = payload;
+
+    for (uint16_t c = 0; c < channels; c++) {
+        if (p >= end) return false;
+        int order = p[0] >> 4;
+        int k = p[0] & 0x0F;
+        p++;
+        int16_t* s = samples + c;
+
+        if (k == VERBATIM) {
+            if (p + n * 2 > end) return false;
+            for (size_t i = 0; i < n; i++, p += 2) {
+                s[i * channels] = getInt16(p);
+            }
+            continue;
+        }
+
+        if (order > 3 || p + order * 2 > end) return false;
+        for (int i = 0; i < order; i++, p += 2) {
+            s[i * channels] = getInt16(p);
+        }
+
+        BitReader reader(p, end);
+        for (size_t i = order; i < n; i++) {
+            uint32_t q = reader.getUnary();
+            int32_t e = unzigzag((q << k) | reader.get(k));
+            int32_t prediction = 0;
+            switch (order) {
+                case 1:
+                    prediction = s[(i - 1) * channels];
+                    break;
+                case 2:
+                    prediction =
+                        2 * s[(i - 1) * channels] - s[(i - 2) * channels];
+                    break;
+                case 3:
+                    prediction = 3 * s[(i - 1) * channels] -
+                                 3 * s[(i - 2) * channels] +
+                                 s[(i - 3) * channels];
+                    break;
+            }
+            s[i * channels] = (int16_t)(prediction + e);
+        }
+        if (reader.exhausted()) return false;
+
+        // Next subframe starts on the byte after the last one used
+        p = reader.in - reader.bits / 8;
+    }
+    return true;
+}
+
+void LosslessDecoder::begin(uint16_t channels, uint32_t dataBytes) {
+    _channels = channels == 2 ? 2 : 1;
+    _remaining = dataBytes;
+    _pcmBytes = 0;
+    _pcmOffset = 0;
+}
+
+bool LosslessDecoder::decodeNext(File& file) {
+    uint8_t lengthField[2];
+    if (_remaining < sizeof(lengthField)) return false;
+    if (file.read(lengthField, sizeof(lengthField)) != sizeof(lengthField)) {
+        return false;
+    }
+    size_t length = lengthField[0] | (lengthField[1] << 8);
+    _remaining -= sizeof(lengthField);
+    if (length > sizeof(_frame) || length > _remaining) return false;
+
+    if (file.read(_frame, length) != (int)length) return false;
+    _remaining -= length;
+
+    if (!LosslessCodec::decodeFrame(_frame, length, _channels, _pcm)) {
+        return false;
+    }
+    _pcmBytes = AUDIO_BLOCK_SAMPLES * _channels * sizeof(int16_t);
+    _pcmOffset = 0;
+    return true;
+}
+
+size_t LosslessDecoder::read(File& file, uint8_t* out, size_t bytes) {
+    size_t produced = 0;
+    while (produced < bytes) {
+        if (_pcmOffset >= _pcmBytes && !decodeNext(file)) break;
+        size_t chunk = _pcmBytes - _pcmOffset;
+        if (chunk > bytes - produced) chunk = bytes - produced;
+        memcpy(out + produced, (const uint8_t*)_pcm + _pcmOffset, chunk);
+        _pcmOffset += chunk;
+        produced += chunk;
+    }
+    return produced;
+}
+
+bool LosslessDecoder::skip(File& file, uint32_t bytes) {
+    const uint32_t frameBytes =
+        AUDIO_BLOCK_SAMPLES * _channels * sizeof(int16_t);
+
+    while (bytes >= frameBytes) {
+        uint8_t lengthField[2];
+        if (_remaining < sizeof(lengthField)) return false;
+        if (file.read(lengthField, 2) != 2) return false;
+        uint32_t length = lengthField[0] | (lengthField[1] << 8);
+        _remaining -= sizeof(lengthField);
+        if (length > _remaining) return false;
+        if (!file.seek(file.position() + length)) return false;
+        _remaining -= length;
+        bytes -= frameBytes;
+    }
+
+    // The rest lands inside a frame
+    _pcmBytes = 0;
+    _pcmOffset = 0;
+    if (bytes == 0) return true;
+    if (!decodeNext(file)) return false;
+    _pcmOffset = bytes;
+    return true;
+}
@@ -0,0 +1,91 @@
+#ifndef LOSSLESSCODEC_HPP
+#define LOSSLESSCODEC_HPP
+
+#include <Arduino.h>
+#include <AudioStream.h>
+#include <SD.h>
+
+// Lossless recording format (".nmc"), loosely modelled on FLAC:
+//
+//   header   one 512 byte sector, see LosslessHeader. Audio starts at 512.
+//   frames   AUDIO_BLOCK_SAMPLES sample frames each:
+//              uint16  payload length in bytes
+//              one subframe per channel, each starting on a byte boundary:
+//                uint8   (predictor order << 4) | rice parameter
+//                        (rice parameter 15 = verbatim, no prediction)
+//                int16   `order` warm-up samples
+//                        rice coded residuals, MSB first
+//
+// The predictors are FLAC's fixed polynomial ones (order 0..3), picked per
+// subframe by smallest residual sum. Everything is integer arithmetic so a
+// block encodes in a few microseconds.
+struct LosslessHeader {
+    char magic[4];  // "NMLC"
+    uint16_t version;
+    uint16_t channels;
+    uint32_t sampleRate;
+    uint32_t totalFrames;  // sample frames, patched on commit and close
+    uint32_t dataBytes;    // encoded bytes following the header
+    uint16_t frameSamples;
+    uint16_t bitsPerSample;
+};
+
+class LosslessCodec {
+   public:
+    static const uint16_t VERSION = 1;
+    static const size_t HEADER_BYTES = 512;
+    static const uint8_t VERBATIM = 15;
+
+    // Largest possible frame: length field plus verbatim subframes
+    static constexpr size_t maxFrameBytes(uint16_t channels) {
+        return 2 + channels * (1 + AUDIO_BLOCK_SAMPLES * sizeof(int16_t));
+    }
+
+    // Encodes one block of interleaved samples, returns the frame size
+    static size_t encodeFrame(const int16_t* samples, uint16_t channels,
+                              uint8_t* out);
+
+    // Decodes a frame payload (without the length field) into interleaved
+    // samples. Returns false if the payload is damaged.
+    static bool decodeFrame(const uint8_t* payload, size_t length,
+                            uint16_t channels, int16_t* samples);
+
+    static bool isHeader(const uint8_t* data) {
+        return memcmp(data, "NMLC", 4) == 0;
+    }
+
+   private:
+    static size_t encodeSubframe(const int16_t* samples, uint16_t stride,
+                                 uint8_t* out);
+};
+
+// Streams decoded PCM out of an open ".nmc" file, a frame at a time
+class LosslessDecoder {
+   public:
+    void begin(uint16_t channels, uint32_t dataBytes);
+
+    // Fills `out` with up to `bytes` of little-endian PCM. Returns 0 at the
+    // end of the data or when a frame can't be read.
+    size_t read(File& file, uint8_t* out, size_t bytes);
+
+    // Skips `bytes` of decoded PCM. Whole frames are stepped over using
+    // their length field, without decoding them.
+    bool skip(File& file, uint32_t bytes);
+
+    // True while decoded or encoded data is left
+    bool available() const {
+        return _pcmOffset < _pcmBytes || _remaining > 0;
+    }
+
+   private:
+    bool decodeNext(File& file);
+
+    uint16_t _channels = 1;
+    uint32_t _remaining = 0;  // encoded bytes not read yet
+    int16_t _pcm[AUDIO_BLOCK_SAMPLES * 2];
+    uint16_t _pcmBytes = 0;
+    uint16_t _pcmOffset = 0;
+    uint8_t _frame[LosslessCodec::maxFrameBytes(2)];
+};
+
+#endif  // LOSSLESSCODEC_HPP
@@ -0,0 +1,98 @@
+#ifndef PEAK_DECIMATOR_HPP
+#define PEAK_DECIMATOR_HPP
+
+#include <Arduino.h>
+#include <AudioStream.h>
+
+// One finished display column
+struct PeakColumn {
+    int16_t min;
+    int16_t max;
+    uint16_t rms;
+};
+
+// Reduces incoming audio blocks to min/max/RMS columns on the fly. The
+// recorder feeds it one block at a time and the UI picks up finished
+// columns whenever it gets around to it, so no raw samples are kept.
+class PeakDecimator {
+   public:
+    static const uint32_t COLUMN_RING = 64;  // finished columns not yet read
+
+    PeakDecimator() { reset(1); }
+
+    void reset(uint32_t blocksPerColumn) {
+        _blocksPerColumn = blocksPerColumn > 0 ? blocksPerColumn : 1;
+        clear();
+    }
+
+    // Drops all columns but keeps the resolution
+    void clear() {
+        _head = 0;
+        _tail = 0;
+        startColumn();
+    }
+
+    void addBlock(const int16_t* samples) {
+        int16_t minVal = _min;
+        int16_t maxVal = _max;
+        uint64_t sumSquares = 0;
+
+        for (size_t i = 0; i < AUDIO_BLOCK_SAMPLES; i++) {
+            int16_t sample = samples[i];
+            if (sample < minVal) minVal = sample;
+            if (sample > maxVal) maxVal = sample;
+            sumSquares += (int32_t)sample * sample;
+        }
+
+        _min = minVal;
+        _max = maxVal;
+        _sumSquares += sumSquares;
+
+        if (++_blocks < _blocksPerColumn) return;
+
+        // Column complete. If the UI has fallen a whole ring behind, the
+        // column is dropped; only the consumer ever moves _tail.
+        if (_head - _tail >= COLUMN_RING) {
+            startColumn();
+            return;
+        }
+
+        PeakColumn& column = _columns[_head % COLUMN_RING];
+        column.min = _min;
+        column.max = _max;
+        column.rms = (uint16_t)sqrtf(
+            (float)_sumSquares / (_blocks * AUDIO_BLOCK_SAMPLES));
+        _head = _head + 1;
+
+        startColumn();
+    }
+
+    uint32_t available() const { return _head - _tail; }
+
+    bool read(PeakColumn& column) {
+        if (_head == _tail) return false;
+        column = _columns[_tail % COLUMN_RING];
+        _tail = _tail + 1;
+        return true;
+    }
+
+   private:
+    void startColumn() {
+        _min = 32767;
+        _max = -32768;
+        _sumSquares = 0;
+        _blocks = 0;
+    }
+
+    PeakColumn _columns[COLUMN_RING];
+    volatile uint32_t _head;  // written by the producer only
+    volatile uint32_t _tail;  // written by the consumer only
+
+    uint32_t _blocksPerColumn;
+    uint32_t _blocks;
+    int16_t _min;
+    int16_t _max;
+    uint64_t _sumSquares;
+};
+
+#endif  // PEAK_DECIMATOR_HPP
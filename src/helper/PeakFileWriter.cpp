@@ -0,0 +1,172 @@
+#include "PeakFileWriter.hpp"
+
+#include "WavFileWriter.hpp"
+
+static_assert(sizeof(PeakFileFooter) == 32, "Footer layout changed");
+
+PeakFileWriter::PeakFileWriter()
+    : m_isOpen(false),
+      m_channels(1),
+      m_pagePairs(0),
+      m_peakCount(0),
+      m_overviewPoints(PEAK_OVERVIEW_POINTS),
+      m_overviewCount(0),
+      m_overviewBlocks(1),
+      m_pendingBlocks(0) {
+    resetPending();
+}
+
+String PeakFileWriter::sidecarPath(const String& audioPath) {
+    int dot = audioPath.lastIndexOf('.');
+    String base = dot >= 0 ? audioPath.substring(0, dot) : audioPath;
+    return base + ".pks";
+}
+
+bool PeakFileWriter::open(const char* fileName, uint32_t maxBlocks,
+                          uint16_t channels) {
+    SdCardLock cardLock;
+    m_file = SD.sdfs.open(fileName, O_RDWR | O_CREAT | O_TRUNC);
+    if (!m_file) {
+        Serial.println("Could not open peak file.");
+        return false;
+    }
+
+    m_channels = channels == 2 ? 2 : 1;
+
+    // Reserve level 0 for the longest possible take so the sidecar doesn't
+    // need cluster allocation mid-take either. Not fatal if it fails.
+    if (maxBlocks > 0) {
+        uint64_t bytes = (uint64_t)maxBlocks * m_channels * 2 *
+                             sizeof(int16_t) +
+                         sizeof(m_overview) + sizeof(PeakFileFooter);
+        m_file.preAllocate(bytes);
+    }
+
+    m_pagePairs = 0;
+    m_peakCount = 0;
+    m_overviewPoints = PEAK_OVERVIEW_POINTS / m_channels;
+    m_overviewCount = 0;
+    m_overviewBlocks = 1;
+    m_pendingBlocks = 0;
+    resetPending();
+    m_isOpen = true;
+    return true;
+}
+
+void PeakFileWriter::resetPending() {
+    for (uint16_t c = 0; c < MAX_CHANNELS; c++) {
+        m_pending[c * 2] = 32767;
+        m_pending[c * 2 + 1] = -32768;
+    }
+}
+
+void PeakFileWriter::addBlock(const int16_t* samples) {
+    if (!m_isOpen) return;
+
+    // One min/max pair per channel, interleaved samples are split here
+    int16_t peak[MAX_CHANNELS * 2];
+    for (uint16_t c = 0; c < m_channels; c++) {
+        int16_t minVal = 32767;
+        int16_t maxVal = -32768;
+        for (size_t i = c; i < AUDIO_BLOCK_SAMPLES; i += m_channels) {
+            int16_t sample = samples[i];
+            if (sample < minVal) minVal = sample;
+            if (sample > maxVal) maxVal = sample;
+        }
+        peak[c * 2] = minVal;
+        peak[c * 2 + 1] = maxVal;
+    }
+
+    // Level 0 goes out a sector at a time
+    memcpy(m_page + m_pagePairs * 2, peak, m_channels * 2 * sizeof(int16_t));
+    m_peakCount++;
+    m_pagePairs += m_channels;
+    if (m_pagePairs == PAGE_PAIRS) {
+        m_file.write(m_page, sizeof(m_page));
+        m_pagePairs = 0;
+    }
+
+    // The overview is built from the same values and stays in RAM
+    for (uint16_t c = 0; c < m_channels; c++) {
+        if (peak[c * 2] < m_pending[c * 2]) m_pending[c * 2] = peak[c * 2];
+        if (peak[c * 2 + 1] > m_pending[c * 2 + 1]) {
+            m_pending[c * 2 + 1] = peak[c * 2 + 1];
+        }
+    }
+    // A halving keeps the peak pending, as the start of a wider one
+    if (++m_pendingBlocks == m_overviewBlocks && appendOverview(m_pending)) {
+        m_pendingBlocks = 0;
+        resetPending();
+    }
+}
+
+bool PeakFileWriter::appendOverview(const int16_t* peak) {
+    const uint16_t pairs = m_channels;
+
+    if (m_overviewCount == m_overviewPoints) {
+        // Full: halve the resolution in place
+        for (uint32_t i = 0; i < m_overviewPoints / 2; i++) {
+            for (uint16_t c = 0; c < pairs; c++) {
+                const int16_t* a = m_overview + (i * 2 * pairs + c) * 2;
+                const int16_t* b = a + pairs * 2;
+                int16_t* merged = m_overview + (i * pairs + c) * 2;
+                int16_t minVal = min(a[0], b[0]);
+                int16_t maxVal = max(a[1], b[1]);
+                merged[0] = minVal;
+                merged[1] = maxVal;
+            }
+        }
+        m_overviewCount = m_overviewPoints / 2;
+        m_overviewBlocks *= 2;
+
+        // The value being appended only covers half of the new stride, so
+        // carry it over as the start of the next peak instead.
+        memmove(m_pending, peak, pairs * 2 * sizeof(int16_t));
+        m_pendingBlocks = m_overviewBlocks / 2;
+        return false;
+    }
+
+    memcpy(m_overview + m_overviewCount * pairs * 2, peak,
+           pairs * 2 * sizeof(int16_t));
+    m_overviewCount++;
+    return true;
+}
+
+bool PeakFileWriter::close() {
+    if (!m_isOpen) return false;
+    m_isOpen = false;
+    SdCardLock cardLock;
+
+    const size_t peakBytes = m_channels * 2 * sizeof(int16_t);
+
+    // A trailing partial overview peak still counts. With the overview full
+    // the first append only halves it and keeps the peak pending.
+    if (m_pendingBlocks > 0 && !appendOverview(m_pending)) {
+        appendOverview(m_pending);
+    }
+
+    if (m_pagePairs > 0) {
+        m_file.write(m_page, m_pagePairs * 2 * sizeof(int16_t));
+    }
+    m_file.write(m_overview, m_overviewCount * peakBytes);
+
+    // Every block holds AUDIO_BLOCK_SAMPLES samples across all channels
+    const uint32_t framesPerBlock = AUDIO_BLOCK_SAMPLES / m_channels;
+
+    PeakFileFooter footer;
+    memcpy(footer.magic, "NMPK", 4);
+    footer.version = VERSION;
+    footer.channels = m_channels;
+    footer.samplesPerPeak = framesPerBlock;
+    footer.peakCount = m_peakCount;
+    footer.overviewSamplesPerPeak = m_overviewBlocks * framesPerBlock;
+    footer.overviewCount = m_overviewCount;
+    footer.totalSamples = m_peakCount * framesPerBlock;
+    footer.reserved = 0;
+    m_file.write(&footer, sizeof(footer));
+
+    // Drop whatever part of the reservation wasn't used
+    m_file.truncate();
+    m_file.close();
+    return true;
+}
@@ -0,0 +1,76 @@
+#ifndef PEAKFILEWRITER_HPP
+#define PEAKFILEWRITER_HPP
+
+#include <Arduino.h>
+#include <AudioStream.h>
+#include <SD.h>
+
+// Number of min/max pairs in the in-memory overview level, shared between
+// the channels of a stereo take. When it fills up,
+// neighbouring pairs are merged and the overview stride doubles, so it
+// always spans the whole take at the best resolution that fits.
+#ifndef PEAK_OVERVIEW_POINTS
+#define PEAK_OVERVIEW_POINTS 2048
+#endif
+
+// Sidecar layout, all little-endian:
+//   level 0   one min/max int16 pair per channel per audio block, streamed
+//             while recording
+//   overview  one min/max int16 pair per channel per `overviewBlocks` blocks
+//   footer    PeakFileFooter, always the last bytes of the file
+// A peak covers `channels` pairs, left first. Sample counts are in frames.
+struct PeakFileFooter {
+    char magic[4];  // "NMPK"
+    uint16_t version;
+    uint16_t channels;
+    uint32_t samplesPerPeak;  // level 0 resolution
+    uint32_t peakCount;       // level 0 peaks
+    uint32_t overviewSamplesPerPeak;
+    uint32_t overviewCount;
+    uint32_t totalSamples;
+    uint32_t reserved;
+};
+
+class PeakFileWriter {
+   public:
+    static const uint16_t VERSION = 1;
+
+    PeakFileWriter();
+
+    // maxBlocks sizes the up-front reservation, 0 lets the file grow
+    bool open(const char* fileName, uint32_t maxBlocks,
+              uint16_t channels = 1);
+    // AUDIO_BLOCK_SAMPLES samples, interleaved when stereo
+    void addBlock(const int16_t* samples);
+    bool close();
+    bool isOpen() const { return m_isOpen; }
+
+    // "/RECORDINGS/Name.wav" -> "/RECORDINGS/Name.pks"
+    static String sidecarPath(const String& audioPath);
+
+   private:
+    static const size_t PAGE_PAIRS = 128;  // one 512 byte sector per write
+    static const uint16_t MAX_CHANNELS = 2;
+
+    // False if the overview was full and got halved instead, `peak` is
+    // then carried over in m_pending
+    bool appendOverview(const int16_t* peak);
+    void resetPending();
+
+    bool m_isOpen;
+    FsFile m_file;
+    uint16_t m_channels;
+
+    int16_t m_page[PAGE_PAIRS * 2];
+    size_t m_pagePairs;
+    uint32_t m_peakCount;
+
+    int16_t m_overview[PEAK_OVERVIEW_POINTS * 2];
+    uint32_t m_overviewPoints;  // capacity, in peaks
+    uint32_t m_overviewCount;
+    uint32_t m_overviewBlocks;  // blocks merged into each overview peak
+    uint32_t m_pendingBlocks;
+    int16_t m_pending[MAX_CHANNELS * 2];
+};
+
+#endif  // PEAKFILEWRITER_HPP
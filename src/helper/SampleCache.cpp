@@ -0,0 +1,159 @@
+#include "SampleCache.hpp"
+
+#include "AudioDiagnostics.h"
+#include "WavFileWriter.hpp"
+
+SampleCache::SampleCache()
+    : m_bytesUsed(0),
+      m_clock(0),
+      m_voices(nullptr),
+      m_loading(nullptr),
+      m_loadLossless(false),
+      m_loadOffset(0) {
+    for (Entry& entry : m_entries) {
+        entry.data = nullptr;
+        entry.frames = 0;
+        entry.channels = 1;
+        entry.lastUsed = 0;
+        entry.ready = false;
+    }
+}
+
+uint32_t SampleCache::play(AudioSamplerVoices& voices, const String& path,
+                           float gain, float pitch, uint32_t startFrame) {
+    m_voices = &voices;
+    Entry* entry = find(path);
+    if (entry && entry->ready) {
+        audioDiagnostics.recordSampleCacheHit();
+        entry->lastUsed = ++m_clock;
+        return voices.play(entry->data, entry->frames, entry->channels, gain,
+                           pitch, startFrame);
+    }
+
+    audioDiagnostics.recordSampleCacheMiss();
+    if (!entry) m_queued = path;
+    return 0;
+}
+
+void SampleCache::update() {
+    if (!m_loading) {
+        if (m_queued.length() > 0) startLoad();
+        return;
+    }
+
+    // A take may be recording in the background
+    SdCardLock cardLock;
+
+    uint32_t total = m_loading->frames * m_loading->channels * 2;
+    uint32_t bytes = total - m_loadOffset;
+    if (bytes > LOAD_PIECE_BYTES) bytes = LOAD_PIECE_BYTES;
+    uint8_t* dest = (uint8_t*)m_loading->data + m_loadOffset;
+    int got = m_loadLossless ? m_decoder.read(m_loadFile, dest, bytes)
+                             : m_loadFile.read(dest, bytes);
+    if (got <= 0) {
+        Serial.println("Could not load sample: " + m_loading->path);
+        evict(*m_loading);
+        m_loading = nullptr;
+        m_loadFile.close();
+        return;
+    }
+
+    m_loadOffset += got;
+    if (m_loadOffset >= total) {
+        m_loading->ready = true;
+        m_loading = nullptr;
+        m_loadFile.close();
+    }
+}
+
+void SampleCache::clear() {
+    SdCardLock cardLock;
+    if (m_loading) {
+        m_loading = nullptr;
+        m_loadFile.close();
+    }
+    m_queued = "";
+    for (Entry& entry : m_entries) {
+        if (entry.data) evict(entry);
+    }
+}
+
+SampleCache::Entry* SampleCache::find(const String& path) {
+    for (Entry& entry : m_entries) {
+        if (entry.data && entry.path == path) return &entry;
+    }
+    return nullptr;
+}
+
+// A free entry with `bytes` of the budget to spare, evicting as needed.
+// Entries being loaded or played are never evicted.
+SampleCache::Entry* SampleCache::makeRoom(uint32_t bytes) {
+    const uint32_t budget = (uint32_t)SAMPLE_CACHE_KB * 1024;
+    while (true) {
+        Entry* free = nullptr;
+        Entry* oldest = nullptr;
+        for (Entry& entry : m_entries) {
+            if (!entry.data) {
+                if (!free) free = &entry;
+                continue;
+            }
+            if (!entry.ready) continue;
+            if (m_voices && m_voices->isPlayingFrom(entry.data)) continue;
+            if (!oldest || entry.lastUsed < oldest->lastUsed) oldest = &entry;
+        }
+        if (free && m_bytesUsed + bytes <= budget) return free;
+        if (!oldest) return nullptr;
+        evict(*oldest);
+    }
+}
+
+void SampleCache::evict(Entry& entry) {
+    m_bytesUsed -= entry.frames * entry.channels * 2;
+    free(entry.data);
+    entry.data = nullptr;
+    entry.path = "";
+    entry.ready = false;
+}
+
+void SampleCache::startLoad() {
+    String path = m_queued;
+    m_queued = "";
+    if (find(path)) return;
+
+    SdCardLock cardLock;
+    File file = SD.open(path.c_str());
+    if (!file) return;
+
+    AudioSampleInfo info;
+    if (!AudioPlaySdWavExtended::readInfo(file, info)) return;
+    if (info.sampleRate != 44100 || info.bitsPerSample != 16 ||
+        info.channels < 1 || info.channels > 2) {
+        return;
+    }
+    uint32_t frames = info.dataBytes / (info.channels * 2);
+    uint32_t bytes = frames * info.channels * 2;
+    if (frames == 0 || bytes > (uint32_t)SAMPLE_CACHE_MAX_KB * 1024) return;
+
+    Entry* entry = makeRoom(bytes);
+    if (!entry) return;
+    int16_t* data = (int16_t*)malloc(bytes);
+    if (!data) return;
+    if (!file.seek(info.dataOffset)) {
+        free(data);
+        return;
+    }
+    if (info.lossless) m_decoder.begin(info.channels, info.encodedBytes);
+
+    entry->path = path;
+    entry->data = data;
+    entry->frames = frames;
+    entry->channels = info.channels;
+    entry->lastUsed = ++m_clock;
+    entry->ready = false;
+    m_bytesUsed += bytes;
+
+    m_loading = entry;
+    m_loadFile = file;
+    m_loadLossless = info.lossless;
+    m_loadOffset = 0;
+}
@@ -0,0 +1,75 @@
+#ifndef SAMPLECACHE_HPP
+#define SAMPLECACHE_HPP
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include "LosslessCodec.hpp"
+#include "audio-extensions/play_sd_wav_extended.h"
+#include "audio-extensions/sampler_voices.h"
+
+// RAM kept for cached samples, taken from the heap as samples come in
+#ifndef SAMPLE_CACHE_KB
+#define SAMPLE_CACHE_KB 256
+#endif
+
+// Longer samples are always streamed from the card
+#ifndef SAMPLE_CACHE_MAX_KB
+#define SAMPLE_CACHE_MAX_KB 128
+#endif
+
+#ifndef SAMPLE_CACHE_ENTRIES
+#define SAMPLE_CACHE_ENTRIES 16
+#endif
+
+// Short samples held in RAM as 16 bit PCM, so retriggering them doesn't
+// touch the card. A miss queues the sample, update() then reads it in a
+// piece at a time. When the cache is full the sample that went unplayed the
+// longest makes room. Only 44.1 kHz, 16 bit (or lossless) files are kept,
+// the voices don't convert the rate.
+class SampleCache {
+   public:
+    SampleCache();
+
+    // Starts a voice on a hit and returns its note. On a miss nothing
+    // plays (0), the caller streams the sample from the card instead.
+    uint32_t play(AudioSamplerVoices& voices, const String& path,
+                  float gain = 1.0, float pitch = 1.0,
+                  uint32_t startFrame = 0);
+    // Loads queued samples, call from loop()
+    void update();
+    void clear();
+
+    uint32_t getBytesUsed() const { return m_bytesUsed; }
+
+   private:
+    static const uint32_t LOAD_PIECE_BYTES = 4096;
+
+    struct Entry {
+        String path;
+        int16_t* data;
+        uint32_t frames;
+        uint16_t channels;
+        uint32_t lastUsed;
+        bool ready;  // false while it's being loaded
+    };
+
+    Entry* find(const String& path);
+    Entry* makeRoom(uint32_t bytes);
+    void evict(Entry& entry);
+    void startLoad();
+
+    Entry m_entries[SAMPLE_CACHE_ENTRIES];
+    uint32_t m_bytesUsed;
+    uint32_t m_clock;
+    AudioSamplerVoices* m_voices;  // may be reading some of the entries
+
+    String m_queued;
+    Entry* m_loading;
+    File m_loadFile;
+    bool m_loadLossless;
+    LosslessDecoder m_decoder;
+    uint32_t m_loadOffset;  // bytes read so far
+};
+
+#endif  // SAMPLECACHE_HPP
@@ -0,0 +1,118 @@
+#include "SamplePool.hpp"
+
+#include "WavFileWriter.hpp"
+
+SamplePool::SamplePool() : m_clock(0) {}
+
+void SamplePool::setPage(const String* paths, int count) {
+    // A take may be recording in the background
+    SdCardLock cardLock;
+
+    for (Handle& handle : m_handles) {
+        if (!handle.file) continue;
+        bool listed = false;
+        for (int i = 0; i < count; i++) {
+            if (paths[i] == handle.path) listed = true;
+        }
+        if (!listed) {
+            // Only drops our reference, a sample still playing from it
+            // keeps the file open until it ends
+            handle.file = File();
+            handle.path = "";
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (findHandle(paths[i])) continue;
+
+        Handle* free = nullptr;
+        for (Handle& handle : m_handles) {
+            if (!handle.file) {
+                free = &handle;
+                break;
+            }
+        }
+        if (!free) break;
+
+        File file = SD.open(paths[i].c_str());
+        if (!file) continue;
+        InfoEntry* entry = lookup(paths[i], file);
+        if (!entry) continue;
+        free->path = paths[i];
+        free->file = file;
+        free->info = entry->info;
+    }
+}
+
+void SamplePool::clear() {
+    SdCardLock cardLock;
+    for (Handle& handle : m_handles) {
+        handle.file = File();
+        handle.path = "";
+    }
+}
+
+bool SamplePool::play(AudioPlaySdWavExtended& player, const String& path,
+                      uint32_t startPosition, uint32_t endPosition,
+                      float volumeScaleFactor) {
+    Handle* handle = findHandle(path);
+    if (handle) {
+        return player.play(handle->file, handle->info, startPosition,
+                           endPosition, volumeScaleFactor);
+    }
+
+    SdCardLock cardLock;
+    File file = SD.open(path.c_str());
+    if (!file) return false;
+    InfoEntry* entry = lookup(path, file);
+    if (!entry) return false;
+    return player.play(file, entry->info, startPosition, endPosition,
+                       volumeScaleFactor);
+}
+
+// Cached header for an open file, parsed on a miss. Null if the file isn't
+// something the player understands.
+SamplePool::InfoEntry* SamplePool::lookup(const String& path, File& file) {
+    uint32_t size = file.size();
+    InfoEntry* entry = nullptr;
+    for (InfoEntry& candidate : m_info) {
+        if (candidate.path == path) {
+            entry = &candidate;
+            break;
+        }
+    }
+    if (entry && entry->fileSize == size) {
+        entry->lastUsed = ++m_clock;
+        return entry;
+    }
+
+    AudioSampleInfo info;
+    if (!AudioPlaySdWavExtended::readInfo(file, info)) {
+        Serial.println("Not a playable sample: " + path);
+        return nullptr;
+    }
+
+    if (!entry) {
+        // An empty slot, or the one that went unused the longest
+        entry = &m_info[0];
+        for (InfoEntry& candidate : m_info) {
+            if (candidate.path.length() == 0) {
+                entry = &candidate;
+                break;
+            }
+            if (candidate.lastUsed < entry->lastUsed) entry = &candidate;
+        }
+    }
+    entry->path = path;
+    entry->fileSize = size;
+    entry->lastUsed = ++m_clock;
+    entry->info = info;
+    return entry;
+}
+
+SamplePool::Handle* SamplePool::findHandle(const String& path) {
+    for (Handle& handle : m_handles) {
+        if (handle.file && handle.path == path) return &handle;
+    }
+    return nullptr;
+}
@@ -0,0 +1,58 @@
+#ifndef SAMPLEPOOL_HPP
+#define SAMPLEPOOL_HPP
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include "audio-extensions/play_sd_wav_extended.h"
+
+// Parsed headers kept around, for every sample seen so far
+#ifndef SAMPLE_INFO_CACHE_SIZE
+#define SAMPLE_INFO_CACHE_SIZE 32
+#endif
+
+// Files held open, enough for the samples on one page of the library
+#ifndef SAMPLE_POOL_HANDLES
+#define SAMPLE_POOL_HANDLES 4
+#endif
+
+// Gets samples playing on the next audio block. Opening a file and walking
+// its header takes several card accesses, so both happen ahead of time:
+// headers are cached by path, the files on the current page are held open.
+class SamplePool {
+   public:
+    SamplePool();
+
+    // Holds these files open and lets go of the rest. Files already held
+    // are kept, so scrolling only opens the newly visible ones.
+    void setPage(const String* paths, int count);
+    void clear();
+
+    // Files that aren't held are opened here, using the cached header
+    bool play(AudioPlaySdWavExtended& player, const String& path,
+              uint32_t startPosition = 0, uint32_t endPosition = 0,
+              float volumeScaleFactor = 1.0);
+
+   private:
+    struct InfoEntry {
+        String path;
+        uint32_t fileSize;  // a file that changed size is parsed again
+        uint32_t lastUsed;
+        AudioSampleInfo info;
+    };
+
+    struct Handle {
+        String path;
+        File file;
+        AudioSampleInfo info;
+    };
+
+    InfoEntry* lookup(const String& path, File& file);
+    Handle* findHandle(const String& path);
+
+    InfoEntry m_info[SAMPLE_INFO_CACHE_SIZE];
+    uint32_t m_clock;
+    Handle m_handles[SAMPLE_POOL_HANDLES];
+};
+
+#endif  // SAMPLEPOOL_HPP
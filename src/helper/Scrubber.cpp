@@ -0,0 +1,166 @@
+#include "Scrubber.hpp"
+
+#include "WavFileWriter.hpp"
+
+Scrubber::Scrubber()
+    : m_voices(nullptr),
+      m_decoded(0),
+      m_totalFrames(0),
+      m_grainFrames(0),
+      m_pitch(1.0),
+      m_window(nullptr),
+      m_windowStart(0),
+      m_windowFrames(0),
+      m_position(0),
+      m_pending(false),
+      m_note(0) {}
+
+Scrubber::~Scrubber() {
+    close();
+    free(m_window);
+}
+
+bool Scrubber::open(AudioSamplerVoices& voices, const String& path) {
+    close();
+
+    // A take may be recording in the background
+    SdCardLock cardLock;
+    File file = SD.open(path.c_str());
+    if (!file) return false;
+
+    AudioSampleInfo info;
+    if (!AudioPlaySdWavExtended::readInfo(file, info)) return false;
+    if (info.bitsPerSample != 16 || info.channels < 1 || info.channels > 2) {
+        return false;
+    }
+
+    // Kept for the next take, a grain may still be fading out of it
+    if (!m_window) {
+        m_window = (int16_t*)malloc(WINDOW_BYTES);
+        if (!m_window) return false;
+    }
+
+    m_voices = &voices;
+    m_file = file;
+    m_info = info;
+    m_decoded = 0;
+    if (info.lossless) {
+        m_file.seek(info.dataOffset);
+        m_decoder.begin(info.channels, info.encodedBytes);
+    }
+    m_grainFrames = SCRUB_GRAIN_MS * info.sampleRate / 1000;
+    m_pitch = info.sampleRate / 44100.0f;
+    m_windowStart = 0;
+    m_windowFrames = 0;
+    m_position = 0;
+    m_pending = false;
+    m_totalFrames = info.dataBytes / (info.channels * 2);
+    return m_totalFrames > 0;
+}
+
+void Scrubber::close() {
+    if (m_voices && m_note) m_voices->stop(m_note);
+    m_note = 0;
+    m_file = File();
+    m_totalFrames = 0;
+    m_windowFrames = 0;
+    m_pending = false;
+}
+
+void Scrubber::setPosition(uint32_t frame) {
+    if (!isOpen()) return;
+    m_position = frame < m_totalFrames ? frame : m_totalFrames - 1;
+}
+
+void Scrubber::scrubTo(uint32_t frame) {
+    if (!isOpen()) return;
+    if (frame >= m_totalFrames) frame = m_totalFrames - 1;
+    m_position = frame;
+    if (inWindow(frame)) {
+        playGrain();
+    } else {
+        m_pending = true;
+    }
+}
+
+void Scrubber::scrubBy(int32_t frames) {
+    if (frames < 0 && (uint32_t)-frames > m_position) {
+        scrubTo(0);
+    } else {
+        scrubTo(m_position + frames);
+    }
+}
+
+void Scrubber::update() {
+    if (!m_pending) return;
+
+    // The last grain reads from the window, let it fade out first
+    if (m_note && m_voices->isPlaying(m_note)) {
+        m_voices->stop(m_note);
+        return;
+    }
+    m_note = 0;
+
+    // Centred on the position, starting on a sector so the read is too
+    uint32_t channels = m_info.channels;
+    uint32_t capacity = WINDOW_BYTES / (channels * 2);
+    uint32_t start = m_position > capacity / 2 ? m_position - capacity / 2
+                                               : 0;
+    if (start + capacity > m_totalFrames) {
+        start = m_totalFrames > capacity ? m_totalFrames - capacity : 0;
+    }
+    start -= start % (SECTOR_BYTES / (channels * 2));
+    uint32_t frames = min(capacity, m_totalFrames - start);
+
+    m_pending = false;
+    if (!readWindow(start, frames)) {
+        Serial.println("Could not read scrub window");
+        m_windowFrames = 0;
+        return;
+    }
+    playGrain();
+}
+
+bool Scrubber::inWindow(uint32_t frame) const {
+    uint32_t end = min(frame + m_grainFrames, m_totalFrames);
+    return m_windowFrames > 0 && frame >= m_windowStart &&
+           end <= m_windowStart + m_windowFrames;
+}
+
+bool Scrubber::readWindow(uint32_t start, uint32_t frames) {
+    SdCardLock cardLock;
+    uint32_t frameBytes = m_info.channels * 2;
+    uint32_t bytes = frames * frameBytes;
+    uint32_t offset = start * frameBytes;
+    m_windowFrames = 0;
+
+    int got;
+    if (m_info.lossless) {
+        // Frames can only be decoded in order, so going back starts over
+        if (offset < m_decoded) {
+            if (!m_file.seek(m_info.dataOffset)) return false;
+            m_decoder.begin(m_info.channels, m_info.encodedBytes);
+            m_decoded = 0;
+        }
+        if (!m_decoder.skip(m_file, offset - m_decoded)) return false;
+        got = m_decoder.read(m_file, (uint8_t*)m_window, bytes);
+        m_decoded = offset + (got > 0 ? got : 0);
+    } else {
+        if (!m_file.seek(m_info.dataOffset + offset)) return false;
+        got = m_file.read(m_window, bytes);
+    }
+    if (got <= 0) return false;
+
+    m_windowStart = start;
+    m_windowFrames = got / frameBytes;
+    return true;
+}
+
+void Scrubber::playGrain() {
+    if (!inWindow(m_position)) return;
+    if (m_note) m_voices->stop(m_note);
+    uint32_t frames = min(m_grainFrames, m_totalFrames - m_position);
+    const int16_t* data =
+        m_window + (m_position - m_windowStart) * m_info.channels;
+    m_note = m_voices->play(data, frames, m_info.channels, 1.0, m_pitch);
+}
@@ -0,0 +1,73 @@
+#ifndef SCRUBBER_HPP
+#define SCRUBBER_HPP
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include "LosslessCodec.hpp"
+#include "audio-extensions/play_sd_wav_extended.h"
+#include "audio-extensions/sampler_voices.h"
+
+// Audio kept in RAM around the scrub position. At 44.1 kHz mono 64 KB is
+// ~740 ms, half that in stereo.
+#ifndef SCRUB_WINDOW_KB
+#define SCRUB_WINDOW_KB 64
+#endif
+
+// Length of the snippet played at every move
+#ifndef SCRUB_GRAIN_MS
+#define SCRUB_GRAIN_MS 60
+#endif
+
+// Encoder scrubbing through a take. Every move plays a short grain at the
+// new position on the sampler voices, straight from a window of the take
+// held in RAM. The card is only read once the position leaves the window,
+// and then once for however many moves came in meanwhile. 16 bit WAV and
+// lossless takes only.
+class Scrubber {
+   public:
+    Scrubber();
+    ~Scrubber();
+
+    bool open(AudioSamplerVoices& voices, const String& path);
+    void close();
+    bool isOpen() const { return m_totalFrames > 0; }
+
+    // Positions are frames from the start of the audio data. Setting one
+    // plays nothing and reads nothing.
+    void setPosition(uint32_t frame);
+    void scrubTo(uint32_t frame);
+    void scrubBy(int32_t frames);
+    uint32_t getPosition() const { return m_position; }
+    uint32_t getSampleRate() const { return m_info.sampleRate; }
+
+    // Reads the window in when a move left it, call from loop()
+    void update();
+
+   private:
+    static const uint32_t WINDOW_BYTES = SCRUB_WINDOW_KB * 1024;
+    static const uint32_t SECTOR_BYTES = 512;
+
+    bool inWindow(uint32_t frame) const;
+    bool readWindow(uint32_t start, uint32_t frames);
+    void playGrain();
+
+    AudioSamplerVoices* m_voices;
+    File m_file;
+    AudioSampleInfo m_info;
+    LosslessDecoder m_decoder;
+    uint32_t m_decoded;  // lossless only, decoded bytes read so far
+    uint32_t m_totalFrames;
+    uint32_t m_grainFrames;
+    float m_pitch;  // plays the take at its own rate
+
+    int16_t* m_window;
+    uint32_t m_windowStart;   // frame
+    uint32_t m_windowFrames;  // in the window now, 0 before the first read
+
+    uint32_t m_position;
+    bool m_pending;  // the position is outside the window
+    uint32_t m_note;
+};
+
+#endif  // SCRUBBER_HPP
@@ -2,8 +2,63 @@
 
 #include <SPI.h>
 
-WavFileWriter::WavFileWriter(AudioRecordQueue& queue)
-    : m_isWriting(false), m_queue(queue), m_accumulatedSampleCount(0) {}
+#include "AudioDiagnostics.h"
+
+static_assert(WAV_WRITER_FLUSH_KB * 1024 % 512 == 0,
+              "Flush size must be a whole number of sectors");
+static_assert(WAV_WRITER_RING_KB % WAV_WRITER_FLUSH_KB == 0,
+              "Ring size must be a multiple of the flush size");
+
+// The ring lives in DMAMEM (OCRAM) so it doesn't eat into the tightly
+// coupled RAM used by the stack and the audio library.
+DMAMEM uint8_t WavFileWriter::s_ringStorage[RING_BLOCKS * BLOCK_BYTES]
+    __attribute__((aligned(32)));
+
+// Offsets of the size fields inside the 512 byte header
+static const size_t RIFF_SIZE_OFFSET = 4;
+static const size_t DATA_SIZE_OFFSET = WavFileWriter::HEADER_BYTES - 4;
+
+// Offsets of the size fields inside the lossless header
+static const size_t LOSSLESS_FRAMES_OFFSET =
+    offsetof(LosslessHeader, totalFrames);
+static const size_t LOSSLESS_BYTES_OFFSET = offsetof(LosslessHeader, dataBytes);
+
+// FAT32 can't hold files of 4 GB or more
+static const uint64_t MAX_FILE_BYTES = 0xFFFFFFFFull & ~511ull;
+
+// Card lock shared with the rest of the firmware. The writer's interrupt
+// never preempts itself and loop() can't preempt it, so plain volatiles do.
+static volatile uint32_t s_cardLocks = 0;
+static volatile bool s_serviceDeferred = false;
+static WavFileWriter* volatile s_activeWriter = nullptr;
+
+WavFileWriter::WavFileWriter(AudioRecordSink& sink)
+    : m_isWriting(false),
+      m_armed(false),
+      m_holdPreroll(false),
+      m_format(FORMAT_WAV),
+      m_channels(1),
+      m_sampleRate(44100),
+      m_sink(sink),
+      m_dataBytesWritten(0),
+      m_maxWriteMicros(0),
+      m_commitIntervalMs(WAV_WRITER_COMMIT_INTERVAL_MS),
+      m_lastCommitMillis(0),
+      m_extentBytes(0),
+      m_firstSector(0),
+      m_rawSectors(false),
+      m_extentFull(false),
+      m_scannedBlocks(0),
+      m_ringHighWater(0),
+      m_droppedBlocks(0),
+      m_staged(0),
+      m_stagedFrames(0),
+      m_committedBlocks(0) {
+    m_sink.setRing(reinterpret_cast<int16_t*>(s_ringStorage), RING_BLOCKS);
+
+    // Wake the writer twice per burst rather than for every block
+    m_sink.setWatermark(FLUSH_BLOCKS / 2);
+}
 
 bool WavFileWriter::open(const char* fileName, unsigned int sampleRate,
                          unsigned int channelCount) {
@@ -11,149 +66,655 @@ bool WavFileWriter::open(const char* fileName, unsigned int sampleRate,
         Serial.println("Cannot write WAV file. Already writing one.");
         return false;
     }
+    if (channelCount != 1 && channelCount != 2) {
+        Serial.println("Only mono and stereo takes are supported.");
+        return false;
+    }
+    uint16_t decimation = decimationFor(sampleRate);
+    if (decimation == 0) {
+        Serial.println("Unsupported recording sample rate.");
+        return false;
+    }
+
+    // A pre-roll in another rate or channel layout is no use for this take
+    if (m_armed &&
+        (channelCount != m_channels || sampleRate != m_sampleRate)) {
+        disarm();
+    }
+
+    // Setting up the file can take a while. Keep everything captured from
+    // here on, the pre-roll only stops sliding once the take has started.
+    m_holdPreroll = true;
+
+    // Keeps the player's refill off the bus until the take is set up. Our
+    // own first pass waits for it too, unlockCard() starts it.
+    SdCardLock cardLock;
 
     if (SD.exists(fileName)) {
         SD.remove(fileName);
     }
 
-    m_file = SD.open(fileName, FILE_WRITE);
+    m_file = SD.sdfs.open(fileName, O_RDWR | O_CREAT | O_TRUNC);
     if (!m_file) {
         Serial.println("Could not open file while trying to write WAV file.");
+        m_holdPreroll = false;
+        return false;
+    }
+
+    if (!m_armed) {
+        m_channels = channelCount;
+        m_sampleRate = sampleRate;
+        m_sink.setChannels(channelCount);
+        m_sink.setDecimation(decimation);
+        m_sink.reset();
+        m_scannedBlocks = 0;
+    }
+    m_ringHighWater = 0;
+    m_droppedBlocks = 0;
+    m_dataBytesWritten = 0;
+    m_maxWriteMicros = 0;
+    m_extentFull = false;
+    m_staged = 0;
+    m_stagedFrames = 0;
+    m_committedBlocks = 0;
+
+    if (m_format == FORMAT_LOSSLESS) {
+        writeLosslessHeader(sampleRate, channelCount);
+    } else {
+        writeHeader(sampleRate, channelCount);
+    }
+
+    // Reserve the whole take before any audio arrives so that neither FAT
+    // nor cluster allocation has to happen while recording. Lossless takes
+    // reserve the same, the unused part is given back on close.
+    if (!allocateExtent(sampleRate * channelCount * 2)) {
+        Serial.println("No contiguous space, falling back to growing file.");
+    }
+
+    if (!writeHeaderSector()) {
+        Serial.println("Could not write WAV header.");
+        m_file.close();
+        m_holdPreroll = false;
         return false;
     }
 
-    m_queue.begin();
+    // Min/max peaks are collected as the audio goes out, so the editor can
+    // show the take without reading it back.
+    uint32_t maxBlocks =
+        m_extentBytes > 0 ? (m_extentBytes - HEADER_BYTES) / BLOCK_BYTES : 0;
+    m_peaks.open(PeakFileWriter::sidecarPath(fileName).c_str(), maxBlocks,
+                 m_channels);
+
+    m_display.clear();
+    m_lastCommitMillis = millis();
+
+    // Whatever the ring holds at this point is the start of the take. It
+    // drains a burst per pass like live audio does, so no single pass holds
+    // the card long enough to starve the player's refill.
+    noInterrupts();
     m_isWriting = true;
-    m_totalBytesWritten = 0;
+    m_holdPreroll = false;
+    bool capturing = m_armed;
+    m_armed = false;
+    interrupts();
 
-    writeHeader(sampleRate, channelCount);
+    if (!capturing) startCapture();
     return true;
 }
 
+void WavFileWriter::startCapture() {
+#if WAV_WRITER_INTERRUPT_DRIVEN
+    s_activeWriter = this;
+    m_event.setContext(this);
+    m_event.attachInterrupt(onAudioBlocks);
+    m_sink.setEvent(&m_event);
+#endif
+    m_sink.begin();
+}
+
+void WavFileWriter::stopCapture() {
+#if WAV_WRITER_INTERRUPT_DRIVEN
+    m_sink.setEvent(nullptr);
+    m_event.detach();
+    s_activeWriter = nullptr;
+#endif
+    m_sink.end();
+}
+
+void WavFileWriter::arm(unsigned int sampleRate, unsigned int channelCount) {
+    uint16_t decimation = decimationFor(sampleRate);
+    if (PREROLL_BLOCKS == 0 || m_armed || m_isWriting || decimation == 0) {
+        return;
+    }
+
+    m_channels = channelCount == 2 ? 2 : 1;
+    m_sampleRate = sampleRate;
+    m_sink.setChannels(m_channels);
+    m_sink.setDecimation(decimation);
+    m_sink.reset();
+    m_scannedBlocks = 0;
+    m_armed = true;
+    startCapture();
+}
+
+uint16_t WavFileWriter::decimationFor(unsigned int sampleRate) {
+    // The audio clock isn't exactly 44.1 kHz, so compare loosely
+    for (uint16_t factor = 1; factor <= 4; factor *= 2) {
+        float rate = AUDIO_SAMPLE_RATE_EXACT / factor;
+        if (fabsf(rate - sampleRate) < rate * 0.01f) return factor;
+    }
+    return 0;
+}
+
+void WavFileWriter::disarm() {
+    if (!m_armed) return;
+
+    stopCapture();
+    m_armed = false;
+}
+
+void WavFileWriter::onAudioBlocks(EventResponderRef event) {
+    WavFileWriter* writer = static_cast<WavFileWriter*>(event.getContext());
+
+    // Someone else is on the card. The ring absorbs the delay and
+    // unlockCard() picks the work up again.
+    if (s_cardLocks > 0) {
+        s_serviceDeferred = true;
+        return;
+    }
+    writer->service();
+}
+
+void WavFileWriter::lockCard() {
+    noInterrupts();
+    s_cardLocks = s_cardLocks + 1;
+    interrupts();
+}
+
+void WavFileWriter::unlockCard() {
+    noInterrupts();
+    s_cardLocks = s_cardLocks - 1;
+    bool resume = s_cardLocks == 0 && s_serviceDeferred;
+    if (resume) s_serviceDeferred = false;
+    interrupts();
+
+    WavFileWriter* writer = s_activeWriter;
+    if (resume && writer) writer->m_event.triggerEvent();
+}
+
+bool WavFileWriter::isCardLocked() { return s_cardLocks > 0; }
+
 bool WavFileWriter::isWriting() { return m_isWriting; }
 
+bool WavFileWriter::allocateExtent(uint32_t bytesPerSecond) {
+    m_extentBytes = 0;
+    m_rawSectors = false;
+
+    uint64_t extent =
+        (uint64_t)WAV_WRITER_MAX_TAKE_SECONDS * bytesPerSecond + HEADER_BYTES;
+    if (extent > MAX_FILE_BYTES) extent = MAX_FILE_BYTES;
+    const uint64_t minExtent = (uint64_t)bytesPerSecond * 10 + HEADER_BYTES;
+
+    // Ask for the configured maximum first and back off until the card can
+    // provide a contiguous run of clusters.
+    while (extent >= minExtent) {
+        extent &= ~(uint64_t)(SECTOR_BYTES - 1);
+        if (m_file.preAllocate(extent)) break;
+        extent /= 2;
+    }
+    if (extent < minExtent) return false;
+
+    m_extentBytes = extent;
+
+    // On exFAT pre-allocated space past the valid length reads back as
+    // zeros, so data has to go through the file API there. The clusters are
+    // still reserved, which keeps the bitmap and FAT untouched mid-take.
+    uint32_t firstSector, lastSector;
+    if (SD.sdfs.fatType() != FAT_TYPE_EXFAT &&
+        m_file.contiguousRange(&firstSector, &lastSector)) {
+        // Commit the directory entry now, while nothing is being recorded
+        m_file.sync();
+        m_firstSector = firstSector;
+        m_rawSectors = true;
+    }
+
+    Serial.printf("Pre-allocated %lu KB (%s)\n",
+                  (unsigned long)(m_extentBytes / 1024),
+                  m_rawSectors ? "raw sectors" : "file writes");
+    return true;
+}
+
 void WavFileWriter::writeHeader(unsigned int sampleRate,
                                 unsigned int channelCount) {
-    // Write the main chunk ID
-    uint8_t mainChunkId[4] = {'R', 'I', 'F', 'F'};
-    m_file.write(mainChunkId, sizeof(mainChunkId));
-
-    // Write the main chunk header
-    uint32_t mainChunkSize = 0;  // placeholder, will be written on closing
-    encode(m_file, mainChunkSize);
-    uint8_t mainChunkFormat[4] = {'W', 'A', 'V', 'E'};
-    m_file.write(mainChunkFormat, sizeof(mainChunkFormat));
-
-    // Write the sub-chunk 1 ("format") id and size
-    uint8_t fmtChunkId[4] = {'f', 'm', 't', ' '};
-    m_file.write(fmtChunkId, sizeof(fmtChunkId));
-    uint32_t fmtChunkSize = 16;
-    encode(m_file, fmtChunkSize);
-
-    // Write the format (PCM)
-    uint16_t format = 1;
-    encode(m_file, format);
-
-    // Write the sound attributes
-    encode(m_file, static_cast<uint16_t>(channelCount));
-    encode(m_file, static_cast<uint32_t>(sampleRate));
+    memset(m_header, 0, sizeof(m_header));
+    uint8_t* p = m_header;
+
+    // Main chunk, size is a placeholder until closing
+    p = encode(p, "RIFF");
+    p = encode(p, static_cast<uint32_t>(0));
+    p = encode(p, "WAVE");
+
+    // Sub-chunk 1 ("format") id and size
+    p = encode(p, "fmt ");
+    p = encode(p, static_cast<uint32_t>(16));
+
+    // Format (PCM) and sound attributes
+    p = encode(p, static_cast<uint16_t>(1));
+    p = encode(p, static_cast<uint16_t>(channelCount));
+    p = encode(p, static_cast<uint32_t>(sampleRate));
     uint32_t byteRate = sampleRate * channelCount * 2;
-    encode(m_file, byteRate);
+    p = encode(p, byteRate);
     uint16_t blockAlign = channelCount * 2;
-    encode(m_file, blockAlign);
+    p = encode(p, blockAlign);
     uint16_t bitsPerSample = 16;
-    encode(m_file, bitsPerSample);
+    p = encode(p, bitsPerSample);
+
+    // Pad up to the data chunk header at the end of the sector. Readers
+    // skip unknown chunks, so the audio ends up starting at byte 512.
+    uint32_t junkSize = (m_header + DATA_SIZE_OFFSET - 4) - (p + 8);
+    p = encode(p, "JUNK");
+    p = encode(p, junkSize);
+    p += junkSize;
+
+    // Sub-chunk 2 ("data") id and size, placeholder until closing
+    p = encode(p, "data");
+    encode(p, static_cast<uint32_t>(0));
+}
+
+void WavFileWriter::writeLosslessHeader(unsigned int sampleRate,
+                                        unsigned int channelCount) {
+    memset(m_header, 0, sizeof(m_header));
+    uint8_t* p = m_header;
+
+    p = encode(p, "NMLC");
+    p = encode(p, LosslessCodec::VERSION);
+    p = encode(p, static_cast<uint16_t>(channelCount));
+    p = encode(p, static_cast<uint32_t>(sampleRate));
+    p = encode(p, static_cast<uint32_t>(0));  // total frames
+    p = encode(p, static_cast<uint32_t>(0));  // data bytes
+    p = encode(p, static_cast<uint16_t>(AUDIO_BLOCK_SAMPLES));
+    encode(p, static_cast<uint16_t>(16));
+}
 
-    // Write the sub-chunk 2 ("data") id and size
-    uint8_t dataChunkId[4] = {'d', 'a', 't', 'a'};
-    m_file.write(dataChunkId, sizeof(dataChunkId));
-    uint32_t dataChunkSize = 0;  // placeholder, will be written on closing
-    encode(m_file, dataChunkSize);
+void WavFileWriter::patchHeader() {
+    if (m_format == FORMAT_LOSSLESS) {
+        uint32_t totalFrames =
+            m_committedBlocks * AUDIO_BLOCK_SAMPLES / m_channels;
+        encode(m_header + LOSSLESS_FRAMES_OFFSET, totalFrames);
+        encode(m_header + LOSSLESS_BYTES_OFFSET, m_dataBytesWritten);
+        return;
+    }
 
-    m_totalBytesWritten += 44;
+    encode(m_header + RIFF_SIZE_OFFSET,
+           static_cast<uint32_t>(HEADER_BYTES - 8 + m_dataBytesWritten));
+    encode(m_header + DATA_SIZE_OFFSET, m_dataBytesWritten);
+}
+
+bool WavFileWriter::writeHeaderSector() {
+    if (m_rawSectors) {
+        return SD.sdfs.card()->writeSector(m_firstSector, m_header);
+    }
+
+    m_file.seekSet(0);
+    bool ok = m_file.write(m_header, HEADER_BYTES) == HEADER_BYTES;
+    m_file.seekSet(HEADER_BYTES + m_dataBytesWritten);
+    return ok;
+}
+
+bool WavFileWriter::writeData(const uint8_t* data, size_t bytes) {
+    uint32_t start = micros();
+    bool ok;
+
+    if (m_rawSectors) {
+        FsBlockDevice* card = SD.sdfs.card();
+        uint32_t sector =
+            m_firstSector + (HEADER_BYTES + m_dataBytesWritten) / SECTOR_BYTES;
+        size_t wholeSectors = bytes / SECTOR_BYTES;
+        size_t tail = bytes % SECTOR_BYTES;
+
+        ok = wholeSectors == 0 ||
+             card->writeSectors(sector, data, wholeSectors);
+
+        // Only the last write of a take can end mid-sector
+        if (ok && tail > 0) {
+            memcpy(m_sector, data + wholeSectors * SECTOR_BYTES, tail);
+            memset(m_sector + tail, 0, SECTOR_BYTES - tail);
+            ok = card->writeSector(sector + wholeSectors, m_sector);
+        }
+    } else {
+        ok = m_file.write(data, bytes) == bytes;
+    }
+
+    uint32_t elapsed = micros() - start;
+    if (elapsed > m_maxWriteMicros) m_maxWriteMicros = elapsed;
+    audioDiagnostics.recordSdWrite(elapsed);
+
+    if (ok) m_dataBytesWritten += bytes;
+    return ok;
+}
+
+uint32_t WavFileWriter::worstCaseBlockBytes() const {
+    if (m_format != FORMAT_LOSSLESS) return BLOCK_BYTES;
+
+    // A frame spans one slot per channel
+    return (LosslessCodec::maxFrameBytes(m_channels) + m_channels - 1) /
+           m_channels;
+}
+
+void WavFileWriter::encodeBlocks(uint32_t first, uint32_t blocks) {
+    for (uint32_t i = 0; i < blocks; i += m_channels) {
+        const int16_t* block =
+            reinterpret_cast<const int16_t*>(ringSlot(first + i));
+        m_staged += LosslessCodec::encodeFrame(block, m_channels,
+                                               m_staging + m_staged);
+        m_frameEnds[m_stagedFrames++] = m_staged;
+    }
+}
+
+void WavFileWriter::writeStaged(bool flushAll) {
+    // Keep the card writes sector aligned until the very last one
+    size_t bytes = flushAll ? m_staged : m_staged & ~(SECTOR_BYTES - 1);
+    if (bytes == 0) return;
+
+    if (!writeData(m_staging, bytes)) {
+        Serial.println("SD write failed.");
+    }
+
+    uint32_t done = 0;
+    while (done < m_stagedFrames && m_frameEnds[done] <= bytes) done++;
+    m_committedBlocks += done * m_channels;
+
+    // Move the partial sector to the front for the next burst
+    memmove(m_staging, m_staging + bytes, m_staged - bytes);
+    for (uint32_t i = done; i < m_stagedFrames; i++) {
+        m_frameEnds[i - done] = m_frameEnds[i] - bytes;
+    }
+    m_stagedFrames -= done;
+    m_staged -= bytes;
+}
+
+void WavFileWriter::commit() {
+    // A single sector write in raw mode: the directory entry already spans
+    // the whole extent, so the header is the only thing that goes stale.
+    patchHeader();
+    writeHeaderSector();
+
+    // A growing file also needs its directory entry size brought up to date
+    if (!m_rawSectors) m_file.sync();
+
+    m_lastCommitMillis = millis();
 }
 
 bool WavFileWriter::update() {
-    if (!m_isWriting) return false;
+#if WAV_WRITER_INTERRUPT_DRIVEN
+    // Everything happens in onAudioBlocks()
+    return false;
+#else
+    return service();
+#endif
+}
+
+bool WavFileWriter::service() {
+    if (!m_isWriting) {
+        if (m_armed) scanBlocks();
+        return false;
+    }
 
-    if (m_queue.available() < 2) return false;
-
-    // Fetch 2 blocks from the audio library and copy
-    // into a 512 byte buffer.  The Arduino SD library
-    // is most efficient when full 512 byte sector size
-    // writes are used.
-    memcpy(m_buffer, m_queue.readBuffer(), 256);
-    m_queue.freeBuffer();
-    memcpy(m_buffer + 256, m_queue.readBuffer(), 256);
-    m_queue.freeBuffer();
-
-    // write all 512 bytes to the SD card
-    m_file.write(m_buffer, 512);
-    m_totalBytesWritten += 512;
-
-    for (size_t i = 0; i < 512; i += 2) {
-        if (m_accumulatedSampleCount < MAX_ACCUMULATED_SAMPLES) {
-            // Convert little-endian bytes to int16_t
-            int16_t sample = (m_buffer[i + 1] << 8) | m_buffer[i];
-            m_accumulatedBuffer[m_accumulatedSampleCount++] = sample;
+    scanBlocks();
+    if (flushRing(false)) return true;
+
+    // Only commit on a pass that didn't write a burst, so a single update
+    // never holds off the next drain for longer than one card write.
+    if (m_commitIntervalMs > 0 &&
+        millis() - m_lastCommitMillis >= m_commitIntervalMs) {
+        commit();
+    }
+    return false;
+}
+
+uint8_t* WavFileWriter::ringSlot(uint32_t index) {
+    return reinterpret_cast<uint8_t*>(m_sink.slot(index));
+}
+
+void WavFileWriter::scanBlocks() {
+    uint32_t head = m_sink.headIndex();
+
+    if (!m_isWriting) {
+        // While armed only the last PREROLL_BLOCKS are kept. The window
+        // moves a burst at a time so the tail stays burst aligned for raw
+        // sector writes.
+        while (!m_holdPreroll &&
+               head - m_sink.tailIndex() >= PREROLL_BLOCKS + FLUSH_BLOCKS) {
+            m_sink.consume(FLUSH_BLOCKS);
         }
+        m_scannedBlocks = head;
+        return;
+    }
+
+    // The blocks are already in place, the live display just gets a look
+    // at the new ones
+    for (; m_scannedBlocks != head; m_scannedBlocks++) {
+        m_display.addBlock(
+            reinterpret_cast<const int16_t*>(ringSlot(m_scannedBlocks)));
     }
 
+    uint32_t fill = head - m_sink.tailIndex();
+    if (fill > m_ringHighWater) m_ringHighWater = fill;
+    audioDiagnostics.recordRingDepth(fill);
+}
+
+bool WavFileWriter::flushRing(bool flushAll) {
+    // A pre-roll just taken over counts as pending too. The ring has room
+    // for a full set of live blocks on top of it, so working it off a burst
+    // at a time never costs live audio.
+    uint32_t pending = m_scannedBlocks - m_sink.tailIndex();
+
+    // Outside of close() only whole bursts are written
+    if (!flushAll && pending < FLUSH_BLOCKS) return false;
+
+    writeBlocks(flushAll ? pending : FLUSH_BLOCKS);
+    if (flushAll && m_format == FORMAT_LOSSLESS) writeStaged(true);
     return true;
 }
 
+void WavFileWriter::writeBlocks(uint32_t count) {
+    // The staging buffer holds one burst of encoded frames at most
+    bool lossless = m_format == FORMAT_LOSSLESS;
+
+    while (count > 0) {
+        uint32_t tail = m_sink.tailIndex();
+        uint32_t slot = tail % RING_BLOCKS;
+        uint32_t blocks = RING_BLOCKS - slot;
+        if (blocks > count) blocks = count;
+        if (lossless && blocks > FLUSH_BLOCKS) blocks = FLUSH_BLOCKS;
+
+        if (m_extentBytes > 0) {
+            uint64_t room =
+                m_extentBytes - HEADER_BYTES - m_dataBytesWritten - m_staged;
+            uint32_t blockBytes = worstCaseBlockBytes();
+            if ((uint64_t)blocks * blockBytes > room) {
+                blocks = room / blockBytes;
+                blocks -= blocks % m_channels;  // whole frames only
+                m_extentFull = true;
+            }
+        }
+
+        for (uint32_t i = 0; i < blocks; i++) {
+            m_peaks.addBlock(
+                reinterpret_cast<const int16_t*>(ringSlot(tail + i)));
+        }
+
+        if (lossless) {
+            encodeBlocks(tail, blocks);
+            writeStaged(false);
+        } else if (blocks > 0 &&
+                   !writeData(ringSlot(tail), blocks * BLOCK_BYTES)) {
+            Serial.println("SD write failed.");
+        }
+        m_sink.consume(blocks);
+        count -= blocks;
+
+        if (m_extentFull) {
+            // Whatever didn't fit is lost
+            uint32_t lost = m_scannedBlocks - m_sink.tailIndex();
+            m_droppedBlocks += lost;
+            audioDiagnostics.recordDroppedBlocks(lost);
+            m_sink.consume(lost);
+            break;
+        }
+    }
+}
+
 bool WavFileWriter::close() {
     if (!m_isWriting) return false;
 
-    m_queue.end();
-    while (m_queue.available() > 0) {
-        m_file.write(reinterpret_cast<const uint8_t*>(m_queue.readBuffer()),
-                     256);
-        m_queue.freeBuffer();
-        m_totalBytesWritten += 256;
-    }
+    // Stop the interrupt first, the rest of the take is written from here,
+    // with the player's refill held off
+    stopCapture();
+    SdCardLock cardLock;
+    scanBlocks();
+    flushRing(true);
 
     Serial.print("Done! Max no. of audio blocks used: ");
     Serial.println(AudioMemoryUsageMax());
     Serial.print("Bytes written: ");
-    Serial.println(m_totalBytesWritten);
-
-    m_file.flush();
+    Serial.println(HEADER_BYTES + m_dataBytesWritten);
+    Serial.print("Ring high-water mark (slots): ");
+    Serial.println(m_ringHighWater);
+    Serial.print("Sink overruns (audio updates): ");
+    Serial.println(getOverruns());
+    Serial.print("Dropped at full extent (slots): ");
+    Serial.println(getDroppedBlocks());
+    Serial.print("Worst write latency (us): ");
+    Serial.println(m_maxWriteMicros);
+    if (m_channels == 2) {
+        Serial.print("Worst interleave cost (cycles per sample): ");
+        Serial.println((float)m_sink.getInterleaveCycles() /
+                       (AUDIO_BLOCK_SAMPLES * 2));
+    }
 
     // Update the main chunk size and data sub-chunk size
-    uint32_t mainChunkSize = m_totalBytesWritten - 8;  // 8 bytes RIFF header
-    uint32_t dataChunkSize =
-        m_totalBytesWritten - 44;  // 44 bytes RIFF + WAVE headers
-    m_file.seek(4);
-    encode(m_file, mainChunkSize);
-    m_file.seek(40);
-    encode(m_file, dataChunkSize);
+    patchHeader();
+    writeHeaderSector();
+
+    // Give back the part of the extent the take didn't use
+    if (m_extentBytes > 0) {
+        m_file.truncate(HEADER_BYTES + m_dataBytesWritten);
+    }
 
     m_file.close();
+    m_peaks.close();
 
     m_isWriting = false;
     return true;
 }
 
-const int16_t* WavFileWriter::getAccumulatedBuffer(size_t& sampleCount) {
-    sampleCount = m_accumulatedSampleCount;
-    return m_accumulatedBuffer;
+bool WavFileWriter::findDataChunk(const uint8_t* header, size_t length,
+                                  uint32_t& dataOffset, uint32_t& dataSize) {
+    if (length < 12 || memcmp(header, "RIFF", 4) != 0 ||
+        memcmp(header + 8, "WAVE", 4) != 0) {
+        return false;
+    }
+
+    size_t position = 12;
+    while (position + 8 <= length) {
+        const uint8_t* chunk = header + position;
+        uint32_t chunkSize = chunk[4] | (chunk[5] << 8) | (chunk[6] << 16) |
+                             ((uint32_t)chunk[7] << 24);
+        if (memcmp(chunk, "data", 4) == 0) {
+            dataOffset = position + 8;
+            dataSize = chunkSize;
+            return true;
+        }
+        position += 8 + chunkSize + (chunkSize & 1);
+    }
+    return false;
 }
 
-void WavFileWriter::clearAccumulatedBuffer() { m_accumulatedSampleCount = 0; }
+bool WavFileWriter::repairFile(FsFile& file) {
+    uint8_t header[HEADER_BYTES];
+    uint64_t fileSize = file.fileSize();
+    int length = file.read(header, sizeof(header));
+
+    if (length >= (int)sizeof(LosslessHeader) &&
+        LosslessCodec::isHeader(header)) {
+        // The header itself holds nothing that depends on the file length,
+        // so only the unused tail of the extent has to go
+        const uint8_t* p = header + LOSSLESS_BYTES_OFFSET;
+        uint32_t dataBytes =
+            p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        uint64_t end = LosslessCodec::HEADER_BYTES + (uint64_t)dataBytes;
+        if (end >= fileSize) return false;
+
+        file.truncate(end);
+        file.sync();
+        return true;
+    }
 
-void WavFileWriter::encode(File& file, uint16_t value) {
-    uint8_t bytes[] = {static_cast<uint8_t>(value & 0xFF),
-                       static_cast<uint8_t>(value >> 8)};
-    file.write(reinterpret_cast<const uint8_t*>(bytes), sizeof(bytes));
+    uint32_t dataOffset, dataSize;
+    if (length <= 0 || !findDataChunk(header, length, dataOffset, dataSize)) {
+        return false;
+    }
+
+    uint32_t riffSize = header[4] | (header[5] << 8) | (header[6] << 16) |
+                        ((uint32_t)header[7] << 24);
+    if (riffSize + 8 == fileSize && dataOffset + dataSize <= fileSize) {
+        return false;  // closed properly
+    }
+
+    // Keep what the last commit vouched for. Anything past it is either the
+    // unused tail of a pre-allocated extent or never reached the card.
+    uint64_t available = fileSize > dataOffset ? fileSize - dataOffset : 0;
+    if (dataSize > available) dataSize = available;
+    dataSize &= ~1u;
+
+    encode(header + RIFF_SIZE_OFFSET,
+           static_cast<uint32_t>(dataOffset - 8 + dataSize));
+    encode(header + dataOffset - 4, dataSize);
+
+    file.seekSet(0);
+    file.write(header, dataOffset);
+    file.truncate(dataOffset + dataSize);
+    file.sync();
+    return true;
+}
+
+void WavFileWriter::repairRecordings(const char* dirPath) {
+    FsFile dir = SD.sdfs.open(dirPath);
+    if (!dir) return;
+
+    FsFile entry;
+    char name[64];
+    while (entry.openNext(&dir, O_RDWR)) {
+        size_t nameLength = entry.getName(name, sizeof(name));
+        const char* extension = nameLength > 4 ? name + nameLength - 4 : "";
+        bool isTake = strcasecmp(extension, ".wav") == 0 ||
+                      strcasecmp(extension, ".nmc") == 0;
+
+        if (!entry.isDir() && isTake && repairFile(entry)) {
+            Serial.print("Repaired interrupted take: ");
+            Serial.println(name);
+        }
+        entry.close();
+    }
+    dir.close();
+}
+
+uint8_t* WavFileWriter::encode(uint8_t* dst, const char* id) {
+    memcpy(dst, id, 4);
+    return dst + 4;
+}
+
+uint8_t* WavFileWriter::encode(uint8_t* dst, uint16_t value) {
+    dst[0] = static_cast<uint8_t>(value & 0xFF);
+    dst[1] = static_cast<uint8_t>(value >> 8);
+    return dst + 2;
 }
 
-void WavFileWriter::encode(File& file, uint32_t value) {
-    uint8_t bytes[] = {
-        static_cast<uint8_t>(value & 0x000000FF),
-        static_cast<uint8_t>((value & 0x0000FF00) >> 8),
-        static_cast<uint8_t>((value & 0x00FF0000) >> 16),
-        static_cast<uint8_t>((value & 0xFF000000) >> 24),
-    };
-    file.write(reinterpret_cast<const uint8_t*>(bytes), sizeof(bytes));
-}
\ No newline at end of file
+uint8_t* WavFileWriter::encode(uint8_t* dst, uint32_t value) {
+    dst[0] = static_cast<uint8_t>(value & 0x000000FF);
+    dst[1] = static_cast<uint8_t>((value & 0x0000FF00) >> 8);
+    dst[2] = static_cast<uint8_t>((value & 0x00FF0000) >> 16);
+    dst[3] = static_cast<uint8_t>((value & 0xFF000000) >> 24);
+    return dst + 4;
+}
@@ -3,36 +3,241 @@
 
 #include <Arduino.h>
 #include <Audio.h>
+#include <EventResponder.h>
 #include <SD.h>
 
+#include "LosslessCodec.hpp"
+#include "PeakDecimator.hpp"
+#include "PeakFileWriter.hpp"
+#include "audio-extensions/record_sink.h"
+
+// Size of the RAM ring that sits between the record sink and the SD card.
+// At 44.1 kHz mono 64 KB holds ~740 ms of audio (half that in stereo), enough
+// to ride out the erase/allocation stalls that slower cards show every few
+// hundred ms.
+#ifndef WAV_WRITER_RING_KB
+#define WAV_WRITER_RING_KB 64
+#endif
+
+// Size of a single burst written to the card. Must be a multiple of the
+// 512 byte sector size and divide the ring size evenly.
+#ifndef WAV_WRITER_FLUSH_KB
+#define WAV_WRITER_FLUSH_KB 8
+#endif
+
+// Longest take the writer reserves space for up front. The extent is shrunk
+// automatically when the card can't provide a contiguous run that large.
+#ifndef WAV_WRITER_MAX_TAKE_SECONDS
+#define WAV_WRITER_MAX_TAKE_SECONDS 3600
+#endif
+
+// How often the header (and, for growing files, the directory entry) is
+// brought up to date while recording. At most this much audio is lost when
+// power goes away mid-take.
+#ifndef WAV_WRITER_COMMIT_INTERVAL_MS
+#define WAV_WRITER_COMMIT_INTERVAL_MS 2000
+#endif
+
+// Audio kept while the recorder is armed and prepended to the next take.
+// It lives in the same DMAMEM ring, on top of WAV_WRITER_RING_KB, and needs
+// the interrupt driven writer. Sized for 44.1 kHz mono: stereo gets half as
+// long, the lower rates two or four times as long. 0 disables it.
+#ifndef WAV_WRITER_PREROLL_SECONDS
+#define WAV_WRITER_PREROLL_SECONDS 2
+#endif
+
+// Drain and write from a low-priority software interrupt fired by the record
+// sink, instead of waiting for loop() to call update(). Set to 0 to go back
+// to polling.
+#ifndef WAV_WRITER_INTERRUPT_DRIVEN
+#define WAV_WRITER_INTERRUPT_DRIVEN 1
+#endif
+
 class WavFileWriter {
    public:
-    WavFileWriter(AudioRecordQueue& queue);
+    enum Format {
+        FORMAT_WAV = 0,
+        FORMAT_LOSSLESS = 1  // ".nmc", see LosslessCodec.hpp
+    };
+
+    WavFileWriter(AudioRecordSink& sink);
 
-    const int16_t* getAccumulatedBuffer(size_t& sampleCount);
-    void clearAccumulatedBuffer();
+    // Applies to the next take opened
+    void setFormat(Format format) { m_format = format; }
+    Format getFormat() const { return m_format; }
+    static const char* fileExtension(Format format) {
+        return format == FORMAT_LOSSLESS ? ".nmc" : ".wav";
+    }
 
+    // Live display: one column per `blocksPerColumn` recorded blocks
+    void setDisplayResolution(uint32_t blocksPerColumn) {
+        m_display.reset(blocksPerColumn);
+    }
+    bool readDisplayColumn(PeakColumn& column) {
+        return m_display.read(column);
+    }
+
+    // Starts capturing into the pre-roll. The next open() writes whatever
+    // was captured ahead of the live audio, if it asks for the same rate
+    // and number of channels.
+    void arm(unsigned int sampleRate = 44100, unsigned int channelCount = 1);
+    void disarm();
+    bool isArmed() const { return m_armed; }
+
+    // Mono records input 0 of the sink, stereo interleaves inputs 0 and 1.
+    // 22050 and 11025 Hz are decimated from the audio rate by the sink.
     bool open(const char* fileName, unsigned int sampleRate = 44100,
               unsigned int channelCount = 1);
     bool isWriting();
+    // Only needed with WAV_WRITER_INTERRUPT_DRIVEN set to 0
     bool update();
     bool close();
-    File& getFile() { return m_file; }
+    FsFile& getFile() { return m_file; }
+
+    // 0 disables periodic commits, the header is then only written on close
+    void setCommitInterval(uint32_t intervalMs) {
+        m_commitIntervalMs = intervalMs;
+    }
+
+    // Fixes up takes that were cut off by a reset or power loss, using the
+    // last committed header. Meant to be called once at boot.
+    static void repairRecordings(const char* dirPath);
+
+    // Other code that uses the SD card while a take is running has to hold
+    // the card for the duration, see SdCardLock below. Writer passes that
+    // come in meanwhile are deferred until the card is released.
+    static void lockCard();
+    static void unlockCard();
+    static bool isCardLocked();
+
+    // True once the pre-allocated extent is used up. Further audio is dropped.
+    bool isFull() const { return m_extentFull; }
+
+    // Ring slots lost to a full extent
+    uint32_t getDroppedBlocks() const { return m_droppedBlocks; }
+    // Audio updates the sink had no ring room for, a frame count of
+    // AUDIO_BLOCK_SAMPLES / decimation each
+    uint32_t getOverruns() const { return m_sink.getOverruns(); }
+    uint32_t getRingHighWater() const { return m_ringHighWater; }
+    uint32_t getMaxWriteMicros() const { return m_maxWriteMicros; }
+
+    // The header is padded to a full sector with a JUNK chunk so the audio
+    // data starts sector aligned and can be streamed with raw sector writes.
+    static const size_t HEADER_BYTES = 512;
 
    private:
+    static const size_t SECTOR_BYTES = 512;
+    // One ring slot: a mono audio block, or half of an interleaved stereo one.
+    // Block counts below are all in slots.
+    static const size_t BLOCK_BYTES = AUDIO_BLOCK_SAMPLES * sizeof(int16_t);
+    static const size_t RING_BYTES = WAV_WRITER_RING_KB * 1024;
+    static const size_t FLUSH_BYTES = WAV_WRITER_FLUSH_KB * 1024;
+    static const uint32_t FLUSH_BLOCKS = FLUSH_BYTES / BLOCK_BYTES;
+
+    // Pre-roll rounded up to whole bursts, so the ring stays a multiple of
+    // the burst size
+#if WAV_WRITER_INTERRUPT_DRIVEN
+    static const uint32_t PREROLL_BLOCKS =
+        ((uint32_t)(WAV_WRITER_PREROLL_SECONDS * AUDIO_SAMPLE_RATE_EXACT) /
+             AUDIO_BLOCK_SAMPLES +
+         FLUSH_BLOCKS - 1) /
+        FLUSH_BLOCKS * FLUSH_BLOCKS;
+#else
+    static const uint32_t PREROLL_BLOCKS = 0;
+#endif
+    static const uint32_t RING_BLOCKS =
+        RING_BYTES / BLOCK_BYTES + PREROLL_BLOCKS;
+
+    static uint8_t s_ringStorage[RING_BLOCKS * BLOCK_BYTES];
+
+    // Encoded frames wait here until a whole sector's worth can go out. A
+    // burst never holds more than FLUSH_BLOCKS frames plus a partial sector.
+    static const size_t STAGING_BYTES =
+        FLUSH_BLOCKS * LosslessCodec::maxFrameBytes(1) + SECTOR_BYTES;
+    static const size_t MIN_FRAME_BYTES = 2 + 1 + AUDIO_BLOCK_SAMPLES / 8;
+    static const size_t MAX_STAGED_FRAMES = STAGING_BYTES / MIN_FRAME_BYTES;
+
     void writeHeader(unsigned int sampleRate, unsigned int channelCount);
-    void encode(File& file, uint16_t value);
-    void encode(File& file, uint32_t value);
-
-    bool m_isWriting;
-    AudioRecordQueue& m_queue;
-    File m_file;
-    uint8_t m_buffer[512];
-    uint32_t m_totalBytesWritten;
-
-    static const size_t MAX_ACCUMULATED_SAMPLES = 44100;  // ~0.5 sec at 44.1kHz
-    int16_t m_accumulatedBuffer[MAX_ACCUMULATED_SAMPLES];
-    size_t m_accumulatedSampleCount;
+    void writeLosslessHeader(unsigned int sampleRate,
+                             unsigned int channelCount);
+    void patchHeader();
+    static uint8_t* encode(uint8_t* dst, const char* id);
+    static uint8_t* encode(uint8_t* dst, uint16_t value);
+    static uint8_t* encode(uint8_t* dst, uint32_t value);
+
+    bool allocateExtent(uint32_t bytesPerSecond);
+    bool writeHeaderSector();
+    bool writeData(const uint8_t* data, size_t bytes);
+    void encodeBlocks(uint32_t first, uint32_t blocks);
+    void writeStaged(bool flushAll);
+    uint32_t worstCaseBlockBytes() const;
+    void commit();
+
+    static uint16_t decimationFor(unsigned int sampleRate);
+
+    static bool repairFile(FsFile& file);
+    static bool findDataChunk(const uint8_t* header, size_t length,
+                              uint32_t& dataOffset, uint32_t& dataSize);
+
+    bool service();
+    static void onAudioBlocks(EventResponderRef event);
+    void startCapture();
+    void stopCapture();
+
+    void scanBlocks();
+    bool flushRing(bool flushAll);
+    void writeBlocks(uint32_t count);
+    uint8_t* ringSlot(uint32_t index);
+
+    volatile bool m_isWriting;
+    volatile bool m_armed;
+    volatile bool m_holdPreroll;  // open() in progress, don't overwrite
+    Format m_format;
+    uint16_t m_channels;  // of the take, or of the pre-roll while armed
+    unsigned int m_sampleRate;
+    AudioRecordSink& m_sink;
+    EventResponder m_event;
+    FsFile m_file;
+    PeakFileWriter m_peaks;
+    PeakDecimator m_display;
+    uint8_t m_header[HEADER_BYTES];
+    uint8_t m_sector[SECTOR_BYTES];  // padding for a partial last sector
+    uint32_t m_dataBytesWritten;
+    uint32_t m_maxWriteMicros;
+    uint32_t m_commitIntervalMs;
+    uint32_t m_lastCommitMillis;
+
+    // Pre-allocated extent. When m_rawSectors is set the file is contiguous
+    // and audio goes straight to the card starting at m_firstSector.
+    uint64_t m_extentBytes;
+    uint32_t m_firstSector;
+    bool m_rawSectors;
+    bool m_extentFull;
+
+    // Block ring, filled by the sink from the audio interrupt. Its head
+    // counts blocks received, its tail blocks written to the card (or, while
+    // armed, the oldest block of the pre-roll). m_scannedBlocks trails the
+    // head by the blocks the live display hasn't seen yet. In stereo all of
+    // them move in pairs, so a frame never straddles the ring end.
+    uint32_t m_scannedBlocks;
+    uint32_t m_ringHighWater;
+    uint32_t m_droppedBlocks;
+
+    // Lossless staging. m_frameEnds holds the end offset of every frame in
+    // the staging buffer, so commits only count frames fully on the card.
+    // A stereo frame takes two ring slots, m_committedBlocks counts slots.
+    uint8_t m_staging[STAGING_BYTES];
+    size_t m_staged;
+    uint16_t m_frameEnds[MAX_STAGED_FRAMES];
+    uint32_t m_stagedFrames;
+    uint32_t m_committedBlocks;
+};
+
+// Holds the SD card for the enclosing scope
+class SdCardLock {
+   public:
+    SdCardLock() { WavFileWriter::lockCard(); }
+    ~SdCardLock() { WavFileWriter::unlockCard(); }
 };
 
 #endif  // WAVFILEWRITER_HPP
@@ -0,0 +1,28 @@
+#include "halfband_decimator.h"
+
+#include "sample_kernels.h"
+
+// Taps 1, 3, 5, ... away from the centre, the centre tap is 0.5. Sums to
+// unity gain at DC.
+static const int16_t coefficients[12] = {
+    10358, -3262, 1745, -1046, 639, -383, 219, -116, 55, -23, 7, -1};
+
+void HalfbandDecimator::reset(void) { memset(buffer, 0, sizeof(buffer)); }
+
+void HalfbandDecimator::process(const int16_t* in, int16_t* out, int count) {
+    const int centre = HISTORY / 2;
+    memcpy(buffer + HISTORY, in, count * sizeof(int16_t));
+
+    for (int i = 0; i < count / 2; i++) {
+        // Window of TAPS inputs ending at input 2i+1
+        const int16_t* x = buffer + i * 2 + 1 + centre;
+        int32_t acc = (int32_t)x[0] << 14;
+        for (int k = 0; k < 12; k++) {
+            int offset = k * 2 + 1;
+            acc += coefficients[k] * (x[-offset] + x[offset]);
+        }
+        out[i] = saturate16((acc + (1 << 14)) >> 15);
+    }
+
+    memmove(buffer, buffer + count, HISTORY * sizeof(int16_t));
+}
@@ -0,0 +1,33 @@
+#ifndef halfband_decimator_h_
+#define halfband_decimator_h_
+#include <Arduino.h>
+#include <AudioStream.h>
+
+// Halves the sample rate of a stream of 16 bit samples. A 47 tap half-band
+// FIR (Kaiser window) removes what would alias first. With the Q15 taps, in
+// terms of the input rate: within 0.013 dB up to 0.2 fs, -6 dB at 0.25 fs,
+// -57 dB at 0.3 fs and at least 75 dB down from 0.305 fs on. So whatever
+// folds back below 0.195 fs (8.6 kHz at a 44.1 kHz input) is 75 dB down.
+// DC gain is exactly 1. Every other tap of a half-band filter is zero and
+// the rest are symmetric, so each output costs 12 multiplies, and only
+// every second output is ever computed (polyphase). Coefficients are Q15,
+// accumulation is 32 bit.
+class HalfbandDecimator {
+   public:
+    static const int TAPS = 47;
+
+    HalfbandDecimator(void) { reset(); }
+
+    // Forgets the history, the next block starts from silence
+    void reset(void);
+    // `count` input samples, even and at most AUDIO_BLOCK_SAMPLES, give
+    // count / 2 output samples
+    void process(const int16_t* in, int16_t* out, int count);
+
+   private:
+    static const int HISTORY = TAPS - 1;
+
+    // Last HISTORY inputs, then the block being processed
+    int16_t buffer[HISTORY + AUDIO_BLOCK_SAMPLES];
+};
+#endif
@@ -29,8 +29,22 @@
 
 #include <Arduino.h>
 
+#include <atomic>
+
+#include "../AudioDiagnostics.h"
+#include "../WavFileWriter.hpp"
+#include "sample_kernels.h"
 #include "spi_interrupt.h"
 
+static_assert(PLAY_SD_WAV_PREFETCH_KB * 1024 % PLAY_SD_WAV_READ_BYTES == 0,
+              "Prefetch size must be a multiple of the read size");
+static_assert(PLAY_SD_WAV_LOOP_HEAD_KB * 1024 >=
+                  PLAY_SD_WAV_LOOP_FADE_FRAMES * 4,
+              "The loop head must hold the whole crossfade");
+
+// More than update() ever consumes for one block, at 4x speed
+static const uint32_t LOOP_AHEAD_BYTES = 4096;
+
 #define STATE_DIRECT_8BIT_MONO 0      // playing mono at native sample rate
 #define STATE_DIRECT_8BIT_STEREO 1    // playing stereo at native sample rate
 #define STATE_DIRECT_16BIT_MONO 2     // playing mono at native sample rate
@@ -47,14 +61,61 @@
 #define STATE_PAUSED 13
 #define STATE_STOP 14
 
+// The sketch and update() share the command ring and the snapshot, and
+// update() and refill() the seek request. Each is written on one side
+// only and published by a volatile index, these keep the compiler from
+// moving the data past the index. Everything runs on the one core.
+static inline void publish_fence(void) {
+    std::atomic_signal_fence(std::memory_order_release);
+}
+
+static inline void take_fence(void) {
+    std::atomic_signal_fence(std::memory_order_acquire);
+}
+
+// Q16, up to 16 times
+static int32_t volume_gain(float volumeScaleFactor) {
+    if (volumeScaleFactor < 0.0f) volumeScaleFactor = 0.0f;
+    if (volumeScaleFactor > 16.0f) volumeScaleFactor = 16.0f;
+    return (int32_t)(volumeScaleFactor * 65536.0f);
+}
+
 void AudioPlaySdWavExtended::begin(void) {
     state = STATE_STOP;
     state_play = STATE_STOP;
     data_length = 0;
+    total_length = 0;
     play_start_position = 0;
     play_end_position = 0;
-    volume_scale = 1.0;
-    data_start_offset = 0;
+    gain_current = 0;
+    gain_target = 65536;
+    speed = 65536;
+    interpolation = CUBIC;
+    memset(&layout, 0, sizeof(layout));
+    compressed = false;
+    command_head = 0;
+    command_tail = 0;
+    file_head = 0;
+    file_tail = 0;
+    last_file = (uint32_t)-1;
+    memset(&status, 0, sizeof(status));
+    status.state = STATE_STOP;
+    status_sequence = 0;
+    state_until = 0;
+    expected_state = EXPECT_STOPPED;
+    expected_looping = false;
+    seek_until = 0;
+    expected_frame = 0;
+    prefetch_head = 0;
+    prefetch_tail = 0;
+    prefetch_eof = true;
+    seek_sequence = 0;
+    seek_served = 0;
+    source_position = 0;
+    play_loop = false;
+    looping = false;
+    play_direction = FORWARD;
+    reverse = false;
     if (block_left) {
         release(block_left);
         block_left = NULL;
@@ -69,71 +130,320 @@ bool AudioPlaySdWavExtended::play(const char* filename) {
     return play(filename, 0, 0, 1.0);
 }
 
+// The header comes through the prefetch ring like everything else, so
+// the play doesn't count as started until update() has parsed it
 bool AudioPlaySdWavExtended::play(const char* filename, uint32_t startPosition,
                                   uint32_t endPosition,
                                   float volumeScaleFactor) {
-    stop();
+    if (!prepare(false)) return false;
 
-    // Store the playback parameters
-    play_start_position = startPosition;
-    play_end_position = endPosition;
-    volume_scale = volumeScaleFactor;
+    // refill() may be reading the card for the play before this one. Held
+    // until `file` is gone, so its reference is dropped with refill() out
+    // of the way too.
+    SdCardLock cardLock;
+    File file = SD.open(filename);
+    if (!file) return false;
 
-    bool irq = false;
-    if (NVIC_IS_ENABLED(IRQ_SOFTWARE)) {
-        NVIC_DISABLE_IRQ(IRQ_SOFTWARE);
-        irq = true;
+    PlayCommand play;
+    memset(&play, 0, sizeof(play));
+    play.start = startPosition;
+    play.end = endPosition;
+    play.gain = volume_gain(volumeScaleFactor);
+    play.direction = FORWARD;
+    play.parse = true;
+    return queue_play(file, play);
+}
+
+// Nothing here touches the card. The header is known already, so the
+// prefetch interrupt seeks straight to the audio once the next update()
+// has started the play, and the update() after has a block to send.
+bool AudioPlaySdWavExtended::play(File& file, const AudioSampleInfo& info,
+                                  uint32_t startPosition, uint32_t endPosition,
+                                  float volumeScaleFactor) {
+    return start_file(file, info, startPosition, endPosition,
+                      volumeScaleFactor, false);
+}
+
+bool AudioPlaySdWavExtended::playRegion(File& file,
+                                        const AudioSampleInfo& info,
+                                        uint32_t startFrame, uint32_t endFrame,
+                                        bool loop, float volumeScaleFactor) {
+    uint32_t frame_bytes = info.channels * (info.bitsPerSample / 8);
+    return start_file(file, info, startFrame * frame_bytes,
+                      endFrame * frame_bytes, volumeScaleFactor, loop);
+}
+
+bool AudioPlaySdWavExtended::start_file(File& file,
+                                        const AudioSampleInfo& info,
+                                        uint32_t startPosition,
+                                        uint32_t endPosition,
+                                        float volumeScaleFactor, bool loop) {
+    if (!file) return false;
+    if (play_direction != FORWARD && info.lossless) return false;
+    // What parse_format() takes, it's only run once the play starts
+    if (info.channels < 1 || info.channels > 2) return false;
+    if (info.bitsPerSample != 8 && info.bitsPerSample != 16) return false;
+    if (info.sampleRate != 44100 && info.sampleRate != 22050 &&
+        info.sampleRate != 11025) {
+        return false;
     }
-#if defined(HAS_KINETIS_SDHC)
-    if (!(SIM_SCGC3 & SIM_SCGC3_SDHC)) AudioStartUsingSPI();
-#else
-    AudioStartUsingSPI();
-#endif
-    wavfile = SD.open(filename);
-    if (!wavfile) {
-#if defined(HAS_KINETIS_SDHC)
-        if (!(SIM_SCGC3 & SIM_SCGC3_SDHC)) AudioStopUsingSPI();
-#else
-        AudioStopUsingSPI();
-#endif
-        if (irq) NVIC_ENABLE_IRQ(IRQ_SOFTWARE);
+    if (!prepare(loop && play_direction != PING_PONG)) return false;
+
+    PlayCommand play;
+    play.info = info;
+    play.start = startPosition;
+    play.end = endPosition;
+    play.gain = volume_gain(volumeScaleFactor);
+    play.direction = play_direction;
+    play.loop = loop;
+    play.parse = false;
+    return queue_play(file, play);
+}
+
+// Reads what play() needs from the start of a file, without playing it
+bool AudioPlaySdWavExtended::readInfo(File& file, AudioSampleInfo& info) {
+    uint8_t head[sizeof(LosslessHeader)];
+    if (!file.seek(0) || file.read(head, sizeof(head)) != sizeof(head)) {
         return false;
     }
-    buffer_length = 0;
-    buffer_offset = 0;
-    state_play = STATE_STOP;
-    data_length = 20;
-    header_offset = 0;
-    state = STATE_PARSE1;
-    if (irq) NVIC_ENABLE_IRQ(IRQ_SOFTWARE);
+
+    if (LosslessCodec::isHeader(head)) {
+        LosslessHeader lossless;
+        memcpy(&lossless, head, sizeof(lossless));
+        info.lossless = true;
+        info.channels = lossless.channels;
+        info.sampleRate = lossless.sampleRate;
+        info.bitsPerSample = 16;
+        info.dataOffset = LosslessCodec::HEADER_BYTES;
+        info.dataBytes = lossless.totalFrames * lossless.channels * 2;
+        info.encodedBytes = lossless.dataBytes;
+        return true;
+    }
+
+    uint32_t words[3];
+    memcpy(words, head, sizeof(words));
+    if (words[0] != 0x46464952 || words[2] != 0x45564157) return false;
+
+    // Walk the chunks up to "data", picking up "fmt " on the way
+    bool format = false;
+    uint32_t position = 12;
+    while (file.seek(position)) {
+        uint32_t chunk[2];
+        if (file.read(chunk, sizeof(chunk)) != sizeof(chunk)) return false;
+        if (chunk[0] == 0x20746D66) {
+            uint16_t fmt[8];
+            if (chunk[1] < 16 || file.read(fmt, 16) != 16) return false;
+            if (fmt[0] != 1) return false;
+            info.channels = fmt[1];
+            info.sampleRate = fmt[2] | ((uint32_t)fmt[3] << 16);
+            info.bitsPerSample = fmt[7];
+            format = true;
+        } else if (chunk[0] == 0x61746164) {
+            if (!format) return false;
+            info.lossless = false;
+            info.dataOffset = position + 8;
+            info.dataBytes = chunk[1];
+            info.encodedBytes = 0;
+            return true;
+        }
+        // Chunks are padded to an even length
+        position += 8 + chunk[1] + (chunk[1] & 1);
+    }
+    return false;
+}
+
+// Buffers are allocated here rather than in update(), and kept
+bool AudioPlaySdWavExtended::prepare(bool loop) {
+    if (!prefetch) {
+        prefetch = (uint8_t*)malloc(PREFETCH_BYTES);
+        if (!prefetch) return false;
+        prefetch_event.setContext(this);
+        prefetch_event.attachInterrupt(prefetch_handler);
+    }
+    if (loop && !loop_head) {
+        loop_head = (uint8_t*)malloc(LOOP_HEAD_BYTES + LOOP_FADE_BYTES);
+        if (!loop_head) return false;
+    }
     return true;
 }
 
-void AudioPlaySdWavExtended::stop(void) {
-    bool irq = false;
-    if (NVIC_IS_ENABLED(IRQ_SOFTWARE)) {
-        NVIC_DISABLE_IRQ(IRQ_SOFTWARE);
-        irq = true;
+// The file goes to refill() and the play to update(). A full ring means
+// update() isn't running, the play is refused rather than waited for.
+bool AudioPlaySdWavExtended::queue_play(File& file, PlayCommand& play) {
+    uint32_t head = file_head;
+    if (head - file_tail >= FILE_SLOTS ||
+        command_head - command_tail >= COMMAND_SLOTS) {
+        audioDiagnostics.recordPlayerCommandDropped();
+        prefetch_event.triggerEvent();
+        return false;
     }
-    if (state != STATE_STOP) {
-        audio_block_t* b1 = block_left;
-        block_left = NULL;
-        audio_block_t* b2 = block_right;
-        block_right = NULL;
+    {
+        // The copy takes a reference refill() may be counting on the same
+        // file, keep it out meanwhile
+        SdCardLock cardLock;
+        files[head % FILE_SLOTS] = file;
+    }
+    publish_fence();
+    file_head = head + 1;
+
+    Command command = Command();
+    command.type = COMMAND_PLAY;
+    command.value = 0;
+    command.play = play;
+    command.play.file = head;
+    push_command(command);
+    expect(EXPECT_PLAYING, play.loop);
+    return true;
+}
+
+bool AudioPlaySdWavExtended::push_command(uint8_t type, uint32_t value) {
+    Command command = Command();
+    command.type = type;
+    command.value = value;
+    return push_command(command);
+}
+
+bool AudioPlaySdWavExtended::push_command(const Command& command) {
+    uint32_t head = command_head;
+    if (head - command_tail >= COMMAND_SLOTS) {
+        audioDiagnostics.recordPlayerCommandDropped();
+        return false;
+    }
+    commands[head % COMMAND_SLOTS] = command;
+    publish_fence();
+    command_head = head + 1;
+    return true;
+}
+
+bool AudioPlaySdWavExtended::stop(void) {
+    if (!push_command(COMMAND_STOP, 0)) return false;
+    expect(EXPECT_STOPPED, false);
+    return true;
+}
+
+bool AudioPlaySdWavExtended::togglePlayPause(void) {
+    Status now;
+    read_status(now);
+    bool looping = queued(now, state_until)
+                       ? expected_looping
+                       : now.looping && now.layout.loop_period > 0;
+    uint8_t next = expected(now);
+    if (next == EXPECT_PLAYING) {
+        next = EXPECT_PAUSED;
+    } else if (next == EXPECT_PAUSED) {
+        next = EXPECT_PLAYING;
+    }
+    if (!push_command(COMMAND_PAUSE, 0)) return false;
+    expect(next, looping);
+    return true;
+}
+
+// Audio interrupt: first whatever the sketch asked for since the last
+// block, so it all lands on this block's first sample, then the block
+void AudioPlaySdWavExtended::update(void) {
+    apply_commands();
+    play_block();
+    publish_status();
+}
+
+void AudioPlaySdWavExtended::apply_commands(void) {
+    uint32_t tail = command_tail;
+    while (tail != command_head) {
+        take_fence();
+        const Command& command = commands[tail % COMMAND_SLOTS];
+        switch (command.type) {
+            case COMMAND_PLAY:
+                start_play(command.play);
+                break;
+            case COMMAND_STOP:
+                halt();
+                break;
+            case COMMAND_PAUSE:
+                pause();
+                break;
+            case COMMAND_SEEK:
+                seek_frame(command.value);
+                break;
+            case COMMAND_GAIN:
+                gain_target = command.value;
+                break;
+            case COMMAND_LOOP:
+                looping = command.value;
+                break;
+            case COMMAND_SPEED:
+                speed = command.value;
+                break;
+        }
+        publish_fence();
+        command_tail = ++tail;
+    }
+}
+
+// What prepare() and the play calls used to set up with the audio
+// interrupt masked. The file itself is refill()'s to pick up.
+void AudioPlaySdWavExtended::start_play(const PlayCommand& play) {
+    halt();
+    last_file = play.file;
+    play_start_position = play.start;
+    play_end_position = play.end;
+    play_loop = play.loop;
+    gain_target = play.gain;
+    gain_current = 0;
+    speed = 65536;
+    looping = false;
+    buffer_length = 0;
+    buffer_offset = 0;
+    source_position = 0;
+    memset(&layout, 0, sizeof(layout));
+    layout.direction = play.direction;
+
+    bool ok = true;
+    if (play.parse) {
+        state_play = STATE_STOP;
+        data_length = 20;
+        header_offset = 0;
+        state = STATE_PARSE1;
+        request_seek(0, 0);
+    } else {
+        layout.data_offset = play.info.dataOffset;
+        if (play.info.lossless) {
+            layout.lossless = true;
+            layout.channels = play.info.channels;
+            layout.encoded_bytes = play.info.encodedBytes;
+        }
+        // Same checks as a "fmt " chunk
+        header[0] = 1 | (play.info.channels << 16);
+        header[1] = play.info.sampleRate;
+        header[3] = play.info.bitsPerSample << 16;
+        ok = parse_format() && begin_data(play.info.dataBytes, true);
+    }
+    if (!ok) {
+        // refill() drops the file
         state = STATE_STOP;
-        if (b1) release(b1);
-        if (b2) release(b2);
-        wavfile.close();
+        prefetch_event.triggerEvent();
+        return;
+    }
 #if defined(HAS_KINETIS_SDHC)
-        if (!(SIM_SCGC3 & SIM_SCGC3_SDHC)) AudioStopUsingSPI();
+    if (!(SIM_SCGC3 & SIM_SCGC3_SDHC)) AudioStartUsingSPI();
 #else
-        AudioStopUsingSPI();
+    AudioStartUsingSPI();
 #endif
-    }
-    if (irq) NVIC_ENABLE_IRQ(IRQ_SOFTWARE);
 }
 
-void AudioPlaySdWavExtended::togglePlayPause(void) {
+// Blocks only exist within update(), there are none to drop here
+void AudioPlaySdWavExtended::halt(void) {
+    if (state == STATE_STOP) return;
+    state = STATE_STOP;
+#if defined(HAS_KINETIS_SDHC)
+    if (!(SIM_SCGC3 & SIM_SCGC3_SDHC)) AudioStopUsingSPI();
+#else
+    AudioStopUsingSPI();
+#endif
+    // refill() lets go of the file
+    prefetch_event.triggerEvent();
+}
+
+void AudioPlaySdWavExtended::pause(void) {
     // take no action if wave header is not parsed OR
     // state is explicitly STATE_STOP
     if (state_play >= 8 || state == STATE_STOP) return;
@@ -146,21 +456,31 @@ void AudioPlaySdWavExtended::togglePlayPause(void) {
     }
 }
 
-void AudioPlaySdWavExtended::update(void) {
+void AudioPlaySdWavExtended::play_block(void) {
     int32_t n;
 
     // only update if we're playing and not paused
-    if (state == STATE_STOP || state == STATE_PAUSED) return;
+    if (state == STATE_STOP) {
+        // Playback ran out, let refill() close the file
+        if (prefetch_active) prefetch_event.triggerEvent();
+        return;
+    }
+    if (state == STATE_PAUSED) return;
 
     // allocate the audio blocks to transmit
     block_left = allocate();
-    if (block_left == NULL) return;
+    if (block_left == NULL) {
+        // out of audio memory, this block is lost
+        if (state < 8) audioDiagnostics.recordPlayerUnderrun();
+        return;
+    }
     if (state < 8 && (state & 1) == 1) {
         // if we're playing stereo, allocate another
         // block for the right channel output
         block_right = allocate();
         if (block_right == NULL) {
             release(block_left);
+            audioDiagnostics.recordPlayerUnderrun();
             return;
         }
     } else {
@@ -170,6 +490,15 @@ void AudioPlaySdWavExtended::update(void) {
     }
     block_offset = 0;
 
+    // Looping regions never run dry, see update_loop()
+    if (layout.loop_period > 0 && state < 8) update_loop();
+    if (state < 8) {
+        // Native rate files stay on the direct kernels until the speed
+        // changes, then convert for the rest of the play
+        if ((state & 4) == 0 && speed != 65536) begin_varispeed();
+        select_decoder();
+    }
+
     // is there buffered data?
     n = buffer_length - buffer_offset;
     if (n > 0) {
@@ -178,19 +507,22 @@ void AudioPlaySdWavExtended::update(void) {
     }
 
     // we only get to this point when buffer[512] is empty
-    if (state != STATE_STOP && wavfile.available()) {
-    // we can read more data from the file...
+    if (state != STATE_STOP) {
+    // we can read more data from the prefetch ring...
     readagain:
-        buffer_length = wavfile.read(buffer, 512);
-        if (buffer_length == 0) goto end;
+        buffer_length = read_prefetched(buffer, 512);
+        if (buffer_length == 0) {
+            if (prefetch_done()) goto end;
+            goto starved;
+        }
         buffer_offset = 0;
-        bool parsing = (state >= 8);
         bool txok = consume(buffer_length);
         if (txok) {
             if (state != STATE_STOP) return;
         } else {
             if (state != STATE_STOP) {
-                if (parsing && state < 8)
+                // Playing fast, a block can take several reads
+                if (state < 8)
                     goto readagain;
                 else
                     goto cleanup;
@@ -198,7 +530,9 @@ void AudioPlaySdWavExtended::update(void) {
         }
     }
 end:  // end of file reached or other reason to stop
-    wavfile.close();
+    // the file ran dry before the data chunk did, so this block goes out
+    // short (or not at all)
+    if (state < 8 && data_length > 0) audioDiagnostics.recordPlayerUnderrun();
 #if defined(HAS_KINETIS_SDHC)
     if (!(SIM_SCGC3 & SIM_SCGC3_SDHC)) AudioStopUsingSPI();
 #else
@@ -206,44 +540,216 @@ end:  // end of file reached or other reason to stop
 #endif
     state_play = STATE_STOP;
     state = STATE_STOP;
+    // refill() closes the file, it may be in the middle of reading it
+    prefetch_event.triggerEvent();
+    goto cleanup;
+starved:
+    // The card hasn't kept up. Nothing waits for it here: whatever this
+    // block holds goes out padded with silence and playback carries on.
+    if (state < 8 && !seek_pending()) audioDiagnostics.recordPlayerUnderrun();
 cleanup:
-    if (block_left) {
-        if (block_offset > 0) {
-            for (uint32_t i = block_offset; i < AUDIO_BLOCK_SAMPLES; i++) {
-                block_left->data[i] = 0;
-            }
-            transmit(block_left, 0);
-            if (state < 8 && (state & 1) == 0) {
-                transmit(block_left, 1);
-            }
+    if (block_left && block_offset > 0) {
+        for (uint32_t i = block_offset; i < AUDIO_BLOCK_SAMPLES; i++) {
+            block_left->data[i] = 0;
+            if (block_right) block_right->data[i] = 0;
         }
+        transmit_blocks(state == STATE_STOP);
+    }
+    if (block_left) {
         release(block_left);
         block_left = NULL;
     }
     if (block_right) {
-        if (block_offset > 0) {
-            for (uint32_t i = block_offset; i < AUDIO_BLOCK_SAMPLES; i++) {
-                block_right->data[i] = 0;
-            }
-            transmit(block_right, 1);
-        }
         release(block_right);
         block_right = NULL;
     }
 }
 
+// The pass being played is tracked modulo loop_period. While looping, the
+// next pass is added before this one runs out, otherwise whatever goes
+// past the end of the current pass is cut.
+void AudioPlaySdWavExtended::update_loop(void) {
+    uint32_t period = layout.loop_period;
+    uint32_t played = (total_length - data_length) % period;
+    if (looping) {
+        while (data_length < LOOP_AHEAD_BYTES) data_length += period;
+    } else if (data_length > period - played) {
+        data_length = period - played;
+    }
+    total_length = played + data_length;
+}
+
+bool AudioPlaySdWavExtended::setLooping(bool loop) {
+    Status now;
+    read_status(now);
+    uint8_t next = expected(now);
+    if (!push_command(COMMAND_LOOP, loop)) return false;
+    expect(next, loop);
+    return true;
+}
+
+bool AudioPlaySdWavExtended::seekSamples(uint32_t frame) {
+    if (!isPlaying() && !isPaused()) return false;
+    if (!push_command(COMMAND_SEEK, frame)) return false;
+    seek_until = command_head;
+    expected_frame = frame;
+    return true;
+}
+
+// Only the read position moves: the format, the region and the file stay
+// as they are, and refill() restarts the ring with a single read from the
+// target's sector. Lossless data is decoded from its first frame again.
+void AudioPlaySdWavExtended::seek_frame(uint32_t frame) {
+    // The region, or a pass of a looping one, is played as a stream of
+    // `length` bytes
+    uint32_t length = layout.loop_period > 0
+                          ? layout.loop_period
+                          : layout.region_end - layout.region_start;
+    if ((state >= 8 && state != STATE_PAUSED) || length < layout.frame_bytes) {
+        return;
+    }
+    uint32_t offset = seek_offset(layout, frame);
+
+    total_length = length;
+    data_length = length - offset;
+    leftover_bytes = 0;
+    reset_converter();
+    // Comes back in from silence rather than jumping
+    gain_current = 0;
+    uint32_t position = layout.region_start + offset;
+    if (layout.lossless) {
+        request_seek(layout.data_offset, position);
+    } else {
+        request_seek(layout.data_offset + position, 0);
+    }
+}
+
+// Where in the stream `frame` is, kept within the region. A looping region
+// only goes up to its faded tail, a ping-pong one lands on the way up.
+uint32_t AudioPlaySdWavExtended::seek_offset(const Layout& layout,
+                                             uint32_t frame) {
+    uint32_t frame_bytes = layout.frame_bytes;
+    uint32_t region_start = layout.region_start;
+    uint32_t region_end = layout.region_end;
+    uint32_t length = layout.loop_period > 0 ? layout.loop_period
+                                             : region_end - region_start;
+    if (length < frame_bytes) return 0;
+    uint32_t position = frame * frame_bytes;
+    if (position < region_start) position = region_start;
+    if (position + frame_bytes > region_end) {
+        position = region_end - frame_bytes;
+    }
+
+    uint32_t offset = layout.direction == REVERSE
+                          ? region_end - frame_bytes - position
+                          : position - region_start;
+    uint32_t most = layout.direction == PING_PONG ? length / 2 : length;
+    if (offset + frame_bytes > most) offset = most - frame_bytes;
+    return offset;
+}
+
+// The other way round, the frame `offset` bytes into a pass
+uint32_t AudioPlaySdWavExtended::stream_frame(const Layout& layout,
+                                              uint32_t offset) {
+    uint32_t frame_bytes = layout.frame_bytes;
+    uint32_t region_start = layout.region_start;
+    uint32_t region_end = layout.region_end;
+    uint32_t period = layout.loop_period;
+    // On the way down a ping-pong pass starts over from the top frame
+    bool down = layout.direction == REVERSE;
+    if (layout.direction == PING_PONG && offset >= period / 2) {
+        offset -= period / 2;
+        down = true;
+    }
+    if (!down) return (region_start + offset) / frame_bytes;
+    if (offset + frame_bytes > region_end - region_start) {
+        return region_start / frame_bytes;
+    }
+    return (region_end - frame_bytes - offset) / frame_bytes;
+}
+
+bool AudioPlaySdWavExtended::seekMillis(uint32_t milliseconds) {
+    Status now;
+    read_status(now);
+    // convert_step is 4 at 44.1 kHz, 2 at 22.05 and 1 at 11.025 kHz
+    uint32_t rate = 11025 * now.convert_step;
+    return seekSamples((uint64_t)milliseconds * rate / 1000);
+}
+
+void AudioPlaySdWavExtended::setDirection(Direction direction) {
+    play_direction = direction;
+}
+
+bool AudioPlaySdWavExtended::isLooping(void) {
+    Status now;
+    read_status(now);
+    if (queued(now, state_until)) {
+        return expected_looping && expected_state == EXPECT_PLAYING;
+    }
+    return now.looping && now.layout.loop_period > 0 && now.state < 8;
+}
+
+bool AudioPlaySdWavExtended::setVolume(float volumeScaleFactor) {
+    return push_command(COMMAND_GAIN, volume_gain(volumeScaleFactor));
+}
+
+bool AudioPlaySdWavExtended::setSpeed(float factor) {
+    if (factor < 0.25f) factor = 0.25f;
+    if (factor > 4.0f) factor = 4.0f;
+    return push_command(COMMAND_SPEED, (uint32_t)(factor * 65536.0f + 0.5f));
+}
+
+float AudioPlaySdWavExtended::getSpeed(void) {
+    Status now;
+    read_status(now);
+    return now.speed / 65536.0f;
+}
+
+void AudioPlaySdWavExtended::setInterpolation(Interpolation quality) {
+    interpolation = quality;
+}
+
+// Sends the current block(s) out, mono goes to both outputs. The gain ramps
+// across the block towards the target, or down to silence over the samples
+// actually filled when this is the last block.
+void AudioPlaySdWavExtended::transmit_blocks(bool last) {
+    int32_t target = last ? 0 : gain_target;
+    int32_t length = last && block_offset > 0 ? block_offset
+                                              : AUDIO_BLOCK_SAMPLES;
+    int32_t step = (target - gain_current) / length;
+
+    if (step != 0 || gain_current != 65536) {
+        apply_gain(block_left->data, gain_current, step);
+        if (block_right) apply_gain(block_right->data, gain_current, step);
+    }
+    gain_current = target;
+
+    transmit(block_left, 0);
+    release(block_left);
+    if (block_right) {
+        transmit(block_right, 1);
+        release(block_right);
+        block_right = NULL;
+    } else {
+        transmit(block_left, 1);
+    }
+    block_left = NULL;
+}
+
 // https://ccrma.stanford.edu/courses/422/projects/WaveFormat/
 
 // Consume already buffered data.  Returns true if audio transmitted.
 bool AudioPlaySdWavExtended::consume(uint32_t size) {
     uint32_t len;
-    uint8_t lsb, msb;
     const uint8_t* p;
 
     p = buffer + buffer_offset;
 start:
     if (size == 0) return false;
 
+    // Playing, straight into the kernel parse_format() picked
+    if (state < 8) return (this->*decode)(size);
+
     switch (state) {
         // parse wav file header, is this really a .wav file?
         case STATE_PARSE1:
@@ -255,6 +761,15 @@ start:
             data_length -= len;
             if (data_length > 0) return false;
             // parse the header...
+            if (LosslessCodec::isHeader((const uint8_t*)header)) {
+                if (!parse_lossless()) break;
+                if (state & 1) {
+                    block_right = allocate();
+                    if (!block_right) return false;
+                }
+                // The rest of buffer[] is encoded, refill it with PCM
+                return false;
+            }
             if (header[0] == 0x46464952 && header[2] == 0x45564157) {
                 if (header[3] == 0x20746D66) {
                     // "fmt " header
@@ -311,42 +826,15 @@ start:
             size -= len;
             data_length = header[1];
             if (header[0] == 0x61746164) {
-                // Found data chunk
-                leftover_bytes = 0;
-                state = state_play;
-
-                // Store the file position where audio data starts
-                data_start_offset =
-                    wavfile.position() - (buffer_length - buffer_offset);
-
-                // If start position is specified, seek to it
-                if (play_start_position > 0) {
-                    uint32_t seek_position =
-                        data_start_offset + play_start_position;
-
-                    // Ensure seek position is aligned for stereo 16-bit (4
-                    // bytes per sample pair)
-                    if (state_play == STATE_DIRECT_16BIT_STEREO) {
-                        seek_position = (seek_position / 4) * 4;
-                    } else if (state_play == STATE_DIRECT_16BIT_MONO) {
-                        seek_position = (seek_position / 2) * 2;
-                    }
+                // Found data chunk, store the file position where audio
+                // data starts
+                layout.data_offset =
+                    source_position - (buffer_length - buffer_offset);
+                if (!begin_data(header[1], false)) break;
 
-                    wavfile.seek(seek_position);
-
-                    // Adjust data_length based on start position
-                    uint32_t actual_start = seek_position - data_start_offset;
-                    data_length -= actual_start;
-
-                    // Clear buffer to force new read from file
-                    buffer_length = 0;
-                    buffer_offset = 0;
-                }
-
-                // If end position is specified, limit data_length
-                if (play_end_position > 0 && play_end_position < data_length) {
-                    data_length = play_end_position - play_start_position;
-                }
+                // refill() seeks to the start position and starts over, the
+                // rest of buffer[] is from before it
+                if (seek_pending()) size = 0;
 
                 if (state & 1) {
                     // if we're going to start stereo
@@ -354,7 +842,6 @@ start:
                     block_right = allocate();
                     if (!block_right) return false;
                 }
-                total_length = data_length;
             } else {
                 state = STATE_PARSE4;
             }
@@ -388,137 +875,246 @@ start:
             state = STATE_PARSE1;
             goto start;
 
-        // playing mono at native sample rate
-        case STATE_DIRECT_8BIT_MONO:
+        // ignore any extra data after playing
+        // or anything following any error
+        case STATE_STOP:
             return false;
+    }
+    state_play = STATE_STOP;
+    state = STATE_STOP;
+    return false;
+}
 
-        // playing stereo at native sample rate
-        case STATE_DIRECT_8BIT_STEREO:
-            return false;
+// One sample as stored in the file. 16 bit data is little endian like the
+// CPU, so it's a plain load. 8 bit data is unsigned.
+template <bool Wide>
+static inline int16_t read_sample(const uint8_t* src, uint32_t index) {
+    if (Wide) return ((const int16_t*)src)[index];
+    return ((int)src[index] - 128) << 8;
+}
 
-        // playing mono at native sample rate
-        case STATE_DIRECT_16BIT_MONO:
-            if (size > data_length) size = data_length;
-            data_length -= size;
-            while (1) {
-                lsb = *p++;
-                msb = *p++;
-                size -= 2;
-                // Apply volume scaling
-                int16_t sample = (msb << 8) | lsb;
-                sample = (int16_t)(sample * volume_scale);
-                block_left->data[block_offset++] = sample;
-                if (block_offset >= AUDIO_BLOCK_SAMPLES) {
-                    transmit(block_left, 0);
-                    transmit(block_left, 1);
-                    release(block_left);
-                    block_left = NULL;
-                    data_length += size;
-                    buffer_offset = p - buffer;
-                    if (block_right) release(block_right);
-                    if (data_length == 0) state = STATE_STOP;
-                    return true;
-                }
-                if (size == 0) {
-                    if (data_length == 0) break;
-                    return false;
-                }
-            }
-            // end of file reached
-            if (block_offset > 0) {
-                // TODO: fill remainder of last block with zero and transmit
-            }
-            state = STATE_STOP;
-            return false;
+// Whole frames from the file into the blocks, right is unused for mono
+template <bool Stereo, bool Wide>
+static inline void unpack_frames(int16_t* left, int16_t* right,
+                                 const uint8_t* src, uint32_t frames) {
+    if (Wide && Stereo) {
+        deinterleave(left, right, src, frames);
+    } else if (Wide) {
+        memcpy(left, src, frames * 2);
+    } else {
+        for (uint32_t i = 0; i < frames; i++) {
+            left[i] = read_sample<Wide>(src, i * (Stereo ? 2 : 1));
+            if (Stereo) right[i] = read_sample<Wide>(src, i * 2 + 1);
+        }
+    }
+}
+
+// Native rate data goes straight into the blocks, the gain is applied once
+// the block is full. A frame split across two reads waits in
+// convert_partial.
+template <bool Stereo, bool Wide>
+bool AudioPlaySdWavExtended::consume_direct(uint32_t size) {
+    const uint32_t frame_bytes = (Wide ? 2 : 1) * (Stereo ? 2 : 1);
+    const uint8_t* p = buffer + buffer_offset;
+    uint32_t avail = size < data_length ? size : data_length;
 
-        // playing stereo at native sample rate
-        case STATE_DIRECT_16BIT_STEREO: {
-            if (size > data_length) size = data_length;
-            data_length -= size;
+    if (leftover_bytes > 0) {
+        uint32_t n = frame_bytes - leftover_bytes;
+        if (n > avail) n = avail;
+        memcpy(convert_partial + leftover_bytes, p, n);
+        leftover_bytes += n;
+        p += n;
+        avail -= n;
+        data_length -= n;
+        if (leftover_bytes == frame_bytes) {
+            unpack_frames<Stereo, Wide>(
+                block_left->data + block_offset,
+                Stereo ? block_right->data + block_offset : NULL,
+                convert_partial, 1);
+            block_offset++;
+            leftover_bytes = 0;
+        }
+    }
 
-            // Declare variables at the beginning of the scope
-            int16_t sample_left, sample_right;
+    uint32_t frames = avail / frame_bytes;
+    uint32_t room = AUDIO_BLOCK_SAMPLES - block_offset;
+    if (frames > room) frames = room;
+    unpack_frames<Stereo, Wide>(block_left->data + block_offset,
+                                Stereo ? block_right->data + block_offset
+                                       : NULL,
+                                p, frames);
+    block_offset += frames;
+    p += frames * frame_bytes;
+    avail -= frames * frame_bytes;
+    data_length -= frames * frame_bytes;
 
-            if (leftover_bytes) {
-                block_left->data[block_offset] =
-                    (int16_t)(header[0] * volume_scale);
-                leftover_bytes = 0;
-                goto right16;
-            }
-            while (1) {
-                lsb = *p++;
-                msb = *p++;
-                size -= 2;
-                if (size == 0) {
-                    if (data_length == 0) break;
-                    header[0] = (msb << 8) | lsb;
-                    leftover_bytes = 2;
-                    return false;
-                }
-                // Apply volume scaling to left channel
-                sample_left = (msb << 8) | lsb;
-                sample_left = (int16_t)(sample_left * volume_scale);
-                block_left->data[block_offset] = sample_left;
-            right16:
-                lsb = *p++;
-                msb = *p++;
-                size -= 2;
-                // Apply volume scaling to right channel
-                sample_right = (msb << 8) | lsb;
-                sample_right = (int16_t)(sample_right * volume_scale);
-                block_right->data[block_offset++] = sample_right;
-                if (block_offset >= AUDIO_BLOCK_SAMPLES) {
-                    transmit(block_left, 0);
-                    release(block_left);
-                    block_left = NULL;
-                    transmit(block_right, 1);
-                    release(block_right);
-                    block_right = NULL;
-                    data_length += size;
+    if (block_offset < AUDIO_BLOCK_SAMPLES && avail > 0 && avail < frame_bytes) {
+        // Keep the start of a frame for the next read
+        memcpy(convert_partial, p, avail);
+        leftover_bytes = avail;
+        p += avail;
+        data_length -= avail;
+    }
+    buffer_offset = p - buffer;
+    if (data_length < frame_bytes - leftover_bytes) {
+        // Nothing left that could make up another frame
+        data_length = 0;
+        state = STATE_STOP;
+    }
+
+    if (block_offset < AUDIO_BLOCK_SAMPLES) return false;
+    // Where the converter picks up if the speed changes
+    convert_history[0][3] = block_left->data[AUDIO_BLOCK_SAMPLES - 1];
+    if (Stereo) {
+        convert_history[1][3] = block_right->data[AUDIO_BLOCK_SAMPLES - 1];
+    }
+    transmit_blocks(state == STATE_STOP);
+    return true;
+}
+
+// Between the current frame (history[1]) and the next, `frac` (Q16) of the
+// way. Linear is one multiply. Cubic is Catmull-Rom through the frame
+// before and the two after, in Horner form: three 32x32 multiplies, one
+// SMULL each on the M7, with the halves folded into the final shift.
+static inline int16_t interpolate_linear(const int16_t* history,
+                                         uint32_t frac) {
+    int32_t delta = history[2] - history[1];
+    return history[1] + ((delta * (int32_t)(frac >> 1)) >> 15);
+}
+
+static inline int16_t interpolate_cubic(const int16_t* history,
+                                        uint32_t frac) {
+    int32_t p0 = history[0], p1 = history[1];
+    int32_t p2 = history[2], p3 = history[3];
+    int32_t a = 3 * (p1 - p2) + p3 - p0;
+    int32_t b = 2 * p0 - 5 * p1 + 4 * p2 - p3;
+    int32_t c = p2 - p0;
+    int32_t y = (int32_t)(((int64_t)a * frac) >> 16) + b;
+    y = (int32_t)(((int64_t)y * frac) >> 16) + c;
+    y = (int32_t)(((int64_t)y * frac) >> 16) + 2 * p1;
+    return saturate16((y + 1) >> 1);
+}
+
+void AudioPlaySdWavExtended::reset_converter(void) {
+    memset(convert_history, 0, sizeof(convert_history));
+    convert_cycles = 0;
+    // Pull three frames before the first output, so it lands exactly on
+    // the first one
+    convert_phase = 3 << 16;
+}
+
+// A native rate file leaving its own speed. consume_direct() left the
+// last frame it played at the end of the history, three pulls put it
+// before the next one.
+void AudioPlaySdWavExtended::begin_varispeed(void) {
+    state_play |= 4;
+    state = state_play;
+    convert_phase = 3 << 16;
+    convert_cycles = 0;
+}
+
+void AudioPlaySdWavExtended::select_decoder(void) {
+    if ((state_play & 4) && interpolation == LINEAR) {
+        decode = linear_decoders[state_play & 3];
+    } else {
+        decode = decoders[state_play];
+    }
+}
+
+// The sample rate converting states. Source frames are unpacked into a
+// four frame window per channel, every output sample is interpolated from
+// that window. The read head moves by the file's rate over 44.1 kHz times
+// the speed per output sample, so at 4x a block pulls 512 frames.
+template <bool Stereo, bool Wide, bool Cubic>
+bool AudioPlaySdWavExtended::consume_convert(uint32_t size) {
+    uint32_t start = ARM_DWT_CYCCNT;
+    const uint32_t frame_bytes = (Wide ? 2 : 1) * (Stereo ? 2 : 1);
+    const uint8_t* p = buffer + buffer_offset;
+    uint32_t avail = size < data_length ? size : data_length;
+    const uint32_t step = (speed * convert_step) >> 2;
+
+    while (1) {
+        // Slide the window until it covers the next output sample
+        while (convert_phase >= 65536) {
+            const uint8_t* frame = p;
+            if (leftover_bytes > 0 || avail < frame_bytes) {
+                uint32_t n = frame_bytes - leftover_bytes;
+                if (n > avail) n = avail;
+                memcpy(convert_partial + leftover_bytes, p, n);
+                leftover_bytes += n;
+                p += n;
+                avail -= n;
+                data_length -= n;
+                if (leftover_bytes < frame_bytes) {
+                    // Need the next read, or the data is used up
                     buffer_offset = p - buffer;
                     if (data_length == 0) state = STATE_STOP;
-                    return true;
-                }
-                if (size == 0) {
-                    if (data_length == 0) break;
-                    leftover_bytes = 0;
+                    convert_cycles += ARM_DWT_CYCCNT - start;
                     return false;
                 }
+                frame = convert_partial;
+                leftover_bytes = 0;
+            } else {
+                p += frame_bytes;
+                avail -= frame_bytes;
+                data_length -= frame_bytes;
             }
-            // end of file reached
-            if (block_offset > 0) {
-                // TODO: fill remainder of last block with zero and transmit
+
+            for (int c = 0; c < (Stereo ? 2 : 1); c++) {
+                int16_t* h = convert_history[c];
+                h[0] = h[1];
+                h[1] = h[2];
+                h[2] = h[3];
+                h[3] = read_sample<Wide>(frame, c);
             }
-            state = STATE_STOP;
-            return false;
+            convert_phase -= 65536;
         }
 
-        // playing mono, converting sample rate
-        case STATE_CONVERT_8BIT_MONO:
-            return false;
-
-        // playing stereo, converting sample rate
-        case STATE_CONVERT_8BIT_STEREO:
-            return false;
+        block_left->data[block_offset] =
+            Cubic ? interpolate_cubic(convert_history[0], convert_phase)
+                  : interpolate_linear(convert_history[0], convert_phase);
+        if (Stereo) {
+            block_right->data[block_offset] =
+                Cubic ? interpolate_cubic(convert_history[1], convert_phase)
+                      : interpolate_linear(convert_history[1], convert_phase);
+        }
+        block_offset++;
+        convert_phase += step;
 
-        // playing mono, converting sample rate
-        case STATE_CONVERT_16BIT_MONO:
-            return false;
+        if (block_offset >= AUDIO_BLOCK_SAMPLES) {
+            buffer_offset = p - buffer;
+            if (data_length == 0) state = STATE_STOP;
+            transmit_blocks(state == STATE_STOP);
 
-        // playing stereo, converting sample rate
-        case STATE_CONVERT_16BIT_STEREO:
-            return false;
-
-        // ignore any extra data after playing
-        // or anything following any error
-        case STATE_STOP:
-            return false;
+            audioDiagnostics.recordResamplerBlock(convert_cycles +
+                                                  ARM_DWT_CYCCNT - start);
+            convert_cycles = 0;
+            return true;
+        }
     }
-    state_play = STATE_STOP;
-    state = STATE_STOP;
-    return false;
 }
 
+// One kernel per play state, in STATE_* order
+const AudioPlaySdWavExtended::Decoder AudioPlaySdWavExtended::decoders[8] = {
+    &AudioPlaySdWavExtended::consume_direct<false, false>,
+    &AudioPlaySdWavExtended::consume_direct<true, false>,
+    &AudioPlaySdWavExtended::consume_direct<false, true>,
+    &AudioPlaySdWavExtended::consume_direct<true, true>,
+    &AudioPlaySdWavExtended::consume_convert<false, false, true>,
+    &AudioPlaySdWavExtended::consume_convert<true, false, true>,
+    &AudioPlaySdWavExtended::consume_convert<false, true, true>,
+    &AudioPlaySdWavExtended::consume_convert<true, true, true>,
+};
+
+// The converting states with linear interpolation
+const AudioPlaySdWavExtended::Decoder
+    AudioPlaySdWavExtended::linear_decoders[4] = {
+        &AudioPlaySdWavExtended::consume_convert<false, false, false>,
+        &AudioPlaySdWavExtended::consume_convert<true, false, false>,
+        &AudioPlaySdWavExtended::consume_convert<false, true, false>,
+        &AudioPlaySdWavExtended::consume_convert<true, true, false>,
+};
+
 #define B2M_44100 \
     (uint32_t)((double)4294967296000.0 / AUDIO_SAMPLE_RATE_EXACT)  // 97352592
 #define B2M_22050 \
@@ -539,11 +1135,14 @@ bool AudioPlaySdWavExtended::parse_format(void) {
     rate = header[1];
     if (rate == 44100) {
         b2m = B2M_44100;
+        convert_step = 4;
     } else if (rate == 22050) {
         b2m = B2M_22050;
+        convert_step = 2;
         num |= 4;
     } else if (rate == 11025) {
         b2m = B2M_11025;
+        convert_step = 1;
         num |= 4;
     } else {
         return false;
@@ -570,38 +1169,577 @@ bool AudioPlaySdWavExtended::parse_format(void) {
     bytes2millis = b2m;
 
     state_play = num;
+    select_decoder();
+    return true;
+}
+
+// Lossless takes: header[] holds the first 20 bytes of LosslessHeader
+bool AudioPlaySdWavExtended::parse_lossless(void) {
+    uint16_t channels = header[1] >> 16;
+    uint32_t rate = header[2];
+    uint32_t frames = header[3];
+    uint32_t data_bytes = header[4];
+
+    // Reuse the "fmt " checks, the samples are always 16 bit PCM
+    header[0] = 1 | (channels << 16);
+    header[1] = rate;
+    header[3] = 16 << 16;
+    if (!parse_format()) return false;
+
+    // refill() moves to the first frame, switches to decoding and skips
+    // to the start position
+    layout.data_offset = LosslessCodec::HEADER_BYTES;
+    layout.lossless = true;
+    layout.channels = channels;
+    layout.encoded_bytes = data_bytes;
+
+    // From here on everything counts decoded PCM bytes, exactly as if the
+    // file were a WAV, so positions and lengths work unchanged
+    return begin_data(frames * channels * 2, true);
+}
+
+// Sets up playing `bytes` of audio from the layout's data_offset, limited
+// to the requested start and end positions. A seek is requested when the
+// start isn't at the data, or always with `seek` set. Lossless data is
+// always read from its first frame and the decoded bytes skipped up to
+// the start. The request goes last, with the layout all set up.
+bool AudioPlaySdWavExtended::begin_data(uint32_t bytes, bool seek) {
+    uint32_t frame_bytes =
+        ((state_play & 2) ? 2 : 1) * ((state_play & 1) ? 2 : 1);
+    uint32_t start = play_start_position / frame_bytes * frame_bytes;
+    if (start > 0 && start >= bytes) return false;
+
+    data_length = bytes - start;
+    if (play_end_position > start && play_end_position - start < data_length) {
+        data_length = play_end_position - start;
+    }
+    data_length -= data_length % frame_bytes;
+
+    leftover_bytes = 0;
+    reset_converter();
+    layout.frame_bytes = frame_bytes;
+    layout.channels = (state_play & 1) ? 2 : 1;
+    layout.region_start = start;
+    layout.region_end = start + data_length;
+    if (layout.direction == PING_PONG) {
+        if (!begin_pingpong(frame_bytes)) return false;
+    } else if (play_loop && !begin_loop(frame_bytes)) {
+        return false;
+    }
+    total_length = data_length;
+
+    if (layout.lossless) {
+        request_seek(layout.data_offset, start);
+    } else if (seek || start > 0) {
+        request_seek(layout.data_offset + start, 0);
+    }
+    state = state_play;
+    return true;
+}
+
+// Splits the region in data_length into passes: everything up to the
+// last loop_fade bytes, which are faded into the start of the next pass.
+bool AudioPlaySdWavExtended::begin_loop(uint32_t frame_bytes) {
+    uint32_t region = data_length / frame_bytes * frame_bytes;
+    // prepare() allocates it
+    if (region == 0 || !loop_head) return false;
+
+    uint32_t fade = PLAY_SD_WAV_LOOP_FADE_FRAMES * frame_bytes;
+    if (fade > region / 2) fade = region / 2 / frame_bytes * frame_bytes;
+    layout.loop_fade = fade;
+    layout.loop_period = region - fade;
+    layout.loop_cached = LOOP_HEAD_BYTES / frame_bytes * frame_bytes;
+    if (layout.loop_cached > layout.loop_period) {
+        layout.loop_cached = layout.loop_period;
+    }
+    looping = true;
+    data_length = layout.loop_period;
     return true;
 }
 
+// A ping-pong pass is the way up the region and the way back down, each
+// leaving out the frame the other one turns on so neither plays twice.
+// There's no seam to fade.
+bool AudioPlaySdWavExtended::begin_pingpong(uint32_t frame_bytes) {
+    if (data_length < 2 * frame_bytes) return false;
+    layout.loop_period = 2 * (data_length - frame_bytes);
+    layout.loop_fade = 0;
+    looping = play_loop;
+    data_length = layout.loop_period;
+    return true;
+}
+
+uint16_t AudioPlaySdWavExtended::read_source(uint8_t* dest, uint16_t size) {
+    if (source.direction == PING_PONG) return read_pingpong(dest, size);
+    if (source.loop_period > 0) return read_loop(dest, size);
+    return read_raw(dest, size);
+}
+
+uint16_t AudioPlaySdWavExtended::read_raw(uint8_t* dest, uint16_t size) {
+    if (compressed) return decoder.read(wavfile, dest, size);
+    if (reverse) return read_reverse(dest, size);
+    int n = wavfile.read(dest, size);
+    return n > 0 ? n : 0;
+}
+
+// Backwards: the `size` bytes below reverse_cursor, frames flipped into
+// playing order. That's one seek and one read a piece, never a seek per
+// frame, and the seek back is cheap on the recorder's contiguous files.
+uint16_t AudioPlaySdWavExtended::read_reverse(uint8_t* dest, uint16_t size) {
+    if (size > reverse_cursor - reverse_floor) {
+        size = reverse_cursor - reverse_floor;
+    }
+    if (size == 0 || !wavfile.seek(reverse_cursor - size) ||
+        wavfile.read(dest, size) != size) {
+        return 0;
+    }
+    reverse_cursor -= size;
+    switch (source.frame_bytes) {
+        case 1:
+            reverse_frames<1>(dest, size);
+            break;
+        case 4:
+            reverse_frames<4>(dest, size);
+            break;
+        default:
+            reverse_frames<2>(dest, size);
+            break;
+    }
+    return size;
+}
+
+// Blends the tail of a loop into its head, in place, with a linear Q15
+// fade. Both are whole frames of data as stored.
+template <bool Wide>
+static void crossfade(uint8_t* head, const uint8_t* tail, uint32_t frames,
+                      uint32_t channels) {
+    for (uint32_t i = 0; i < frames; i++) {
+        int32_t in = (i << 15) / frames;
+        for (uint32_t c = 0; c < channels; c++) {
+            uint32_t n = i * channels + c;
+            int32_t from = read_sample<Wide>(tail, n);
+            int32_t to = read_sample<Wide>(head, n);
+            int32_t mix = (from * 32768 + (to - from) * in + 16384) >> 15;
+            if (Wide) {
+                ((int16_t*)head)[n] = mix;
+            } else {
+                head[n] = (mix >> 8) + 128;
+            }
+        }
+    }
+}
+
+// Looping regions are read through here. The first pass comes from the
+// card and its start is kept in loop_head. Every later pass starts from
+// loop_head, so the wrap itself never waits on the card, and the card only
+// seeks back once the stream has moved past the cached part.
+uint16_t AudioPlaySdWavExtended::read_loop(uint8_t* dest, uint16_t size) {
+    uint32_t loop_period = source.loop_period;
+    uint32_t loop_cached = source.loop_cached;
+    uint16_t done = 0;
+    while (done < size) {
+        if (loop_position == loop_period && !wrap_loop()) break;
+
+        uint32_t n = size - done;
+        uint32_t end = loop_position < loop_cached ? loop_cached : loop_period;
+        if (n > end - loop_position) n = end - loop_position;
+        if (loop_wrapped && loop_position < loop_cached) {
+            memcpy(dest + done, loop_head + loop_position, n);
+        } else {
+            if (loop_wrapped && loop_position == loop_cached && !seek_loop()) {
+                break;
+            }
+            uint32_t got = read_raw(dest + done, n);
+            if (loop_position == loop_filled && loop_position < loop_cached) {
+                memcpy(loop_head + loop_position, dest + done, got);
+                loop_filled += got;
+            }
+            if (got < n) return done + got;
+        }
+        loop_position += n;
+        done += n;
+    }
+    return done;
+}
+
+// End of a pass. After the first one the card is at the region's tail,
+// which gets faded into the cached start once and for all. A seek during
+// the first pass may have skipped part of the start, that's read now.
+bool AudioPlaySdWavExtended::wrap_loop(void) {
+    if (!loop_wrapped) {
+        uint8_t* tail = loop_head + LOOP_HEAD_BYTES;
+        uint32_t loop_fade = source.loop_fade;
+        if (read_raw(tail, loop_fade) < loop_fade) return false;
+        if (loop_filled < source.loop_cached) {
+            uint32_t missing = source.loop_cached - loop_filled;
+            if (!seek_data(source.region_start + loop_filled) ||
+                read_raw(loop_head + loop_filled, missing) < missing) {
+                return false;
+            }
+            loop_filled = source.loop_cached;
+        }
+        uint32_t channels = source.channels;
+        if (source.frame_bytes == channels * 2) {
+            crossfade<true>(loop_head, tail, loop_fade / (channels * 2),
+                            channels);
+        } else {
+            crossfade<false>(loop_head, tail, loop_fade / channels,
+                             channels);
+        }
+        loop_wrapped = true;
+    }
+    loop_position = 0;
+    return true;
+}
+
+// Ping-pong regions: the first half of a pass reads the card forwards, the
+// second half backwards, see begin_pingpong()
+uint16_t AudioPlaySdWavExtended::read_pingpong(uint8_t* dest, uint16_t size) {
+    uint32_t loop_period = source.loop_period;
+    uint32_t half = loop_period / 2;
+    uint16_t done = 0;
+    while (done < size) {
+        if (loop_position == loop_period) loop_position = 0;
+        if ((loop_position == 0 || loop_position == half) &&
+            !turn_pingpong()) {
+            break;
+        }
+
+        uint32_t n = size - done;
+        uint32_t end = loop_position < half ? half : loop_period;
+        if (n > end - loop_position) n = end - loop_position;
+        uint32_t got = read_raw(dest + done, n);
+        loop_position += got;
+        done += got;
+        if (got < n) break;
+    }
+    return done;
+}
+
+// Puts the card where the half starting at loop_position begins. The way
+// down starts at the top frame and stops short of the bottom one.
+bool AudioPlaySdWavExtended::turn_pingpong(void) {
+    reverse = loop_position > 0;
+    uint32_t data = source.data_offset;
+    if (!reverse) return wavfile.seek(data + source.region_start);
+    reverse_cursor = data + source.region_end;
+    reverse_floor = data + source.region_start + source.frame_bytes;
+    return true;
+}
+
+// Puts the card where loop_head ends
+bool AudioPlaySdWavExtended::seek_loop(void) {
+    return seek_data(source.region_start + source.loop_cached);
+}
+
+// `position` is in decoded bytes, lossless data can only be decoded from
+// its first frame. Backwards it's mirrored: region_start is region_end.
+bool AudioPlaySdWavExtended::seek_data(uint32_t position) {
+    uint32_t data = source.data_offset;
+    if (reverse) {
+        reverse_cursor =
+            data + source.region_start + source.region_end - position;
+        return true;
+    }
+    if (!compressed) return wavfile.seek(data + position);
+    if (!wavfile.seek(data)) return false;
+    decoder.begin(source.channels, source.encoded_bytes);
+    return decoder.skip(wavfile, position);
+}
+
+// Audio interrupt side: copies what the ring holds, never touches the card
+uint16_t AudioPlaySdWavExtended::read_prefetched(uint8_t* dest,
+                                                 uint16_t size) {
+    if (seek_pending()) {
+        // refill() may have backed off while the card was held
+        prefetch_event.triggerEvent();
+        return 0;
+    }
+
+    uint32_t tail = prefetch_tail;
+    uint32_t avail = prefetch_head - tail;
+    if (size > avail) size = avail;
+
+    uint32_t at = tail % PREFETCH_BYTES;
+    uint32_t first = PREFETCH_BYTES - at;
+    if (first > size) first = size;
+    memcpy(dest, prefetch + at, first);
+    memcpy(dest + first, prefetch, size - first);
+    prefetch_tail = tail + size;
+    source_position += size;
+
+    if (PREFETCH_BYTES - (prefetch_head - prefetch_tail) >=
+        PLAY_SD_WAV_READ_BYTES) {
+        prefetch_event.triggerEvent();
+    }
+    return size;
+}
+
+bool AudioPlaySdWavExtended::prefetch_done(void) {
+    return prefetch_eof && !seek_pending() && prefetch_head == prefetch_tail;
+}
+
+// The layout goes along with the request, it's all refill() reads
+void AudioPlaySdWavExtended::request_seek(uint32_t offset,
+                                          uint32_t decoded_skip) {
+    seek_request.layout = layout;
+    seek_request.offset = offset;
+    seek_request.skip = decoded_skip;
+    seek_request.file = last_file;
+    publish_fence();
+    seek_sequence = seek_sequence + 1;
+    source_position = offset;
+    buffer_length = 0;
+    buffer_offset = 0;
+    prefetch_event.triggerEvent();
+}
+
+// File handles are shared with whoever passed them to play(), so this only
+// drops ours. The last one to go closes the file. The sketch only touches
+// copies of it with the card held, when this doesn't run.
+void AudioPlaySdWavExtended::release_file(void) {
+    wavfile = File();
+}
+
+void AudioPlaySdWavExtended::prefetch_handler(EventResponderRef event) {
+    static_cast<AudioPlaySdWavExtended*>(event.getContext())->refill();
+}
+
+// Moves refill() on to files[] entry `file`, letting go of any it skipped
+// on the way. Returns whether it's a new one.
+bool AudioPlaySdWavExtended::take_file(uint32_t file) {
+    bool taken = false;
+    while (file_tail != file_head && (int32_t)(file - file_tail) >= 0) {
+        take_fence();
+        File& queued = files[file_tail % FILE_SLOTS];
+        wavfile = queued;
+        queued = File();
+        publish_fence();
+        file_tail = file_tail + 1;
+        taken = true;
+    }
+    if (taken) prefetch_active = true;
+    return taken;
+}
+
+// refill()'s side of request_seek(). A new play starts on its own file,
+// with nothing of its loop cached yet.
+void AudioPlaySdWavExtended::seek_source(const SeekRequest& request) {
+    if (take_file(request.file)) {
+        loop_filled = 0;
+        loop_wrapped = false;
+    }
+    source = request.layout;
+
+    uint32_t position = source.lossless
+                            ? request.skip
+                            : request.offset - source.data_offset;
+    if (source.loop_period > 0) {
+        loop_position = position - source.region_start;
+    }
+    // Seeks in a ping-pong pass land on the way up
+    reverse = source.direction == REVERSE;
+    reverse_floor = source.data_offset + source.region_start;
+    compressed = false;
+    // Plain data is read from the start of the sector the target is in,
+    // so the reads after it stay sector aligned. The lead-in up to the
+    // target is dropped from the ring.
+    uint32_t lead = source.lossless || source.loop_period > 0 || reverse
+                        ? 0
+                        : request.offset % 512;
+    bool ok = reverse ? seek_data(position)
+                      : wavfile.seek(request.offset - lead);
+    if (ok && source.lossless) {
+        compressed = true;
+        decoder.begin(source.channels, source.encoded_bytes);
+        if (request.skip > 0) ok = decoder.skip(wavfile, request.skip);
+    }
+    // update() keeps off the ring until the request is served
+    prefetch_head = 0;
+    prefetch_tail = 0;
+    prefetch_eof = !ok;
+    if (reverse && source.loop_period == 0) {
+        // Backwards the same goes the other way: the first piece is cut
+        // short to end on a sector boundary, and fills its slot from the
+        // top
+        uint32_t frame_bytes = source.frame_bytes;
+        uint32_t pad = (512 - reverse_cursor % 512) % 512;
+        pad = (pad + frame_bytes - 1) / frame_bytes * frame_bytes;
+        prefetch_head = pad;
+        prefetch_tail = pad;
+    }
+    if (ok && lead > 0) {
+        uint16_t got = read_raw(prefetch, PLAY_SD_WAV_READ_BYTES);
+        if (got < PLAY_SD_WAV_READ_BYTES) prefetch_eof = true;
+        prefetch_head = got;
+        prefetch_tail = lead < got ? lead : got;
+    }
+}
+
+// Software interrupt side, below the audio interrupt. Reads one piece per
+// pass and re-triggers itself while there's room for more, so the record
+// writer sharing this interrupt level gets a turn in between.
+void AudioPlaySdWavExtended::refill(void) {
+    // Someone else is on the card, the next update() asks again
+    if (WavFileWriter::isCardLocked()) return;
+
+    // Read first: a play update() starts after this has its own file
+    uint32_t file = last_file;
+    take_fence();
+    if (state == STATE_STOP) {
+        // update() has played everything or was told to stop. Files of
+        // plays it hasn't got to yet stay queued.
+        take_file(file);
+        prefetch_active = false;
+        release_file();
+        return;
+    }
+
+    uint32_t sequence = seek_sequence;
+    if (sequence != seek_served) {
+        SeekRequest request;
+        do {
+            sequence = seek_sequence;
+            take_fence();
+            request = seek_request;
+            take_fence();
+        } while (sequence != seek_sequence);
+        seek_source(request);
+        // Still pending if update() asked again meanwhile, the trigger
+        // that came with it runs this again
+        publish_fence();
+        seek_served = sequence;
+    }
+    if (!prefetch_active) return;
+
+    uint32_t head = prefetch_head;
+    if (prefetch_eof ||
+        PREFETCH_BYTES - (head - prefetch_tail) < PLAY_SD_WAV_READ_BYTES) {
+        return;
+    }
+
+    // Pieces end on a slot boundary, so they never wrap. They're all
+    // whole ones but the first after a backwards seek.
+    uint32_t at = head % PREFETCH_BYTES;
+    uint16_t size = PLAY_SD_WAV_READ_BYTES - at % PLAY_SD_WAV_READ_BYTES;
+    uint16_t got = read_source(prefetch + at, size);
+    if (got < size) prefetch_eof = true;
+    prefetch_head = head + got;
+
+    if (!prefetch_eof && PREFETCH_BYTES - (prefetch_head - prefetch_tail) >=
+                             PLAY_SD_WAV_READ_BYTES) {
+        prefetch_event.triggerEvent();
+    }
+}
+
+// After every block, whatever path update() took
+void AudioPlaySdWavExtended::publish_status(void) {
+    status_sequence = status_sequence + 1;
+    publish_fence();
+    status.commands = command_tail;
+    status.total_length = total_length;
+    status.data_length = data_length;
+    status.bytes2millis = bytes2millis;
+    status.speed = speed;
+    status.state = state;
+    status.convert_step = convert_step;
+    status.looping = looping;
+    status.layout = layout;
+    publish_fence();
+    status_sequence = status_sequence + 1;
+}
+
+// update() can cut in while this copies, the copy is taken again then
+void AudioPlaySdWavExtended::read_status(Status& now) {
+    uint32_t sequence;
+    do {
+        sequence = status_sequence;
+        take_fence();
+        now = status;
+        take_fence();
+    } while ((sequence & 1) || sequence != status_sequence);
+}
+
+// Commands up to `until` haven't all been carried out by `now`
+bool AudioPlaySdWavExtended::queued(const Status& now, uint32_t until) {
+    return (int32_t)(until - now.commands) > 0;
+}
+
+// Where the commands queued so far leave the player
+uint8_t AudioPlaySdWavExtended::expected(const Status& now) {
+    if (queued(now, state_until)) return expected_state;
+    if (now.state == STATE_STOP) return EXPECT_STOPPED;
+    if (now.state == STATE_PAUSED) return EXPECT_PAUSED;
+    return EXPECT_PLAYING;
+}
+
+// Called with the command that gets the player there just queued
+void AudioPlaySdWavExtended::expect(uint8_t state, bool looping) {
+    expected_state = state;
+    expected_looping = looping;
+    state_until = command_head;
+}
+
 bool AudioPlaySdWavExtended::isPlaying(void) {
-    uint8_t s = *(volatile uint8_t*)&state;
-    return (s < 8);
+    Status now;
+    read_status(now);
+    if (queued(now, state_until)) return expected_state == EXPECT_PLAYING;
+    return now.state < 8;
 }
 
 bool AudioPlaySdWavExtended::isPaused(void) {
-    uint8_t s = *(volatile uint8_t*)&state;
-    return (s == STATE_PAUSED);
+    Status now;
+    read_status(now);
+    if (queued(now, state_until)) return expected_state == EXPECT_PAUSED;
+    return now.state == STATE_PAUSED;
 }
 
 bool AudioPlaySdWavExtended::isStopped(void) {
-    uint8_t s = *(volatile uint8_t*)&state;
-    return (s == STATE_STOP);
+    Status now;
+    read_status(now);
+    if (queued(now, state_until)) return expected_state == EXPECT_STOPPED;
+    return now.state == STATE_STOP;
+}
+
+// Bytes into the current pass, or into the one the last seek goes to
+// while that's queued. Returns false while there's nothing to tell.
+bool AudioPlaySdWavExtended::stream_offset(const Status& now,
+                                           uint32_t& offset) {
+    const Layout& layout = now.layout;
+    if (layout.frame_bytes == 0) return false;
+    if (queued(now, seek_until)) {
+        offset = seek_offset(layout, expected_frame);
+        return true;
+    }
+    if (now.state >= 8 && now.state != STATE_PAUSED) return false;
+    offset = now.total_length - now.data_length;
+    if (layout.loop_period > 0) offset %= layout.loop_period;
+    return true;
 }
 
 uint32_t AudioPlaySdWavExtended::positionMillis(void) {
-    uint8_t s = *(volatile uint8_t*)&state;
-    if (s >= 8 && s != STATE_PAUSED) return 0;
-    uint32_t tlength = *(volatile uint32_t*)&total_length;
-    uint32_t dlength = *(volatile uint32_t*)&data_length;
-    uint32_t offset = tlength - dlength;
-    uint32_t b2m = *(volatile uint32_t*)&bytes2millis;
-    return ((uint64_t)offset * b2m) >> 32;
+    Status now;
+    read_status(now);
+    uint32_t offset;
+    if (!stream_offset(now, offset)) return 0;
+    return ((uint64_t)offset * now.bytes2millis) >> 32;
+}
+
+// In frames from the start of the data, like seekSamples()
+uint32_t AudioPlaySdWavExtended::positionSamples(void) {
+    Status now;
+    read_status(now);
+    uint32_t offset;
+    if (!stream_offset(now, offset)) return 0;
+    return stream_frame(now.layout, offset);
 }
 
 uint32_t AudioPlaySdWavExtended::lengthMillis(void) {
-    uint8_t s = *(volatile uint8_t*)&state;
-    if (s >= 8 && s != STATE_PAUSED) return 0;
-    uint32_t tlength = *(volatile uint32_t*)&total_length;
-    uint32_t b2m = *(volatile uint32_t*)&bytes2millis;
-    return ((uint64_t)tlength * b2m) >> 32;
-}
\ No newline at end of file
+    Status now;
+    read_status(now);
+    if (now.state >= 8 && now.state != STATE_PAUSED) return 0;
+    uint32_t tlength = now.total_length;
+    const Layout& layout = now.layout;
+    if (layout.loop_period > 0) tlength = layout.loop_period + layout.loop_fade;
+    return ((uint64_t)tlength * now.bytes2millis) >> 32;
+}
@@ -28,31 +28,243 @@
 #define play_sd_wav_extended_h_
 #include <Arduino.h>  // github.com/PaulStoffregen/cores/blob/master/teensy4/Arduino.h
 #include <AudioStream.h>  // github.com/PaulStoffregen/cores/blob/master/teensy4/AudioStream.h
+#include <EventResponder.h>
 #include <SD.h>  // github.com/PaulStoffregen/SD/blob/Juse_Use_SdFat/src/SD.h
 
+#include "../LosslessCodec.hpp"
+
+// Read-ahead between the card and update(). It's refilled from a
+// low-priority software interrupt in PLAY_SD_WAV_READ_BYTES pieces, so the
+// audio interrupt only ever copies from RAM. Allocated on the first play().
+// 32 KB covers 185 ms of 16 bit stereo at normal speed, 46 ms at 4x.
+#ifndef PLAY_SD_WAV_PREFETCH_KB
+#define PLAY_SD_WAV_PREFETCH_KB 32
+#endif
+
+#ifndef PLAY_SD_WAV_READ_BYTES
+#define PLAY_SD_WAV_READ_BYTES 4096
+#endif
+
+// Looping regions keep their first PLAY_SD_WAV_LOOP_HEAD_KB in RAM, so a
+// wrap is served from memory while the card seeks back. The seam is
+// crossfaded over PLAY_SD_WAV_LOOP_FADE_FRAMES (5.8 ms at 44.1 kHz).
+#ifndef PLAY_SD_WAV_LOOP_HEAD_KB
+#define PLAY_SD_WAV_LOOP_HEAD_KB 8
+#endif
+
+#ifndef PLAY_SD_WAV_LOOP_FADE_FRAMES
+#define PLAY_SD_WAV_LOOP_FADE_FRAMES 256
+#endif
+
+// Where the audio in a sample file is and how it's stored, see readInfo()
+struct AudioSampleInfo {
+    uint32_t dataOffset;    // first sample, or first lossless frame
+    uint32_t dataBytes;     // PCM bytes, decoded size for lossless files
+    uint32_t encodedBytes;  // lossless files only
+    uint32_t sampleRate;
+    uint16_t channels;
+    uint16_t bitsPerSample;
+    bool lossless;
+};
+
+// The control calls don't touch the player, they queue a command that
+// update() carries out at the start of its next block, and what's read
+// back comes from a snapshot update() takes after every block. Nothing
+// masks the audio interrupt. Call them from one place, the sketch's loop.
+// While update() isn't running the ring can fill up: the calls then leave
+// the player as it is and return false, and AudioDiagnostics counts them.
 class AudioPlaySdWavExtended : public AudioStream {
    public:
     AudioPlaySdWavExtended(void)
-        : AudioStream(0, NULL), block_left(NULL), block_right(NULL) {
+        : AudioStream(0, NULL),
+          block_left(NULL),
+          block_right(NULL),
+          prefetch(NULL),
+          prefetch_active(false),
+          loop_head(NULL) {
         begin();
     }
     void begin(void);
     bool play(const char* filename);
     bool play(const char* filename, uint32_t startPosition,
               uint32_t endPosition, float volumeScaleFactor);
-    void togglePlayPause(void);
-    void stop(void);
+    // Plays an already open file without parsing its header again. The
+    // handle is shared, not closed when playback ends. File reference
+    // counts aren't atomic and refill() takes and drops its copy from the
+    // software interrupt, so the copy is made here with the card held
+    // (SdCardLock), which keeps refill() out. Whoever drops their own
+    // handle while it may still be playing has to hold the card as well.
+    bool play(File& file, const AudioSampleInfo& info, uint32_t startPosition,
+              uint32_t endPosition, float volumeScaleFactor);
+    static bool readInfo(File& file, AudioSampleInfo& info);
+    // Plays frames startFrame up to endFrame of an open file, an endFrame
+    // of 0 is the end of the audio. A looping region repeats until stop()
+    // or setLooping(false).
+    bool playRegion(File& file, const AudioSampleInfo& info,
+                    uint32_t startFrame, uint32_t endFrame, bool loop,
+                    float volumeScaleFactor);
+    // Switched off, a looping region plays out to its end and stops
+    bool setLooping(bool loop);
+    bool isLooping(void);
+    // Moves a playing or paused stream without restarting it. Positions
+    // are frames from the start of the audio data, kept within the region.
+    bool seekSamples(uint32_t frame);
+    bool seekMillis(uint32_t milliseconds);
+    // Direction of plays of open files, from the next one on. Reverse
+    // starts at the end of the region, ping-pong goes up and back down it
+    // (and keeps going while looping). WAV only, lossless takes can only
+    // be decoded forwards.
+    enum Direction { FORWARD, REVERSE, PING_PONG };
+    void setDirection(Direction direction);
+    // Takes effect over the next block, so changes never click
+    bool setVolume(float volumeScaleFactor);
+    // Varispeed: 0.25 to 4 times the file's own speed, pitch going with it.
+    // Takes effect from the next block, every play starts at 1.
+    bool setSpeed(float factor);
+    float getSpeed(void);
+    // How samples between source frames are made up, whenever the output
+    // rate isn't the file's own. Cubic is the default.
+    enum Interpolation { LINEAR, CUBIC };
+    void setInterpolation(Interpolation quality);
+    bool togglePlayPause(void);
+    bool stop(void);
     bool isPlaying(void);
     bool isPaused(void);
     bool isStopped(void);
     uint32_t positionMillis(void);
+    uint32_t positionSamples(void);
     uint32_t lengthMillis(void);
     virtual void update(void);
 
    private:
+    // Where and how the card is read for a play. update() sets `layout`
+    // up and hands a copy over with every seek request, refill() only ever
+    // reads its own copy in `source`.
+    struct Layout {
+        uint32_t data_offset;    // file offset of the audio data
+        uint32_t region_start;   // decoded bytes from there
+        uint32_t region_end;
+        uint32_t loop_period;    // 0 when not looping, see begin_loop()
+        uint32_t loop_cached;    // bytes of the region kept in loop_head
+        uint32_t loop_fade;
+        uint32_t encoded_bytes;  // lossless only
+        uint16_t channels;
+        uint8_t frame_bytes;
+        uint8_t direction;
+        bool lossless;           // decoded from the first frame on every seek
+    };
+    struct SeekRequest {
+        Layout layout;
+        uint32_t offset;  // file offset
+        uint32_t skip;    // decoded bytes after it, lossless only
+        uint32_t file;    // files[] entry to read from
+    };
+
+    // Commands from the sketch, see apply_commands()
+    enum CommandType : uint8_t {
+        COMMAND_PLAY,
+        COMMAND_STOP,
+        COMMAND_PAUSE,
+        COMMAND_SEEK,
+        COMMAND_GAIN,
+        COMMAND_LOOP,
+        COMMAND_SPEED
+    };
+    struct PlayCommand {
+        AudioSampleInfo info;  // unused when parsing the header
+        uint32_t start;        // bytes
+        uint32_t end;
+        int32_t gain;
+        uint32_t file;
+        uint8_t direction;
+        bool loop;
+        bool parse;  // opened by name, the header comes through the ring
+    };
+    struct Command {
+        uint8_t type;
+        uint32_t value;
+        PlayCommand play;  // COMMAND_PLAY only
+    };
+
+    // What update() publishes after every block, see read_status()
+    struct Status {
+        uint32_t commands;  // command_tail by then
+        uint32_t total_length;
+        uint32_t data_length;
+        uint32_t bytes2millis;
+        uint32_t speed;
+        uint8_t state;
+        uint8_t convert_step;
+        bool looping;
+        Layout layout;
+    };
+    enum Expectation : uint8_t {
+        EXPECT_PLAYING,
+        EXPECT_PAUSED,
+        EXPECT_STOPPED
+    };
+
     File wavfile;
+    bool prepare(bool loop);
+    bool start_file(File& file, const AudioSampleInfo& info,
+                    uint32_t startPosition, uint32_t endPosition,
+                    float volumeScaleFactor, bool loop);
+    bool queue_play(File& file, PlayCommand& play);
+    bool push_command(uint8_t type, uint32_t value);
+    bool push_command(const Command& command);
+    void apply_commands(void);
+    void start_play(const PlayCommand& play);
+    void halt(void);
+    void pause(void);
+    void seek_frame(uint32_t frame);
+    static uint32_t seek_offset(const Layout& layout, uint32_t frame);
+    static uint32_t stream_frame(const Layout& layout, uint32_t offset);
+    bool stream_offset(const Status& now, uint32_t& offset);
+    void play_block(void);
+    void publish_status(void);
+    void read_status(Status& now);
+    bool queued(const Status& now, uint32_t until);
+    uint8_t expected(const Status& now);
+    void expect(uint8_t state, bool looping);
+    bool begin_data(uint32_t bytes, bool seek);
+    bool begin_loop(uint32_t frame_bytes);
+    bool begin_pingpong(uint32_t frame_bytes);
+    void update_loop(void);
+    void release_file(void);
     bool consume(uint32_t size);
+    // Decode kernels, one instance per format so the sample loops don't
+    // branch on it
+    template <bool Stereo, bool Wide>
+    bool consume_direct(uint32_t size);
+    template <bool Stereo, bool Wide, bool Cubic>
+    bool consume_convert(uint32_t size);
+    typedef bool (AudioPlaySdWavExtended::*Decoder)(uint32_t size);
+    static const Decoder decoders[8];
+    static const Decoder linear_decoders[4];
+    Decoder decode;  // kernel for state_play, see select_decoder()
+    void select_decoder(void);
+    void begin_varispeed(void);
+    void transmit_blocks(bool last);
+    void reset_converter(void);
     bool parse_format(void);
+    bool parse_lossless(void);
+    uint16_t read_source(uint8_t* dest, uint16_t size);
+    uint16_t read_prefetched(uint8_t* dest, uint16_t size);
+    uint16_t read_raw(uint8_t* dest, uint16_t size);
+    uint16_t read_reverse(uint8_t* dest, uint16_t size);
+    uint16_t read_loop(uint8_t* dest, uint16_t size);
+    uint16_t read_pingpong(uint8_t* dest, uint16_t size);
+    bool turn_pingpong(void);
+    bool wrap_loop(void);
+    bool seek_loop(void);
+    bool seek_data(uint32_t position);
+    bool prefetch_done(void);
+    bool seek_pending(void) { return seek_served != seek_sequence; }
+    void request_seek(uint32_t offset, uint32_t decoded_skip);
+    void seek_source(const SeekRequest& request);
+    bool take_file(uint32_t file);
+    void refill(void);
+    static void prefetch_handler(EventResponderRef event);
     uint32_t header[10];    // temporary storage of wav header data
     uint32_t data_length;   // number of bytes remaining in current section
     uint32_t total_length;  // number of audio data bytes in file
@@ -60,7 +272,7 @@ class AudioPlaySdWavExtended : public AudioStream {
     audio_block_t* block_left;
     audio_block_t* block_right;
     uint16_t block_offset;   // how much data is in block_left & block_right
-    uint8_t buffer[512];     // buffer one block of data
+    alignas(4) uint8_t buffer[512];  // buffer one block of data
     uint16_t buffer_offset;  // where we're at consuming "buffer"
     uint16_t
         buffer_length;  // how much data is in "buffer" (512 until last read)
@@ -74,7 +286,87 @@ class AudioPlaySdWavExtended : public AudioStream {
                                    // data start)
     uint32_t play_end_position;    // end position in bytes (relative to audio
                                    // data start)
-    float volume_scale;            // volume scale factor (0.0 to 1.0+)
-    uint32_t data_start_offset;    // file offset where audio data begins
+    // Q16 gains (65536 is unity). Every block ramps from gain_current to
+    // gain_target, a new play starts from silence.
+    int32_t gain_current;
+    int32_t gain_target;
+    Layout layout;  // update()'s
+    Layout source;  // refill()'s
+
+    // Command ring. The sketch only writes command_head and update() only
+    // command_tail, a slot changes hands when the index moves past it.
+    static const uint32_t COMMAND_SLOTS = 8;
+    Command commands[COMMAND_SLOTS];
+    volatile uint32_t command_head;
+    volatile uint32_t command_tail;
+    // Files on their way from the sketch to refill(), which owns wavfile.
+    // Play commands name theirs by its index. The sketch only copies into
+    // a slot with the card held, refill() never runs meanwhile.
+    static const uint32_t FILE_SLOTS = 4;
+    File files[FILE_SLOTS];
+    volatile uint32_t file_head;
+    volatile uint32_t file_tail;
+    volatile uint32_t last_file;  // of the last play update() started
+
+    // Seqlock, status_sequence is odd while update() writes status. The
+    // sketch keeps what it queued and update() hasn't carried out yet, so
+    // what's read back never lags behind the calls.
+    Status status;
+    volatile uint32_t status_sequence;
+    uint32_t state_until;  // command_head after the last play, stop or pause
+    uint8_t expected_state;
+    bool expected_looping;
+    uint32_t seek_until;   // command_head after the last seek
+    uint32_t expected_frame;
+
+    // Lossless (".nmc") files are decoded as they're prefetched
+    bool compressed;
+    LosslessDecoder decoder;
+
+    // Prefetch ring. refill() is the only writer of prefetch_head and the
+    // file, update() the only reader of the ring. Seeks are handed over
+    // in seek_request, update() leaves the ring alone until refill() has
+    // served the last one. update() can cut into refill() at any point, so
+    // refill() works from a copy, a newer request waits for its next pass.
+    static const uint32_t PREFETCH_BYTES = PLAY_SD_WAV_PREFETCH_KB * 1024;
+    uint8_t* prefetch;
+    volatile uint32_t prefetch_head;
+    volatile uint32_t prefetch_tail;
+    volatile bool prefetch_eof;
+    volatile bool prefetch_active;  // refill() holds a file
+    SeekRequest seek_request;
+    volatile uint32_t seek_sequence;  // bumped by update() for every request
+    volatile uint32_t seek_served;    // the last one refill() carried out
+    uint32_t source_position;    // file offset of the next byte update() reads
+    EventResponder prefetch_event;
+
+    // 22.05/11.025 kHz and varispeed playback, see consume_convert()
+    int16_t convert_history[2][4];  // last four source frames per channel
+    alignas(4) uint8_t convert_partial[4];  // a frame split across reads
+    uint32_t convert_phase;         // Q16 frames, >= 1 pulls a frame
+    uint8_t convert_step;           // quarter frames per output: 4, 2 or 1
+    uint32_t convert_cycles;        // spent on the block being filled
+    uint32_t speed;                 // Q16, 65536 is the file's own
+    volatile uint8_t interpolation;
+
+    // Looping regions, see read_loop(). A pass is loop_period bytes, the
+    // region less the faded tail. update() tops data_length up a pass at a
+    // time while looping is set, everything else belongs to refill().
+    static const uint32_t LOOP_HEAD_BYTES = PLAY_SD_WAV_LOOP_HEAD_KB * 1024;
+    static const uint32_t LOOP_FADE_BYTES = PLAY_SD_WAV_LOOP_FADE_FRAMES * 4;
+    bool play_loop;               // set up the next region to loop
+    bool looping;
+    uint32_t loop_filled;         // of loop_cached, read in so far
+    uint32_t loop_position;       // in the pass refill() is reading
+    bool loop_wrapped;            // loop_head starts with the faded seam
+    uint8_t* loop_head;           // LOOP_HEAD_BYTES, then room for the tail
+
+    // Reverse and ping-pong plays, see read_reverse(). Positions handed to
+    // seek_data() and the ring are in the order things are played, only
+    // refill() knows the card is being read backwards.
+    uint8_t play_direction;       // for the next play of an open file
+    bool reverse;                 // refill() is reading backwards
+    uint32_t reverse_cursor;      // file offset, the next read ends here
+    uint32_t reverse_floor;       // file offset reading backwards stops at
 };
 #endif
\ No newline at end of file
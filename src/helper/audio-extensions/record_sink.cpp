@@ -0,0 +1,152 @@
+#include "record_sink.h"
+
+#include "../AudioDiagnostics.h"
+
+// Stands in for a stereo input that has nothing connected
+static const int16_t silence[AUDIO_BLOCK_SAMPLES] __attribute__((aligned(4))) =
+    {0};
+
+#if defined(__ARM_ARCH_7EM__)
+// (right << 16) | (left & 0xFFFF): the first frame of a sample pair
+static inline uint32_t pack_first(uint32_t left, uint32_t right) {
+    uint32_t out;
+    asm("pkhbt %0, %1, %2, lsl #16" : "=r"(out) : "r"(left), "r"(right));
+    return out;
+}
+
+// (right & 0xFFFF0000) | (left >> 16): the second frame of a sample pair
+static inline uint32_t pack_second(uint32_t left, uint32_t right) {
+    uint32_t out;
+    asm("pkhtb %0, %1, %2, asr #16" : "=r"(out) : "r"(right), "r"(left));
+    return out;
+}
+#endif
+
+// Writes `frames` L/R pairs to dst, `frames` a multiple of 4. On the
+// Cortex-M7 every word read holds two samples of one channel and
+// PKHBT/PKHTB turn two such words into two frames, so a sample costs about
+// one cycle.
+static void interleave(int16_t* dst, const int16_t* left, const int16_t* right,
+                       int frames) {
+#if defined(__ARM_ARCH_7EM__)
+    const uint32_t* l = (const uint32_t*)left;
+    const uint32_t* r = (const uint32_t*)right;
+    uint32_t* out = (uint32_t*)dst;
+    const uint32_t* end = l + frames / 2;
+    do {
+        uint32_t l01 = *l++;
+        uint32_t r01 = *r++;
+        uint32_t l23 = *l++;
+        uint32_t r23 = *r++;
+        *out++ = pack_first(l01, r01);
+        *out++ = pack_second(l01, r01);
+        *out++ = pack_first(l23, r23);
+        *out++ = pack_second(l23, r23);
+    } while (l < end);
+#else
+    for (int i = 0; i < frames; i++) {
+        dst[i * 2] = left[i];
+        dst[i * 2 + 1] = right[i];
+    }
+#endif
+}
+
+void AudioRecordSink::setRing(int16_t* storage, uint32_t count) {
+    ring = storage;
+    slots = count;
+    depth = count;
+    reset();
+}
+
+void AudioRecordSink::setDepth(uint32_t blocks) {
+    depth = blocks < slots ? blocks : slots;
+}
+
+void AudioRecordSink::reset(void) {
+    head = 0;
+    tail = 0;
+    highWater = 0;
+    overruns = 0;
+    interleaveCycles = 0;
+    offset = 0;
+    for (int c = 0; c < 2; c++) {
+        decimators[c][0].reset();
+        decimators[c][1].reset();
+    }
+}
+
+// Returns the number of samples written to out
+int AudioRecordSink::decimate(uint16_t channel, const int16_t* in,
+                              int16_t* out) {
+    int count = AUDIO_BLOCK_SAMPLES;
+    for (uint16_t factor = decimation, stage = 0; factor > 1;
+         factor /= 2, stage++) {
+        decimators[channel][stage].process(in, out, count);
+        in = out;
+        count /= 2;
+    }
+    return count;
+}
+
+void AudioRecordSink::update(void) {
+    audio_block_t* left = receiveReadOnly(0);
+    audio_block_t* right = receiveReadOnly(1);
+    if (channels == 1 && right) {
+        release(right);
+        right = NULL;
+    }
+    if (!left && !right) return;
+
+    if (enabled && ring) {
+        const int16_t* l = left ? left->data : silence;
+        const int16_t* r = right ? right->data : silence;
+        int frames = AUDIO_BLOCK_SAMPLES;
+
+        // The filters run on every block, dropped or not, so they never
+        // see a discontinuity
+        int16_t reducedLeft[AUDIO_BLOCK_SAMPLES / 2];
+        int16_t reducedRight[AUDIO_BLOCK_SAMPLES / 2];
+        if (decimation > 1) {
+            frames = decimate(0, l, reducedLeft);
+            l = reducedLeft;
+            if (channels == 2) {
+                decimate(1, r, reducedRight);
+                r = reducedRight;
+            }
+        }
+
+        uint32_t h = head;
+        uint32_t fill = h - tail;
+        if (offset == 0 && fill + channels > depth) {
+            // The consumer has fallen a whole ring behind
+            overruns = overruns + 1;
+            audioDiagnostics.recordQueueOverrun();
+        } else {
+            // Both slots are adjacent, head only ever moves in pairs
+            int16_t* dst = slot(h) + offset;
+            if (channels == 2) {
+                uint32_t start = ARM_DWT_CYCCNT;
+                interleave(dst, l, r, frames);
+                uint32_t cycles = (ARM_DWT_CYCCNT - start) *
+                                  (AUDIO_BLOCK_SAMPLES / frames);
+                if (cycles > interleaveCycles) interleaveCycles = cycles;
+            } else {
+                memcpy(dst, l, frames * sizeof(int16_t));
+            }
+
+            offset += frames * channels;
+            if (offset == AUDIO_BLOCK_SAMPLES * channels) {
+                offset = 0;
+                head = h + channels;
+                fill += channels;
+                if (fill > highWater) highWater = fill;
+            }
+        }
+
+        EventResponder* responder = event;
+        if (responder && fill >= watermark) responder->triggerEvent();
+    }
+
+    if (left) release(left);
+    if (right) release(right);
+}
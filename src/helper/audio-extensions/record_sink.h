@@ -0,0 +1,96 @@
+#ifndef record_sink_h_
+#define record_sink_h_
+#include <Arduino.h>
+#include <AudioStream.h>
+#include <EventResponder.h>
+
+#include "halfband_decimator.h"
+
+// Record endpoint that copies every incoming block straight into a ring of
+// sector aligned slots owned by the consumer (WavFileWriter), so audio
+// library blocks are released in the same update and nothing is queued by
+// reference. The audio interrupt is the only producer (head), the consumer
+// is the only one advancing the tail.
+//
+// In stereo, input 0 (left) and input 1 (right) are interleaved into two
+// consecutive slots, so the ring holds plain interleaved PCM.
+//
+// The input can be decimated by 2 or 4 on the way in (22.05 / 11.025 kHz).
+// Slots are then filled over several updates and only handed over once
+// complete.
+class AudioRecordSink : public AudioStream {
+   public:
+    AudioRecordSink(void)
+        : AudioStream(2, inputQueueArray),
+          ring(NULL),
+          slots(0),
+          depth(0),
+          watermark(1),
+          channels(1),
+          decimation(1),
+          offset(0),
+          event(NULL),
+          enabled(false),
+          interleaveCycles(0) {
+        reset();
+    }
+
+    // `count` slots of AUDIO_BLOCK_SAMPLES samples each. Must be even for
+    // stereo.
+    void setRing(int16_t* storage, uint32_t count);
+    // 1 records input 0 only, 2 interleaves both inputs. Only while stopped.
+    void setChannels(uint16_t count) { channels = count == 2 ? 2 : 1; }
+    uint16_t getChannels(void) const { return channels; }
+    // 1, 2 or 4. Only while stopped.
+    void setDecimation(uint16_t factor) {
+        decimation = factor == 4 ? 4 : factor == 2 ? 2 : 1;
+    }
+    uint16_t getDecimation(void) const { return decimation; }
+    // Blocks held before new input is dropped, at most the ring size
+    void setDepth(uint32_t blocks);
+    // The event fires for every block while at least this many are held
+    void setWatermark(uint32_t blocks) { watermark = blocks > 0 ? blocks : 1; }
+    void setEvent(EventResponder* responder) { event = responder; }
+
+    void begin(void) { enabled = true; }
+    void end(void) { enabled = false; }
+    // Empties the ring and the filters, only while the sink is stopped
+    void reset(void);
+
+    uint32_t available(void) const { return head - tail; }
+    uint32_t headIndex(void) const { return head; }
+    uint32_t tailIndex(void) const { return tail; }
+    int16_t* slot(uint32_t index) const {
+        return ring + (index % slots) * AUDIO_BLOCK_SAMPLES;
+    }
+    void consume(uint32_t blocks) { tail = tail + blocks; }
+
+    uint32_t getHighWater(void) const { return highWater; }
+    void resetHighWater(void) { highWater = available(); }
+    uint32_t getOverruns(void) const { return overruns; }
+    // Worst CPU cycles spent interleaving AUDIO_BLOCK_SAMPLES stereo frames
+    uint32_t getInterleaveCycles(void) const { return interleaveCycles; }
+
+    virtual void update(void);
+
+   private:
+    int decimate(uint16_t channel, const int16_t* in, int16_t* out);
+
+    audio_block_t* inputQueueArray[2];
+    int16_t* ring;
+    uint32_t slots;
+    uint32_t depth;
+    uint32_t watermark;
+    uint16_t channels;
+    uint16_t decimation;
+    uint32_t offset;  // samples already in the slots at head
+    HalfbandDecimator decimators[2][2];  // [channel][stage]
+    EventResponder* volatile event;
+    volatile bool enabled;
+    volatile uint32_t interleaveCycles;
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t highWater;
+    volatile uint32_t overruns;
+};
+#endif
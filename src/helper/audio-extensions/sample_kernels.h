@@ -0,0 +1,164 @@
+#ifndef sample_kernels_h_
+#define sample_kernels_h_
+#include <Arduino.h>
+#include <AudioStream.h>
+
+// Block kernels shared by the sample players. Blocks and sources are 16 bit
+// PCM, the M7 versions handle two samples per 32 bit word.
+
+static inline int16_t saturate16(int32_t value) {
+#if defined(__ARM_ARCH_7EM__)
+    int32_t out;
+    asm("ssat %0, #16, %1" : "=r"(out) : "r"(value));
+    return out;
+#else
+    if (value > 32767) return 32767;
+    if (value < -32768) return -32768;
+    return value;
+#endif
+}
+
+#if defined(__ARM_ARCH_7EM__)
+// (gain * bottom half of pair) >> 16
+static inline int32_t multiply_32x16b(int32_t gain, uint32_t pair) {
+    int32_t out;
+    asm("smulwb %0, %1, %2" : "=r"(out) : "r"(gain), "r"(pair));
+    return out;
+}
+
+// (gain * top half of pair) >> 16
+static inline int32_t multiply_32x16t(int32_t gain, uint32_t pair) {
+    int32_t out;
+    asm("smulwt %0, %1, %2" : "=r"(out) : "r"(gain), "r"(pair));
+    return out;
+}
+
+static inline uint32_t saturate_pack(int32_t bottom, int32_t top) {
+    int32_t b, t;
+    uint32_t out;
+    asm("ssat %0, #16, %1" : "=r"(b) : "r"(bottom));
+    asm("ssat %0, #16, %1" : "=r"(t) : "r"(top));
+    asm("pkhbt %0, %1, %2, lsl #16" : "=r"(out) : "r"(b), "r"(t));
+    return out;
+}
+#endif
+
+// Scales a block by a Q16 gain that moves by `step` every sample. The M7
+// does two samples per word: SMULWB/SMULWT multiply, SSAT clips and PKHBT
+// packs them back, about 1.5 cycles per sample with no float in sight.
+static inline void apply_gain(int16_t* data, int32_t gain, int32_t step) {
+#if defined(__ARM_ARCH_7EM__)
+    uint32_t* p = (uint32_t*)data;
+    const uint32_t* end = p + AUDIO_BLOCK_SAMPLES / 2;
+    int32_t next = gain + step;
+    const int32_t step2 = step * 2;
+    do {
+        uint32_t pair = *p;
+        *p++ = saturate_pack(multiply_32x16b(gain, pair),
+                             multiply_32x16t(next, pair));
+        gain += step2;
+        next += step2;
+    } while (p < end);
+#else
+    for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++, gain += step) {
+        int32_t value = (int32_t)(((int64_t)gain * data[i]) >> 16);
+        if (value > 32767) value = 32767;
+        if (value < -32768) value = -32768;
+        data[i] = value;
+    }
+#endif
+}
+
+// Clips a block of 32 bit sums to 16 bit, two at a time on the M7
+static inline void saturate_block(int16_t* dst, const int32_t* src) {
+#if defined(__ARM_ARCH_7EM__)
+    uint32_t* d = (uint32_t*)dst;
+    for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i += 2) {
+        *d++ = saturate_pack(src[i], src[i + 1]);
+    }
+#else
+    for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) dst[i] = saturate16(src[i]);
+#endif
+}
+
+#if defined(__ARM_ARCH_7EM__)
+static inline uint32_t pack_bottoms(uint32_t a, uint32_t b) {
+    uint32_t out;
+    asm("pkhbt %0, %1, %2, lsl #16" : "=r"(out) : "r"(a), "r"(b));
+    return out;
+}
+
+static inline uint32_t pack_tops(uint32_t a, uint32_t b) {
+    uint32_t out;
+    asm("pkhtb %0, %1, %2, asr #16" : "=r"(out) : "r"(b), "r"(a));
+    return out;
+}
+#endif
+
+// Splits interleaved frames into the two blocks. On the M7 two frames go
+// through at a time: PKHBT gathers the left samples, PKHTB the right ones.
+static inline void deinterleave(int16_t* left, int16_t* right,
+                                const uint8_t* src, uint32_t frames) {
+#if defined(__ARM_ARCH_7EM__)
+    // The blocks are word aligned, the source only every other frame
+    if (((uintptr_t)left & 3) == 0 && ((uintptr_t)src & 3) == 0) {
+        uint32_t* l = (uint32_t*)left;
+        uint32_t* r = (uint32_t*)right;
+        const uint32_t* s = (const uint32_t*)src;
+        for (; frames >= 2; frames -= 2) {
+            uint32_t a = *s++;  // L0 R0
+            uint32_t b = *s++;  // L1 R1
+            *l++ = pack_bottoms(a, b);
+            *r++ = pack_tops(a, b);
+        }
+        left = (int16_t*)l;
+        right = (int16_t*)r;
+        src = (const uint8_t*)s;
+    }
+#endif
+    const int16_t* s = (const int16_t*)src;
+    while (frames-- > 0) {
+        *left++ = *s++;
+        *right++ = *s++;
+    }
+}
+
+// A word of 1, 2 or 4 byte frames with their order flipped: REV for bytes,
+// a halfword rotate for 16 bit frames. Both are single instructions.
+template <uint32_t FrameBytes>
+static inline uint32_t flip_frames(uint32_t word) {
+    if (FrameBytes == 1) return __builtin_bswap32(word);
+    if (FrameBytes == 2) return (word >> 16) | (word << 16);
+    return word;
+}
+
+// Reverses the order of the frames in `data`, in place. Words are swapped
+// end for end and flipped in-register on the way, the few frames left in
+// the middle go one at a time. Loads go through memcpy(), so `data` may be
+// unaligned: the M7 takes that in a plain LDR.
+template <uint32_t FrameBytes>
+static inline void reverse_frames(uint8_t* data, uint32_t bytes) {
+    uint8_t* lo = data;
+    uint8_t* hi = data + bytes;
+    while (hi - lo >= 8) {
+        hi -= 4;
+        uint32_t a, b;
+        memcpy(&a, lo, 4);
+        memcpy(&b, hi, 4);
+        a = flip_frames<FrameBytes>(a);
+        b = flip_frames<FrameBytes>(b);
+        memcpy(lo, &b, 4);
+        memcpy(hi, &a, 4);
+        lo += 4;
+    }
+    while (hi - lo >= (int)(2 * FrameBytes)) {
+        hi -= FrameBytes;
+        uint8_t frame[FrameBytes];
+        memcpy(frame, lo, FrameBytes);
+        memcpy(lo, hi, FrameBytes);
+        memcpy(hi, frame, FrameBytes);
+        lo += FrameBytes;
+    }
+}
+
+#endif
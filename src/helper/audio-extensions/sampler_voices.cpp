@@ -0,0 +1,307 @@
+#include "sampler_voices.h"
+
+#include "../AudioDiagnostics.h"
+#include "sample_kernels.h"
+
+static int32_t gain_q16(float gain) {
+    if (gain < 0.0f) gain = 0.0f;
+    if (gain > 16.0f) gain = 16.0f;
+    return (int32_t)(gain * 65536.0f);
+}
+
+// Two octaves either way
+static uint32_t step_q16(float pitch) {
+    if (pitch < 0.25f) pitch = 0.25f;
+    if (pitch > 4.0f) pitch = 4.0f;
+    return (uint32_t)(pitch * 65536.0f + 0.5f);
+}
+
+AudioSamplerVoices::AudioSamplerVoices(void)
+    : AudioStream(0, NULL),
+      next_id(0),
+      steal_policy(STEAL_OLDEST),
+      voice_limit(SAMPLER_VOICES),
+      voice_cycles(0) {
+    memset(voices, 0, sizeof(voices));
+}
+
+uint32_t AudioSamplerVoices::play(const int16_t* samples, uint32_t frames,
+                                  uint8_t channelCount, float gain,
+                                  float pitch, uint32_t startFrame) {
+    if (!samples || startFrame >= frames) return 0;
+    if (channelCount < 1 || channelCount > 2) return 0;
+
+    Note note;
+    note.data = samples;
+    note.frames = frames;
+    note.channels = channelCount;
+    note.gain = gain_q16(gain);
+    note.step = step_q16(pitch);
+    note.start = startFrame;
+
+    __disable_irq();
+    note.id = ++next_id;
+    if (note.id == 0) note.id = ++next_id;
+    Voice* voice = pick();
+    if (voice->note.id) {
+        // Stolen, update() fades the old note out first
+        voice->next = note;
+    } else {
+        voice->note = note;
+        voice->next.id = 0;
+        voice->index = note.start;
+        voice->frac = 0;
+        voice->gain_current = 0;
+        voice->releasing = false;
+    }
+    __enable_irq();
+    return note.id;
+}
+
+void AudioSamplerVoices::setGain(uint32_t note, float gain) {
+    int32_t q16 = gain_q16(gain);
+    __disable_irq();
+    Voice* voice = find(note);
+    if (voice) {
+        if (voice->next.id == note) voice->next.gain = q16;
+        else voice->note.gain = q16;
+    }
+    __enable_irq();
+}
+
+void AudioSamplerVoices::setPitch(uint32_t note, float pitch) {
+    uint32_t q16 = step_q16(pitch);
+    __disable_irq();
+    Voice* voice = find(note);
+    if (voice) {
+        if (voice->next.id == note) voice->next.step = q16;
+        else voice->note.step = q16;
+    }
+    __enable_irq();
+}
+
+void AudioSamplerVoices::stop(uint32_t note) {
+    __disable_irq();
+    Voice* voice = find(note);
+    if (voice) {
+        if (voice->next.id == note) voice->next.id = 0;
+        else voice->releasing = true;
+    }
+    __enable_irq();
+}
+
+void AudioSamplerVoices::stopAll(void) {
+    __disable_irq();
+    for (Voice& voice : voices) {
+        voice.next.id = 0;
+        if (voice.note.id) voice.releasing = true;
+    }
+    __enable_irq();
+}
+
+bool AudioSamplerVoices::isPlaying(uint32_t note) {
+    return note != 0 && find(note) != NULL;
+}
+
+bool AudioSamplerVoices::isPlaying(void) { return activeVoices() > 0; }
+
+uint32_t AudioSamplerVoices::position(uint32_t note) {
+    uint32_t frame = 0;
+    __disable_irq();
+    Voice* voice = note ? find(note) : NULL;
+    if (voice && voice->note.id == note) frame = voice->index;
+    __enable_irq();
+    return frame;
+}
+
+bool AudioSamplerVoices::isPlayingFrom(const int16_t* samples) {
+    for (Voice& voice : voices) {
+        if (voice.note.id && voice.note.data == samples) return true;
+        if (voice.next.id && voice.next.data == samples) return true;
+    }
+    return false;
+}
+
+int AudioSamplerVoices::activeVoices(void) {
+    int count = 0;
+    for (Voice& voice : voices) {
+        if (voice.note.id || voice.next.id) count++;
+    }
+    return count;
+}
+
+AudioSamplerVoices::Voice* AudioSamplerVoices::find(uint32_t note) {
+    for (Voice& voice : voices) {
+        if (voice.note.id == note || voice.next.id == note) return &voice;
+    }
+    return NULL;
+}
+
+// A free voice while fewer than voice_limit are busy, otherwise the one
+// the steal policy gives up
+AudioSamplerVoices::Voice* AudioSamplerVoices::pick(void) {
+    int busy = 0;
+    Voice* free = NULL;
+    for (Voice& voice : voices) {
+        if (voice.note.id) busy++;
+        else if (!free) free = &voice;
+    }
+    if (free && busy < voice_limit) return free;
+
+    Voice* victim = NULL;
+    for (Voice& voice : voices) {
+        if (!voice.note.id) continue;
+        if (!victim) {
+            victim = &voice;
+        } else if (steal_policy == STEAL_QUIETEST) {
+            if (voice.peak < victim->peak) victim = &voice;
+        } else {
+            // Ids only grow, a pending note makes the voice new again
+            uint32_t age = voice.next.id ? voice.next.id : voice.note.id;
+            uint32_t victim_age =
+                victim->next.id ? victim->next.id : victim->note.id;
+            if (age < victim_age) victim = &voice;
+        }
+    }
+    return victim ? victim : free;
+}
+
+// Adds `count` samples of a voice to the mix, ramping its gain towards the
+// note's gain, or to silence on its last block
+template <bool Stereo, bool Interpolate>
+bool AudioSamplerVoices::render(Voice& voice, int32_t* left, int32_t* right,
+                                uint32_t count, bool last) {
+    const int16_t* data = voice.note.data;
+    const uint32_t step = voice.note.step;
+    const int32_t target = last ? 0 : voice.note.gain;
+    int32_t gain = voice.gain_current;
+    const int32_t ramp = (target - gain) / (int32_t)count;
+    uint32_t index = voice.index;
+    uint32_t frac = voice.frac;
+    uint32_t peak = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const int16_t* frame = data + index * (Stereo ? 2 : 1);
+        int32_t l = frame[0];
+        int32_t r = Stereo ? frame[1] : 0;
+        if (Interpolate) {
+            // Linear, the fraction in Q15 keeps the product in 32 bits
+            int32_t f = frac >> 1;
+            l += ((frame[Stereo ? 2 : 1] - l) * f) >> 15;
+            if (Stereo) r += ((frame[3] - r) * f) >> 15;
+            frac += step;
+            index += frac >> 16;
+            frac &= 0xffff;
+        } else {
+            index++;
+        }
+        l = (int32_t)(((int64_t)l * gain) >> 16);
+        left[i] += l;
+        peak |= l ^ (l >> 31);
+        if (Stereo) {
+            r = (int32_t)(((int64_t)r * gain) >> 16);
+            right[i] += r;
+            peak |= r ^ (r >> 31);
+        } else {
+            right[i] += l;
+        }
+        gain += ramp;
+    }
+
+    voice.index = index;
+    voice.frac = frac;
+    voice.gain_current = target;
+    voice.peak = peak;
+    return !last;
+}
+
+// Next block of a voice. Returns false once the note has ended.
+bool AudioSamplerVoices::render(Voice& voice, int32_t* left, int32_t* right) {
+    const Note& note = voice.note;
+    bool interpolate = note.step != 65536 || voice.frac != 0;
+    uint32_t count;
+    bool last;
+    if (interpolate) {
+        // Every output sample needs the frame after it as well
+        uint64_t end = (uint64_t)(note.frames - 1) << 16;
+        uint64_t at = ((uint64_t)voice.index << 16) | voice.frac;
+        uint64_t remaining = at < end ? (end - at + note.step - 1) / note.step
+                                      : 0;
+        count = remaining < AUDIO_BLOCK_SAMPLES ? remaining
+                                                : AUDIO_BLOCK_SAMPLES;
+        last = remaining <= AUDIO_BLOCK_SAMPLES;
+    } else {
+        uint32_t remaining = note.frames - voice.index;
+        count = remaining < AUDIO_BLOCK_SAMPLES ? remaining
+                                                : AUDIO_BLOCK_SAMPLES;
+        last = remaining <= AUDIO_BLOCK_SAMPLES;
+    }
+    if (count == 0) return false;
+    last = last || voice.releasing || voice.next.id != 0;
+
+    if (note.channels == 2) {
+        return interpolate ? render<true, true>(voice, left, right, count, last)
+                           : render<true, false>(voice, left, right, count,
+                                                 last);
+    }
+    return interpolate ? render<false, true>(voice, left, right, count, last)
+                       : render<false, false>(voice, left, right, count, last);
+}
+
+void AudioSamplerVoices::update(void) {
+    uint32_t start = ARM_DWT_CYCCNT;
+    int32_t left[AUDIO_BLOCK_SAMPLES];
+    int32_t right[AUDIO_BLOCK_SAMPLES];
+    int active = 0;
+
+    for (Voice& voice : voices) {
+        if (!voice.note.id) continue;
+        if (active++ == 0) {
+            memset(left, 0, sizeof(left));
+            memset(right, 0, sizeof(right));
+        }
+        if (render(voice, left, right)) continue;
+
+        voice.note.id = 0;
+        voice.releasing = false;
+        if (voice.next.id) {
+            // A stolen voice, the new note fades in where the old one
+            // faded out
+            voice.note = voice.next;
+            voice.next.id = 0;
+            voice.index = voice.note.start;
+            voice.frac = 0;
+            voice.gain_current = 0;
+            if (!render(voice, left, right)) voice.note.id = 0;
+        }
+    }
+    if (active == 0) return;
+
+    audio_block_t* out_left = allocate();
+    if (!out_left) return;
+    audio_block_t* out_right = allocate();
+    if (!out_right) {
+        release(out_left);
+        return;
+    }
+    saturate_block(out_left->data, left);
+    saturate_block(out_right->data, right);
+    transmit(out_left, 0);
+    transmit(out_right, 1);
+    release(out_left);
+    release(out_right);
+
+    // Going by the dearest voice so far, how many fit the budget
+    uint32_t cycles = ARM_DWT_CYCCNT - start;
+    audioDiagnostics.recordSamplerBlock(cycles);
+    if (cycles / active > voice_cycles) {
+        voice_cycles = cycles / active;
+        uint32_t budget = (uint64_t)F_CPU_ACTUAL * AUDIO_BLOCK_SAMPLES /
+                          AUDIO_SAMPLE_RATE_EXACT *
+                          SAMPLER_CPU_BUDGET_PERCENT / 100;
+        uint32_t limit = budget / voice_cycles;
+        if (limit < 1) limit = 1;
+        if (limit > SAMPLER_VOICES) limit = SAMPLER_VOICES;
+        voice_limit = limit;
+    }
+}
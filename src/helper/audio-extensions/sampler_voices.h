@@ -0,0 +1,81 @@
+#ifndef sampler_voices_h_
+#define sampler_voices_h_
+#include <Arduino.h>
+#include <AudioStream.h>
+
+#ifndef SAMPLER_VOICES
+#define SAMPLER_VOICES 8
+#endif
+
+// Share of each block period the voices may use. The cost of a voice is
+// measured as they play, and no more voices sound at once than fit.
+#ifndef SAMPLER_CPU_BUDGET_PERCENT
+#define SAMPLER_CPU_BUDGET_PERCENT 30
+#endif
+
+// Polyphonic player for 16 bit PCM held in RAM. Every voice has its own
+// gain and pitch, all of them are summed into one stereo pair (mono
+// samples go to both sides). When no voice is free one is stolen, it fades
+// out over one block while the new note fades in.
+class AudioSamplerVoices : public AudioStream {
+   public:
+    enum StealPolicy { STEAL_OLDEST, STEAL_QUIETEST };
+
+    AudioSamplerVoices(void);
+    // `frames` interleaved frames, they have to stay put until the note has
+    // ended, see isPlayingFrom(). Pitch 2.0 plays an octave up. The note
+    // starts `startFrame` frames in. Returns the note for the calls below,
+    // 0 if nothing could be started.
+    uint32_t play(const int16_t* samples, uint32_t frames,
+                  uint8_t channelCount, float gain = 1.0, float pitch = 1.0,
+                  uint32_t startFrame = 0);
+    void setGain(uint32_t note, float gain);
+    void setPitch(uint32_t note, float pitch);
+    void stop(uint32_t note);
+    void stopAll(void);
+    bool isPlaying(uint32_t note);
+    bool isPlaying(void);
+    // Frame a note has got to, 0 until it has started
+    uint32_t position(uint32_t note);
+    // True while any note may still read the data
+    bool isPlayingFrom(const int16_t* samples);
+    int activeVoices(void);
+    // Voices that fit the CPU budget, going by the worst cost seen so far
+    int voiceLimit(void) { return voice_limit; }
+    void setStealPolicy(StealPolicy policy) { steal_policy = policy; }
+    virtual void update(void);
+
+   private:
+    struct Note {
+        const int16_t* data;
+        uint32_t frames;
+        uint8_t channels;
+        int32_t gain;    // Q16, 65536 is unity
+        uint32_t step;   // Q16 frames per output sample
+        uint32_t start;  // first frame
+        uint32_t id;             // 0 when there's no note
+    };
+    struct Voice {
+        Note note;
+        Note next;  // waits for `note` to fade out
+        uint32_t index;  // frame
+        uint32_t frac;   // Q16 position between index and index + 1
+        int32_t gain_current;
+        uint32_t peak;  // of the last block, for STEAL_QUIETEST
+        volatile bool releasing;
+    };
+
+    Voice* find(uint32_t note);
+    Voice* pick(void);
+    template <bool Stereo, bool Interpolate>
+    static bool render(Voice& voice, int32_t* left, int32_t* right,
+                       uint32_t count, bool last);
+    bool render(Voice& voice, int32_t* left, int32_t* right);
+
+    Voice voices[SAMPLER_VOICES];
+    uint32_t next_id;
+    StealPolicy steal_policy;
+    volatile int voice_limit;
+    uint32_t voice_cycles;  // worst seen for one voice and block
+};
+#endif
@@ -11,11 +11,14 @@
 #include <Wire.h>
 
 #include "gui/Screen.h"
+#include "gui/screens/DiagnosticsScreen.h"
 #include "gui/screens/HomeScreen.h"
 #include "gui/screens/LiveScreen.h"
 #include "gui/screens/RecorderScreen.h"
 #include "hardware/Controls.h"
+#include "helper/AudioDiagnostics.h"
 #include "helper/AudioResources.h"
+#include "helper/WavFileWriter.hpp"
 
 #define SDCARD_CS_PIN 10
 #define SDCARD_MOSI_PIN 11
@@ -44,6 +47,7 @@ void changeContext(AppContext newContext);
 HomeScreen homeContext(&controls, &screen, changeContext);
 RecorderScreen recorderContext(&controls, &screen, changeContext);
 LiveScreen liveContext(&controls, &screen, changeContext);
+DiagnosticsScreen diagnosticsContext(&controls, &screen, changeContext);
 AudioResources audioResources;
 
 void changeContext(AppContext newContext) {
@@ -60,6 +64,9 @@ void changeContext(AppContext newContext) {
         case AppContext::LIVE:
             liveContext.refresh();
             break;
+        case AppContext::DIAGNOSTICS:
+            diagnosticsContext.refresh();
+            break;
         default:
             break;
     }
@@ -76,6 +83,9 @@ void sendEventToActiveContext(Controls::ButtonEvent event) {
         case AppContext::LIVE:
             liveContext.handleEvent(event);
             break;
+        case AppContext::DIAGNOSTICS:
+            diagnosticsContext.handleEvent(event);
+            break;
         default:
             break;
     }
@@ -109,6 +119,9 @@ void setup(void) {
         }
     }
 
+    // Recover takes that were cut short by a reset or a pulled battery
+    WavFileWriter::repairRecordings("/RECORDINGS");
+
     screen.begin();
     controls.setEventCallback(handleControlEvent);
 
@@ -140,6 +153,29 @@ void sendTickToActiveContext() {
             globalTickIntervalNew = recorderContext.receiveTimerTick();
             updateTickInterval(globalTickIntervalNew);
             break;
+        case AppContext::DIAGNOSTICS:
+            globalTickIntervalNew = diagnosticsContext.receiveTimerTick();
+            updateTickInterval(globalTickIntervalNew);
+            break;
+        default:
+            break;
+    }
+}
+
+// Single character commands over USB serial:
+//   d  dump the audio pipeline counters
+//   r  reset them
+void handleSerialCommand() {
+    if (!Serial.available()) return;
+
+    switch (Serial.read()) {
+        case 'd':
+            audioDiagnostics.printTo(Serial);
+            break;
+        case 'r':
+            audioDiagnostics.reset();
+            Serial.println("Diagnostics reset");
+            break;
         default:
             break;
     }
@@ -148,6 +184,10 @@ void sendTickToActiveContext() {
 void loop(void) {
     if (recorderContext.currentState == recorderContext.RECORDER_RECORDING)
         recorderContext.continueRecording();
+    if (recorderContext.currentState == recorderContext.RECORDER_EDITING)
+        recorderContext.continueScrubbing();
+
+    if (currentAppContext == AppContext::LIVE) liveContext.continueLoading();
 
     if (ticked) {
         ticked = false;
@@ -155,4 +195,5 @@ void loop(void) {
     }
 
     controls.tick();
+    handleSerialCommand();
 }
\ No newline at end of file
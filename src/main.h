@@ -5,6 +5,7 @@ enum AppContext {
     HOME = 0,
     RECORDER = 1,
     LIVE = 2,
+    DIAGNOSTICS = 3,
 };
 
 #endif
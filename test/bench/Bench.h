@@ -0,0 +1,63 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Timing for the test_bench_* suites. The figures are wall-clock time on
+// the build machine: good for comparing kernels with each other and from
+// one commit to the next, not as Teensy cycle counts. On the device the
+// AudioDiagnostics counters measure the same code.
+
+#include <unity.h>
+
+#include <chrono>
+#include <cstdio>
+
+namespace bench {
+
+// Best time per call of `body` over a few rounds of `calls` calls each,
+// in nanoseconds
+template <typename Body>
+double nanosPerCall(Body body, uint32_t calls = 20000, int rounds = 7) {
+    double best = 1e30;
+    for (int round = 0; round < rounds; round++) {
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < calls; i++) body();
+        std::chrono::duration<double, std::nano> took =
+            std::chrono::steady_clock::now() - start;
+        if (took.count() / calls < best) best = took.count() / calls;
+    }
+    return best;
+}
+
+// Adds up the time spent in time() calls, for benchmarks with untimed work
+// between the parts they measure
+class Stopwatch {
+   public:
+    template <typename Body>
+    void time(Body body) {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        std::chrono::duration<double, std::nano> took =
+            std::chrono::steady_clock::now() - start;
+        _nanos += took.count();
+    }
+    double nanos() const { return _nanos; }
+
+   private:
+    double _nanos = 0;
+};
+
+// Keeps the compiler from dropping work whose result nobody reads
+template <typename T>
+inline void keep(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+inline void report(const char* what, double nanos) {
+    char line[120];
+    snprintf(line, sizeof(line), "%-44s %8.0f ns", what, nanos);
+    TEST_MESSAGE(line);
+}
+
+}  // namespace bench
+
+#endif  // BENCH_H
@@ -0,0 +1,130 @@
+#ifndef MOCK_ARDUINO_H
+#define MOCK_ARDUINO_H
+
+// Just enough of the Teensy core for the helpers to build on the host, see
+// MockHardware.h for how time and interrupts are simulated
+
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <string>
+
+#include "MockHardware.h"
+
+#define DMAMEM
+#define EXTMEM
+#define FASTRUN
+#define PROGMEM
+#define F_CPU_ACTUAL 600000000
+
+using std::max;
+using std::min;
+
+typedef uint8_t byte;
+
+inline uint32_t millis() { return (uint32_t)(mock::now / 1000); }
+inline uint32_t micros() { return (uint32_t)mock::now; }
+inline void delay(uint32_t ms) { mock::advance((uint64_t)ms * 1000); }
+inline void delayMicroseconds(uint32_t us) { mock::advance(us); }
+
+// Nothing preempts the host side for real, interrupts only run where the
+// simulation lets time pass
+inline void noInterrupts() {}
+inline void interrupts() {}
+#define __disable_irq() noInterrupts()
+#define __enable_irq() interrupts()
+
+// Cycle counter at 600 MHz, only moves with virtual time
+#define ARM_DWT_CYCCNT ((uint32_t)(mock::now * 600))
+
+class String {
+   public:
+    String() {}
+    String(const char* text) : _text(text ? text : "") {}
+    String(const std::string& text) : _text(text) {}
+    String(int value) : _text(std::to_string(value)) {}
+    String(unsigned int value) : _text(std::to_string(value)) {}
+    String(long value) : _text(std::to_string(value)) {}
+    String(unsigned long value) : _text(std::to_string(value)) {}
+
+    const char* c_str() const { return _text.c_str(); }
+    unsigned int length() const { return _text.size(); }
+    String substring(unsigned int from) const { return _text.substr(from); }
+    String substring(unsigned int from, unsigned int to) const {
+        return _text.substr(from, to - from);
+    }
+    int indexOf(char c) const { return position(_text.find(c)); }
+    int lastIndexOf(char c) const { return position(_text.rfind(c)); }
+    bool endsWith(const String& suffix) const {
+        return _text.size() >= suffix._text.size() &&
+               _text.compare(_text.size() - suffix._text.size(),
+                             suffix._text.size(), suffix._text) == 0;
+    }
+    bool operator==(const String& other) const { return _text == other._text; }
+    bool operator!=(const String& other) const { return _text != other._text; }
+    String& operator+=(const String& other) {
+        _text += other._text;
+        return *this;
+    }
+    friend String operator+(const String& a, const String& b) {
+        return a._text + b._text;
+    }
+
+   private:
+    static int position(size_t found) {
+        return found == std::string::npos ? -1 : (int)found;
+    }
+
+    std::string _text;
+};
+
+// Output goes nowhere unless MOCK_SERIAL_ECHO is set
+class Print {
+   public:
+    virtual ~Print() {}
+    size_t printf(const char* format, ...) {
+        va_list args;
+        va_start(args, format);
+        int n = echo() ? vprintf(format, args) : 0;
+        va_end(args);
+        return n > 0 ? n : 0;
+    }
+    size_t print(const String& text) { return printf("%s", text.c_str()); }
+    size_t print(const char* text) { return printf("%s", text); }
+    size_t print(long value) { return printf("%ld", value); }
+    size_t print(unsigned long value) { return printf("%lu", value); }
+    size_t print(int value) { return printf("%d", value); }
+    size_t print(unsigned int value) { return printf("%u", value); }
+    size_t print(double value) { return printf("%.2f", value); }
+    size_t println() { return printf("\n"); }
+    template <typename T>
+    size_t println(T value) {
+        return print(value) + println();
+    }
+
+   private:
+    static bool echo() { return getenv("MOCK_SERIAL_ECHO") != nullptr; }
+};
+
+class Stream : public Print {};
+
+class MockSerial : public Stream {
+   public:
+    void begin(long) {}
+    operator bool() { return true; }
+    int available() { return 0; }
+    int read() { return -1; }
+};
+
+inline MockSerial Serial;
+
+#include <EventResponder.h>
+
+#endif  // MOCK_ARDUINO_H
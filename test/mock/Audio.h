@@ -0,0 +1,9 @@
+#ifndef MOCK_AUDIO_H
+#define MOCK_AUDIO_H
+
+// Only the core of the audio library, none of its objects
+#include <AudioStream.h>
+
+#include "spi_interrupt.h"
+
+#endif  // MOCK_AUDIO_H
@@ -0,0 +1,101 @@
+#ifndef MOCK_AUDIOSTREAM_H
+#define MOCK_AUDIOSTREAM_H
+
+// Audio library blocks and the update() plumbing. There are no connections:
+// a test hands blocks to an object's inputs with receive() and picks up
+// what it transmits through `output`.
+
+#include <Arduino.h>
+
+#include <functional>
+
+#ifndef MOCK_AUDIO_BLOCKS
+#define MOCK_AUDIO_BLOCKS 64
+#endif
+
+typedef struct audio_block_struct {
+    uint8_t ref_count;
+    uint8_t reserved1;
+    uint16_t memory_pool_index;
+    int16_t data[AUDIO_BLOCK_SAMPLES];
+} audio_block_t;
+
+class AudioStream {
+   public:
+    AudioStream(unsigned char ninput, audio_block_t** iqueue)
+        : num_inputs(ninput), inputQueue(iqueue) {
+        for (int i = 0; i < num_inputs; i++) inputQueue[i] = nullptr;
+    }
+    virtual ~AudioStream() {}
+    virtual void update(void) = 0;
+
+    // Hands `block` to input `index`, as a connection would. The object
+    // takes over the reference.
+    void receive(audio_block_t* block, unsigned int index = 0) {
+        if (inputQueue[index]) release(inputQueue[index]);
+        inputQueue[index] = block;
+    }
+
+    // Sees every block transmitted, for as long as the call lasts
+    std::function<void(audio_block_t*, unsigned char)> output;
+
+    static audio_block_t* allocate(void) {
+        for (uint16_t i = 0; i < MOCK_AUDIO_BLOCKS; i++) {
+            audio_block_t* block = &pool[i];
+            if (block->ref_count > 0) continue;
+            block->ref_count = 1;
+            block->memory_pool_index = i;
+            memory_used++;
+            if (memory_used > memory_used_max) memory_used_max = memory_used;
+            return block;
+        }
+        return nullptr;
+    }
+    static void release(audio_block_t* block) {
+        if (block->ref_count > 1) {
+            block->ref_count--;
+        } else if (block->ref_count == 1) {
+            block->ref_count = 0;
+            memory_used--;
+        }
+    }
+
+    static inline uint16_t cpu_cycles_total = 0;
+    static inline uint16_t cpu_cycles_total_max = 0;
+    static inline uint16_t memory_used = 0;
+    static inline uint16_t memory_used_max = 0;
+
+   protected:
+    void transmit(audio_block_t* block, unsigned char index = 0) {
+        if (output) output(block, index);
+    }
+    audio_block_t* receiveReadOnly(unsigned int index = 0) {
+        if (index >= num_inputs) return nullptr;
+        audio_block_t* block = inputQueue[index];
+        inputQueue[index] = nullptr;
+        return block;
+    }
+    audio_block_t* receiveWritable(unsigned int index = 0) {
+        return receiveReadOnly(index);
+    }
+
+    bool active = true;
+    uint16_t cpu_cycles = 0;
+    uint16_t cpu_cycles_max = 0;
+
+   private:
+    static inline audio_block_t pool[MOCK_AUDIO_BLOCKS];
+
+    unsigned char num_inputs;
+    audio_block_t** inputQueue;
+};
+
+#define AudioMemoryUsage() (AudioStream::memory_used)
+#define AudioMemoryUsageMax() (AudioStream::memory_used_max)
+#define AudioMemoryUsageMaxReset() \
+    (AudioStream::memory_used_max = AudioStream::memory_used)
+#define AudioProcessorUsage() (0.0f)
+#define AudioProcessorUsageMax() (0.0f)
+#define AudioProcessorUsageMaxReset()
+
+#endif  // MOCK_AUDIOSTREAM_H
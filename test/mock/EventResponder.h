@@ -0,0 +1,7 @@
+#ifndef MOCK_EVENTRESPONDER_H
+#define MOCK_EVENTRESPONDER_H
+
+// The EventResponder lives with the simulated interrupts
+#include "MockHardware.h"
+
+#endif  // MOCK_EVENTRESPONDER_H
@@ -0,0 +1,141 @@
+#ifndef MOCKHARDWARE_H
+#define MOCKHARDWARE_H
+
+// Host stand-ins for the parts of the Teensy the helpers lean on. Time is
+// virtual: it only moves when something takes time (a card access, a
+// delay() in the sketch), and the interrupts that fall due meanwhile run
+// right there, the way they would cut in on the device. The audio
+// interrupt preempts everything, the software interrupt (EventResponders
+// attached with attachInterrupt()) preempts the sketch but not itself.
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#ifndef AUDIO_BLOCK_SAMPLES
+#define AUDIO_BLOCK_SAMPLES 128
+#endif
+#define AUDIO_SAMPLE_RATE_EXACT 44117.64706f
+#define AUDIO_SAMPLE_RATE AUDIO_SAMPLE_RATE_EXACT
+
+class EventResponder;
+typedef EventResponder& EventResponderRef;
+
+class EventResponder {
+   public:
+    typedef void (*EventFunction_t)(EventResponderRef);
+
+    void attachInterrupt(EventFunction_t function) { _function = function; }
+    void attach(EventFunction_t function) { _function = function; }
+    void detach() {
+        clearEvent();
+        _function = nullptr;
+    }
+    inline void triggerEvent(int status = 0, void* data = nullptr);
+    inline void clearEvent();
+    void setContext(void* context) { _context = context; }
+    void* getContext() { return _context; }
+    int getStatus() { return 0; }
+    void* getData() { return nullptr; }
+
+    bool isPending() const { return _pending; }
+
+   private:
+    friend struct MockInterrupts;
+    EventFunction_t _function = nullptr;
+    void* _context = nullptr;
+    bool _pending = false;
+};
+
+namespace mock {
+
+// Microseconds since the simulation started
+inline uint64_t now = 0;
+
+// Called once per audio update, AUDIO_BLOCK_SAMPLES samples apart
+inline std::function<void()> audioInterrupt;
+inline uint64_t audioUpdates = 0;
+inline bool inAudioInterrupt = false;
+
+inline std::vector<EventResponder*> pendingEvents;
+inline bool inSoftwareInterrupt = false;
+
+inline uint64_t audioUpdateTime(uint64_t update) {
+    return (uint64_t)(update * AUDIO_BLOCK_SAMPLES * 1e6 /
+                      AUDIO_SAMPLE_RATE_EXACT);
+}
+
+// Runs whatever software interrupts are pending, unless one is running
+// already or the audio interrupt is
+inline void runSoftwareInterrupt();
+
+// Lets `micros` go by, running the interrupts that fall due on the way
+inline void advance(uint64_t micros) {
+    uint64_t end = now + micros;
+    while (!inAudioInterrupt) {
+        uint64_t due = audioUpdateTime(audioUpdates + 1);
+        if (due > end) break;
+        if (due > now) now = due;
+        audioUpdates++;
+        inAudioInterrupt = true;
+        if (audioInterrupt) audioInterrupt();
+        inAudioInterrupt = false;
+        runSoftwareInterrupt();
+    }
+    if (end > now) now = end;
+    runSoftwareInterrupt();
+}
+
+// Back to time zero with nothing attached
+inline void reset() {
+    now = 0;
+    audioUpdates = 0;
+    audioInterrupt = nullptr;
+    pendingEvents.clear();
+    inAudioInterrupt = false;
+    inSoftwareInterrupt = false;
+}
+
+}  // namespace mock
+
+struct MockInterrupts {
+    static void run() {
+        if (mock::inSoftwareInterrupt || mock::inAudioInterrupt) return;
+        mock::inSoftwareInterrupt = true;
+        while (!mock::pendingEvents.empty()) {
+            EventResponder* event = mock::pendingEvents.front();
+            mock::pendingEvents.erase(mock::pendingEvents.begin());
+            event->_pending = false;
+            if (event->_function) event->_function(*event);
+        }
+        mock::inSoftwareInterrupt = false;
+    }
+
+    static void trigger(EventResponder* event) {
+        if (!event->_pending) {
+            event->_pending = true;
+            mock::pendingEvents.push_back(event);
+        }
+        // From the sketch the interrupt is taken straight away
+        run();
+    }
+
+    static void clear(EventResponder* event) {
+        if (!event->_pending) return;
+        event->_pending = false;
+        mock::pendingEvents.erase(std::find(mock::pendingEvents.begin(),
+                                            mock::pendingEvents.end(), event));
+    }
+};
+
+inline void mock::runSoftwareInterrupt() { MockInterrupts::run(); }
+
+inline void EventResponder::triggerEvent(int, void*) {
+    MockInterrupts::trigger(this);
+}
+
+inline void EventResponder::clearEvent() { MockInterrupts::clear(this); }
+
+#endif  // MOCKHARDWARE_H
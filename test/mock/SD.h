@@ -0,0 +1,93 @@
+#ifndef MOCK_SD_H
+#define MOCK_SD_H
+
+// Teensy's SD wrapper over the RAM card in SdFat.h. Copies of a File share
+// one open file and its position, and the last one to go closes it.
+
+#include <Arduino.h>
+#include <SdFat.h>
+
+#include <functional>
+#include <memory>
+
+#define FILE_READ O_RDONLY
+#define FILE_WRITE (O_RDWR | O_CREAT | O_AT_END)
+#define FILE_WRITE_BEGIN (O_RDWR | O_CREAT)
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+namespace mock {
+// Called whenever a File takes or drops a reference to an open file. The
+// device's counts aren't atomic, tests use this to see who touches them.
+inline std::function<void()> fileReferenceChanged;
+}  // namespace mock
+
+class File : public Stream {
+   public:
+    File() {}
+    explicit File(const FsFile& file)
+        : _file(std::make_shared<FsFile>(file)) {}
+    // Copies only, like Teensy's File
+    File(const File& other) : _file(other._file) { referenceChanged(); }
+    File& operator=(const File& other) {
+        if (_file != other._file) {
+            referenceChanged();
+            _file = other._file;
+            referenceChanged();
+        }
+        return *this;
+    }
+    ~File() { referenceChanged(); }
+
+    operator bool() { return _file && _file->isOpen(); }
+
+    int read(void* buf, size_t count) {
+        return _file ? _file->read(buf, count) : -1;
+    }
+    int read() { return _file ? _file->read() : -1; }
+    size_t write(const void* buf, size_t count) {
+        return _file ? _file->write(buf, count) : 0;
+    }
+    bool seek(uint64_t position, int mode = SeekSet) {
+        if (!_file) return false;
+        if (mode == SeekCur) position += _file->curPosition();
+        if (mode == SeekEnd) position += _file->fileSize();
+        return _file->seekSet(position);
+    }
+    uint64_t position() { return _file ? _file->curPosition() : 0; }
+    uint64_t size() { return _file ? _file->fileSize() : 0; }
+    int available() { return _file ? _file->available() : 0; }
+    void flush() {}
+    void close() {
+        if (_file) _file->close();
+    }
+    bool isDirectory() { return _file && _file->isDir(); }
+
+    // Open references to the same file, this one included
+    long useCount() const { return _file.use_count(); }
+
+   private:
+    void referenceChanged() const {
+        if (_file && mock::fileReferenceChanged) mock::fileReferenceChanged();
+    }
+
+    std::shared_ptr<FsFile> _file;
+};
+
+class SDClass {
+   public:
+    bool begin(uint8_t) { return true; }
+    File open(const char* path, uint8_t mode = FILE_READ) {
+        FsFile file = sdfs.open(path, mode);
+        return file ? File(file) : File();
+    }
+    bool exists(const char* path) { return sdfs.exists(path); }
+    bool remove(const char* path) { return sdfs.remove(path); }
+    bool mkdir(const char* path) { return sdfs.mkdir(path); }
+
+    SdFs sdfs;
+};
+
+inline SDClass SD;
+
+#endif  // MOCK_SD_H
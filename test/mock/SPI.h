@@ -0,0 +1,14 @@
+#ifndef MOCK_SPI_H
+#define MOCK_SPI_H
+
+#include <Arduino.h>
+
+class SPIClass {
+   public:
+    void setMOSI(uint8_t) {}
+    void setSCK(uint8_t) {}
+};
+
+inline SPIClass SPI;
+
+#endif  // MOCK_SPI_H
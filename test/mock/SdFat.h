@@ -0,0 +1,277 @@
+#ifndef MOCK_SDFAT_H
+#define MOCK_SDFAT_H
+
+// An SD card kept in RAM. Files can be pre-allocated into a contiguous run
+// of sectors and written through the block device, like SdFat does on a
+// FAT32 card. Every access can be made to take time, see mock::Card.
+
+#include <Arduino.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define O_RDONLY 0x00
+#define O_WRONLY 0x01
+#define O_RDWR 0x02
+#define O_AT_END 0x04
+#define O_APPEND 0x08
+#define O_CREAT 0x10
+#define O_TRUNC 0x20
+#define O_READ O_RDONLY
+#define O_WRITE O_WRONLY
+typedef int oflag_t;
+
+#define FAT_TYPE_FAT16 16
+#define FAT_TYPE_FAT32 32
+#define FAT_TYPE_EXFAT 64
+
+namespace mock {
+
+struct CardFile {
+    std::vector<uint8_t> data;
+    uint32_t firstSector = 0;  // of a pre-allocated extent, 0 if none
+    uint32_t sectorCount = 0;
+    bool directory = false;
+};
+
+struct Card {
+    static const size_t SECTOR_BYTES = 512;
+
+    std::map<std::string, std::shared_ptr<CardFile>> files;
+    uint8_t fatType = FAT_TYPE_FAT32;
+    // Largest contiguous run preAllocate() finds
+    uint64_t contiguousBytes = 1ull << 32;
+
+    // Microseconds the card stays busy for a write of `sectors` sectors or
+    // a read of `bytes` bytes. Virtual time moves on by that much, so
+    // the audio interrupt keeps running meanwhile.
+    std::function<uint32_t(uint32_t sectors)> writeLatency;
+    std::function<uint32_t(size_t bytes)> readLatency;
+
+    uint32_t writes = 0;
+    uint64_t sectorsWritten = 0;
+    uint32_t nextSector = 8192;
+
+    void reset() {
+        files.clear();
+        fatType = FAT_TYPE_FAT32;
+        contiguousBytes = 1ull << 32;
+        writeLatency = nullptr;
+        readLatency = nullptr;
+        writes = 0;
+        sectorsWritten = 0;
+        nextSector = 8192;
+    }
+
+    void busyWriting(uint32_t sectors) {
+        writes++;
+        sectorsWritten += sectors;
+        if (writeLatency) advance(writeLatency(sectors));
+    }
+    void busyReading(size_t bytes) {
+        if (readLatency) advance(readLatency(bytes));
+    }
+
+    CardFile* fileAt(uint32_t sector) {
+        for (auto& entry : files) {
+            CardFile* file = entry.second.get();
+            if (file->sectorCount > 0 && sector >= file->firstSector &&
+                sector < file->firstSector + file->sectorCount) {
+                return file;
+            }
+        }
+        return nullptr;
+    }
+
+    // What a file holds, empty if there's no such file
+    const std::vector<uint8_t>& contents(const std::string& path) {
+        static const std::vector<uint8_t> none;
+        auto found = files.find(path);
+        return found == files.end() ? none : found->second->data;
+    }
+};
+
+inline Card card;
+
+}  // namespace mock
+
+class FsBlockDevice {
+   public:
+    bool writeSectors(uint32_t sector, const uint8_t* src, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            if (!put(sector + i, src + i * mock::Card::SECTOR_BYTES)) {
+                return false;
+            }
+        }
+        mock::card.busyWriting(count);
+        return true;
+    }
+    bool writeSector(uint32_t sector, const uint8_t* src) {
+        return writeSectors(sector, src, 1);
+    }
+    bool isBusy() { return false; }
+    bool syncDevice() { return true; }
+
+   private:
+    static bool put(uint32_t sector, const uint8_t* src) {
+        mock::CardFile* file = mock::card.fileAt(sector);
+        if (!file) return false;
+        size_t offset =
+            (size_t)(sector - file->firstSector) * mock::Card::SECTOR_BYTES;
+        if (file->data.size() < offset + mock::Card::SECTOR_BYTES) {
+            file->data.resize(offset + mock::Card::SECTOR_BYTES);
+        }
+        memcpy(file->data.data() + offset, src, mock::Card::SECTOR_BYTES);
+        return true;
+    }
+};
+
+class FsFile {
+   public:
+    operator bool() const { return _file != nullptr; }
+    bool isOpen() const { return _file != nullptr; }
+    bool isDir() const { return _file && _file->directory; }
+
+    int read(void* buf, size_t count) {
+        if (!_file) return -1;
+        size_t size = _file->data.size();
+        size_t left = _position < size ? size - _position : 0;
+        if (count > left) count = left;
+        mock::card.busyReading(count);
+        memcpy(buf, _file->data.data() + _position, count);
+        _position += count;
+        return count;
+    }
+    int read() {
+        uint8_t byte;
+        return read(&byte, 1) == 1 ? byte : -1;
+    }
+    size_t write(const void* buf, size_t count) {
+        if (!_file) return 0;
+        std::vector<uint8_t>& data = _file->data;
+        if (data.size() < _position + count) data.resize(_position + count);
+        memcpy(data.data() + _position, buf, count);
+        _position += count;
+        mock::card.busyWriting((count + mock::Card::SECTOR_BYTES - 1) /
+                               mock::Card::SECTOR_BYTES);
+        return count;
+    }
+    size_t write(uint8_t byte) { return write(&byte, 1); }
+
+    bool seekSet(uint64_t position) {
+        if (!_file || position > _file->data.size()) return false;
+        _position = position;
+        return true;
+    }
+    uint64_t curPosition() const { return _position; }
+    uint64_t fileSize() const { return _file ? _file->data.size() : 0; }
+    int available() { return fileSize() - _position; }
+
+    bool sync() { return _file != nullptr; }
+    bool truncate(uint64_t length) {
+        if (!_file || length > _file->data.size()) return false;
+        _file->data.resize(length);
+        if (_position > length) _position = length;
+        return true;
+    }
+    bool truncate() { return truncate(_position); }
+
+    // Like SdFat: only on an empty file. On FAT32 the file takes the full
+    // length straight away, on exFAT it stays empty with the space held.
+    bool preAllocate(uint64_t length) {
+        if (!_file || !_file->data.empty() || _file->sectorCount > 0 ||
+            length > mock::card.contiguousBytes) {
+            return false;
+        }
+        uint32_t sectors = (length + mock::Card::SECTOR_BYTES - 1) /
+                           mock::Card::SECTOR_BYTES;
+        _file->firstSector = mock::card.nextSector;
+        _file->sectorCount = sectors;
+        mock::card.nextSector += sectors;
+        if (mock::card.fatType != FAT_TYPE_EXFAT) _file->data.resize(length);
+        return true;
+    }
+    bool contiguousRange(uint32_t* first, uint32_t* last) {
+        if (!_file || _file->sectorCount == 0) return false;
+        *first = _file->firstSector;
+        *last = _file->firstSector + _file->sectorCount - 1;
+        return true;
+    }
+
+    bool close() {
+        _file = nullptr;
+        return true;
+    }
+
+    size_t getName(char* name, size_t size) {
+        std::string base = _path.substr(_path.rfind('/') + 1);
+        size_t length = std::min(base.size(), size - 1);
+        memcpy(name, base.data(), length);
+        name[length] = 0;
+        return length;
+    }
+    const std::string& path() const { return _path; }
+
+    // Opens the entry after the last one opened through `dir`
+    bool openNext(FsFile* dir, oflag_t = O_RDONLY) {
+        std::string prefix = dir->_path + "/";
+        auto& files = mock::card.files;
+        auto it = files.upper_bound(dir->_lastEntry.empty() ? prefix
+                                                            : dir->_lastEntry);
+        for (; it != files.end(); ++it) {
+            const std::string& path = it->first;
+            if (path.compare(0, prefix.size(), prefix) != 0) break;
+            if (path.find('/', prefix.size()) != std::string::npos) continue;
+            dir->_lastEntry = path;
+            *this = open(path, O_RDWR);
+            return true;
+        }
+        return false;
+    }
+
+    static FsFile open(const std::string& path, oflag_t flags) {
+        FsFile file;
+        auto& files = mock::card.files;
+        auto found = files.find(path);
+        if (found == files.end()) {
+            if (!(flags & O_CREAT)) return file;
+            found = files.emplace(path, std::make_shared<mock::CardFile>())
+                        .first;
+        } else if ((flags & O_TRUNC) && !found->second->directory) {
+            *found->second = mock::CardFile();
+        }
+        file._file = found->second;
+        file._path = path;
+        if (flags & O_AT_END) file._position = file._file->data.size();
+        return file;
+    }
+
+   private:
+    std::shared_ptr<mock::CardFile> _file;
+    std::string _path;
+    uint64_t _position = 0;
+    std::string _lastEntry;  // of a directory being listed
+};
+
+class SdFs {
+   public:
+    FsFile open(const char* path, oflag_t flags = O_RDONLY) {
+        return FsFile::open(path, flags);
+    }
+    bool exists(const char* path) { return mock::card.files.count(path) > 0; }
+    bool remove(const char* path) { return mock::card.files.erase(path) > 0; }
+    bool mkdir(const char* path) {
+        auto file = std::make_shared<mock::CardFile>();
+        file->directory = true;
+        return mock::card.files.emplace(path, file).second;
+    }
+    uint8_t fatType() { return mock::card.fatType; }
+    FsBlockDevice* card() { return &_device; }
+
+   private:
+    FsBlockDevice _device;
+};
+
+#endif  // MOCK_SDFAT_H
@@ -0,0 +1,13 @@
+#ifndef MOCK_SPI_INTERRUPT_H
+#define MOCK_SPI_INTERRUPT_H
+
+// Counts the players holding the card instead of masking the audio
+// interrupt during SPI transactions
+namespace mock {
+inline int spiUsers = 0;
+}
+
+inline void AudioStartUsingSPI() { mock::spiUsers++; }
+inline void AudioStopUsingSPI() { mock::spiUsers--; }
+
+#endif  // MOCK_SPI_INTERRUPT_H
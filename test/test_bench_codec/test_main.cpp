@@ -0,0 +1,106 @@
+// Encode and decode cost of one lossless frame, for the kinds of input that
+// take the codec down its different paths.
+
+#include <Arduino.h>
+#include <Bench.h>
+#include <unity.h>
+
+#include <cmath>
+
+#include "helper/LosslessCodec.hpp"
+
+static const uint32_t BLOCKS = 64;
+
+static int16_t input[BLOCKS][AUDIO_BLOCK_SAMPLES * 2];
+
+// Quiet noise over a couple of partials, roughly what a mic take holds
+static void fillMusic(uint16_t channels) {
+    uint32_t seed = 1;
+    for (uint32_t b = 0; b < BLOCKS; b++) {
+        for (int i = 0; i < AUDIO_BLOCK_SAMPLES * channels; i++) {
+            double t = b * AUDIO_BLOCK_SAMPLES + i / channels;
+            seed = seed * 1664525u + 1013904223u;
+            input[b][i] = (int16_t)lrint(9000 * sin(t * 0.0314) +
+                                         3000 * sin(t * 0.213 + i % 2) +
+                                         (int16_t)(seed >> 16) / 256);
+        }
+    }
+}
+
+static void fillNoise(uint16_t channels) {
+    uint32_t seed = 7;
+    for (uint32_t b = 0; b < BLOCKS; b++) {
+        for (int i = 0; i < AUDIO_BLOCK_SAMPLES * channels; i++) {
+            seed = seed * 1664525u + 1013904223u;
+            input[b][i] = (int16_t)(seed >> 16);
+        }
+    }
+}
+
+static void fillSilence(uint16_t) { memset(input, 0, sizeof(input)); }
+
+static void measure(const char* name, void (*fill)(uint16_t),
+                    uint16_t channels) {
+    static uint8_t frames[BLOCKS][LosslessCodec::maxFrameBytes(2)];
+    static int16_t decoded[AUDIO_BLOCK_SAMPLES * 2];
+    fill(channels);
+
+    uint32_t block = 0;
+    size_t bytes = 0;
+    double encode = bench::nanosPerCall([&]() {
+        bytes = LosslessCodec::encodeFrame(input[block], channels,
+                                           frames[block]);
+        block = (block + 1) % BLOCKS;
+        bench::keep(bytes);
+    });
+
+    size_t total = 0;
+    for (uint32_t b = 0; b < BLOCKS; b++) {
+        total += LosslessCodec::encodeFrame(input[b], channels, frames[b]);
+    }
+    double decode = bench::nanosPerCall([&]() {
+        const uint8_t* frame = frames[block];
+        LosslessCodec::decodeFrame(frame + 2, frame[0] | (frame[1] << 8),
+                                   channels, decoded);
+        block = (block + 1) % BLOCKS;
+        bench::keep(decoded);
+    });
+
+    char what[64];
+    snprintf(what, sizeof(what), "%s %s encode (%.0f%% of PCM)", name,
+             channels == 2 ? "stereo" : "mono",
+             100.0 * total / (BLOCKS * AUDIO_BLOCK_SAMPLES * channels * 2));
+    bench::report(what, encode);
+    snprintf(what, sizeof(what), "%s %s decode", name,
+             channels == 2 ? "stereo" : "mono");
+    bench::report(what, decode);
+
+    TEST_ASSERT_LESS_OR_EQUAL(LosslessCodec::maxFrameBytes(channels),
+                              total / BLOCKS);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_music(void) {
+    measure("music", fillMusic, 1);
+    measure("music", fillMusic, 2);
+}
+
+void test_noise(void) {
+    measure("noise", fillNoise, 1);
+    measure("noise", fillNoise, 2);
+}
+
+void test_silence(void) {
+    measure("silence", fillSilence, 1);
+    measure("silence", fillSilence, 2);
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_music);
+    RUN_TEST(test_noise);
+    RUN_TEST(test_silence);
+    return UNITY_END();
+}
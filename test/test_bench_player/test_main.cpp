@@ -0,0 +1,277 @@
+// Cost of one AudioPlaySdWavExtended update per file format, gain and
+// varispeed setting, with the card reads left out: refill() runs untimed
+// between batches of blocks, as it would in its own interrupt. On the host
+// the portable kernels are measured; the device's resampler counter covers
+// the M7 ones.
+
+#include <Arduino.h>
+#include <Bench.h>
+#include <unity.h>
+
+#include <cmath>
+
+#include "helper/AudioDiagnostics.h"
+#include "helper/audio-extensions/play_sd_wav_extended.h"
+
+static const char* WAV_PATH = "/bench.wav";
+static const uint32_t BLOCKS = 2000;
+// Blocks timed in one go, well inside the prefetch ring even at 4x
+static const uint32_t BATCH = 8;
+static const int ROUNDS = 5;
+
+struct Format {
+    uint32_t rate;
+    uint16_t bits;
+    uint16_t channels;
+};
+
+static void put16(std::vector<uint8_t>& out, uint16_t value) {
+    out.push_back(value & 0xFF);
+    out.push_back(value >> 8);
+}
+
+static void put32(std::vector<uint8_t>& out, uint32_t value) {
+    put16(out, value & 0xFFFF);
+    put16(out, value >> 16);
+}
+
+// A tone with a little noise on it, different on each channel. Long enough
+// for a round at 4x.
+static void writeWav(const Format& format) {
+    const uint32_t frames =
+        (uint64_t)BLOCKS * AUDIO_BLOCK_SAMPLES * 4 * format.rate / 44100 +
+        44100;
+    const uint16_t frameBytes = format.channels * format.bits / 8;
+    std::vector<uint8_t> wav;
+    wav.insert(wav.end(), {'R', 'I', 'F', 'F'});
+    put32(wav, 36 + frames * frameBytes);
+    wav.insert(wav.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' '});
+    put32(wav, 16);
+    put16(wav, 1);
+    put16(wav, format.channels);
+    put32(wav, format.rate);
+    put32(wav, format.rate * frameBytes);
+    put16(wav, frameBytes);
+    put16(wav, format.bits);
+    wav.insert(wav.end(), {'d', 'a', 't', 'a'});
+    put32(wav, frames * frameBytes);
+
+    uint32_t seed = 1;
+    for (uint32_t n = 0; n < frames; n++) {
+        for (uint16_t c = 0; c < format.channels; c++) {
+            seed = seed * 1664525u + 1013904223u;
+            int16_t sample = (int16_t)lrint(
+                16000 * sin(2 * M_PI * (440 + c * 110) * n / format.rate) +
+                (int16_t)(seed >> 16) / 64);
+            if (format.bits == 8) {
+                wav.push_back((uint8_t)((sample >> 8) + 128));
+            } else {
+                put16(wav, sample);
+            }
+        }
+    }
+
+    File file = SD.open(WAV_PATH, FILE_WRITE_BEGIN);
+    file.write(wav.data(), wav.size());
+    file.close();
+}
+
+// One update the way the audio interrupt runs it: the refill it asks for
+// stays pending until the caller lets it run
+static void audioUpdate(AudioPlaySdWavExtended& player) {
+    mock::inAudioInterrupt = true;
+    player.update();
+    mock::inAudioInterrupt = false;
+}
+
+static void refill() { mock::runSoftwareInterrupt(); }
+
+static void startPlaying(AudioPlaySdWavExtended& player) {
+    TEST_ASSERT_TRUE(player.play(WAV_PATH));
+    for (int i = 0; i < 4; i++) {
+        audioUpdate(player);
+        refill();
+    }
+    TEST_ASSERT_TRUE(player.isPlaying());
+}
+
+static void stopPlaying(AudioPlaySdWavExtended& player) {
+    player.stop();
+    audioUpdate(player);
+    refill();
+}
+
+// Runs before every timed update, timed along with it
+typedef void (*BlockHook)(AudioPlaySdWavExtended& player, uint32_t block);
+
+// Best time per block over a few rounds of BLOCKS blocks
+static double nanosPerBlock(AudioPlaySdWavExtended& player,
+                            BlockHook eachBlock) {
+    double best = 1e30;
+    for (int round = 0; round < ROUNDS; round++) {
+        startPlaying(player);
+        uint32_t underruns = audioDiagnostics.getPlayerUnderruns();
+        bench::Stopwatch watch;
+        for (uint32_t block = 0; block < BLOCKS; block += BATCH) {
+            watch.time([&]() {
+                for (uint32_t i = 0; i < BATCH; i++) {
+                    if (eachBlock) eachBlock(player, block + i);
+                    audioUpdate(player);
+                }
+            });
+            refill();
+        }
+        TEST_ASSERT_TRUE(player.isPlaying());
+        TEST_ASSERT_EQUAL_UINT32(underruns,
+                                 audioDiagnostics.getPlayerUnderruns());
+        stopPlaying(player);
+        if (watch.nanos() / BLOCKS < best) best = watch.nanos() / BLOCKS;
+    }
+    return best;
+}
+
+// Loudest sample of a block played after the fade-in, so a kernel that
+// plays silence doesn't pass for a fast one
+static int16_t playedPeak(AudioPlaySdWavExtended& player) {
+    int16_t peak = 0;
+    startPlaying(player);
+    player.output = [&](audio_block_t* block, unsigned char) {
+        for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) {
+            if (abs(block->data[i]) > peak) peak = abs(block->data[i]);
+        }
+    };
+    audioUpdate(player);
+    player.output = nullptr;
+    stopPlaying(player);
+    return peak;
+}
+
+static void measure(const Format& format, const char* variant = "",
+                    BlockHook eachBlock = nullptr) {
+    writeWav(format);
+    AudioPlaySdWavExtended player;
+    double nanos = nanosPerBlock(player, eachBlock);
+
+    char what[64];
+    snprintf(what, sizeof(what), "%5.2f kHz %2u bit %s%s",
+             format.rate / 1000.0, format.bits,
+             format.channels == 2 ? "stereo" : "mono", variant);
+    bench::report(what, nanos);
+    TEST_ASSERT_GREATER_THAN(8000, playedPeak(player));
+}
+
+void setUp(void) {
+    mock::reset();
+    mock::card.reset();
+}
+
+void tearDown(void) {}
+
+// Every rate, width and layout parse_format() picks a kernel for
+void test_every_format(void) {
+    for (uint32_t rate : {44100u, 22050u, 11025u}) {
+        for (uint16_t bits : {8, 16}) {
+            measure({rate, bits, 1});
+            measure({rate, bits, 2});
+        }
+    }
+}
+
+// At the native rate the direct kernels must hand the file over unchanged,
+// from the block after the fade-in on
+static void checkDirect(const Format& format) {
+    writeWav(format);
+    AudioPlaySdWavExtended player;
+    std::vector<int16_t> played[2];
+    player.output = [&](audio_block_t* block, unsigned char channel) {
+        played[channel].insert(played[channel].end(), block->data,
+                               block->data + AUDIO_BLOCK_SAMPLES);
+    };
+    TEST_ASSERT_TRUE(player.play(WAV_PATH));
+    for (int i = 0; i < 40; i++) {
+        audioUpdate(player);
+        refill();
+    }
+    player.output = nullptr;
+
+    const std::vector<uint8_t>& wav = mock::card.contents(WAV_PATH);
+    const uint8_t* data = wav.data() + 44;
+    const uint16_t sampleBytes = format.bits / 8;
+    TEST_ASSERT_TRUE(played[0].size() >= 32 * AUDIO_BLOCK_SAMPLES);
+    for (size_t n = AUDIO_BLOCK_SAMPLES; n < played[0].size(); n++) {
+        for (uint16_t c = 0; c < 2; c++) {
+            const uint8_t* p =
+                data + (n * format.channels + c % format.channels) *
+                           sampleBytes;
+            int16_t expected = format.bits == 8
+                                   ? (int16_t)((p[0] - 128) << 8)
+                                   : (int16_t)(p[0] | (p[1] << 8));
+            TEST_ASSERT_EQUAL_INT16(expected, played[c][n]);
+        }
+    }
+}
+
+void test_direct_kernels_are_exact(void) {
+    for (uint16_t bits : {8, 16}) {
+        checkDirect({44100, bits, 1});
+        checkDirect({44100, bits, 2});
+    }
+}
+
+// Gain at unity skips the multiply, a steady gain scales every block and a
+// moving one ramps across each
+static void steadyGain(AudioPlaySdWavExtended& player, uint32_t block) {
+    if (block == 0) player.setVolume(0.7);
+}
+
+static void movingGain(AudioPlaySdWavExtended& player, uint32_t block) {
+    player.setVolume(block % 2 ? 0.6 : 0.9);
+}
+
+void test_gain(void) {
+    for (uint16_t channels = 1; channels <= 2; channels++) {
+        measure({44100, 16, channels}, ", unity gain");
+        measure({44100, 16, channels}, ", steady gain", steadyGain);
+        measure({44100, 16, channels}, ", gain ramp", movingGain);
+    }
+}
+
+// Varispeed moves native rate files off the direct kernels onto the
+// converter, with either interpolation
+static float varispeed;
+static AudioPlaySdWavExtended::Interpolation quality;
+
+static void setSpeed(AudioPlaySdWavExtended& player, uint32_t block) {
+    if (block == 0) {
+        player.setInterpolation(quality);
+        player.setSpeed(varispeed);
+    }
+}
+
+void test_varispeed(void) {
+    for (uint16_t channels = 1; channels <= 2; channels++) {
+        measure({44100, 16, channels}, ", 1x direct");
+        for (auto interpolation : {AudioPlaySdWavExtended::LINEAR,
+                                   AudioPlaySdWavExtended::CUBIC}) {
+            for (float factor : {0.5f, 1.5f, 4.0f}) {
+                quality = interpolation;
+                varispeed = factor;
+                char variant[32];
+                snprintf(variant, sizeof(variant), ", %.1fx %s", factor,
+                         interpolation == AudioPlaySdWavExtended::LINEAR
+                             ? "linear"
+                             : "cubic");
+                measure({44100, 16, channels}, variant, setSpeed);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_direct_kernels_are_exact);
+    RUN_TEST(test_every_format);
+    RUN_TEST(test_gain);
+    RUN_TEST(test_varispeed);
+    return UNITY_END();
+}
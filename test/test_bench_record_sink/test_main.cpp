@@ -0,0 +1,83 @@
+// Cost of one AudioRecordSink update: the mono copy against the stereo
+// interleave, at each recording rate. On the host the interleave is the
+// portable loop; the PKHBT/PKHTB path is measured on the device by the
+// sink's own cycle counter.
+
+#include <Arduino.h>
+#include <Bench.h>
+#include <unity.h>
+
+#include "helper/audio-extensions/record_sink.h"
+
+static const uint32_t RING_SLOTS = 64;
+
+static int16_t ring[RING_SLOTS * AUDIO_BLOCK_SAMPLES];
+
+static void measure(uint16_t channels, uint16_t decimation) {
+    AudioRecordSink sink;
+    sink.setRing(ring, RING_SLOTS);
+    sink.setChannels(channels);
+    sink.setDecimation(decimation);
+    sink.begin();
+
+    audio_block_t* left = AudioStream::allocate();
+    audio_block_t* right = AudioStream::allocate();
+    for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) {
+        left->data[i] = (int16_t)(i * 301);
+        right->data[i] = (int16_t)(i * -173);
+    }
+
+    double nanos = bench::nanosPerCall([&]() {
+        // Keep the blocks alive across the release in update()
+        left->ref_count++;
+        sink.receive(left, 0);
+        if (channels == 2) {
+            right->ref_count++;
+            sink.receive(right, 1);
+        }
+        sink.update();
+        sink.consume(sink.available());
+    });
+
+    char what[64];
+    snprintf(what, sizeof(what), "%s update at %u Hz",
+             channels == 2 ? "stereo" : "mono", 44100 / decimation);
+    bench::report(what, nanos);
+
+    // The last slot written holds the input, interleaved when stereo
+    const int16_t* slot = sink.slot(sink.headIndex() - channels);
+    if (decimation == 1) {
+        for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) {
+            TEST_ASSERT_EQUAL_INT16(left->data[i], slot[i * channels]);
+            if (channels == 2) {
+                TEST_ASSERT_EQUAL_INT16(right->data[i], slot[i * 2 + 1]);
+            }
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, sink.getOverruns());
+
+    AudioStream::release(left);
+    AudioStream::release(right);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_mono(void) {
+    measure(1, 1);
+    measure(1, 2);
+    measure(1, 4);
+}
+
+void test_stereo(void) {
+    measure(2, 1);
+    measure(2, 2);
+    measure(2, 4);
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_mono);
+    RUN_TEST(test_stereo);
+    return UNITY_END();
+}
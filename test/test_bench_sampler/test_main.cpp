@@ -0,0 +1,102 @@
+// Cost of one AudioSamplerVoices update by the number of voices sounding,
+// their layout and pitch. Pitch 1.0 takes the copying kernels, anything
+// else the interpolating ones. On the device the sampler's own cycle
+// counter measures the same code.
+
+#include <Arduino.h>
+#include <Bench.h>
+#include <unity.h>
+
+#include <cmath>
+#include <vector>
+
+#include "helper/audio-extensions/sampler_voices.h"
+
+static const uint32_t BLOCKS = 1000;
+static const int ROUNDS = 7;
+// A round at the highest pitch measured, and the fade-in before it
+static const uint32_t FRAMES = (BLOCKS + 2) * AUDIO_BLOCK_SAMPLES * 3 / 2;
+
+static std::vector<int16_t> samples[3];
+
+// A tone with a little noise on it, different on each channel
+static const std::vector<int16_t>& sample(uint16_t channels) {
+    std::vector<int16_t>& data = samples[channels];
+    if (!data.empty()) return data;
+    uint32_t seed = 1;
+    for (uint32_t n = 0; n < FRAMES; n++) {
+        for (uint16_t c = 0; c < channels; c++) {
+            seed = seed * 1664525u + 1013904223u;
+            data.push_back((int16_t)lrint(
+                16000 * sin(2 * M_PI * (440 + c * 110) * n / 44100) +
+                (int16_t)(seed >> 16) / 64));
+        }
+    }
+    return data;
+}
+
+static void measure(int voices, uint16_t channels, float pitch) {
+    const std::vector<int16_t>& data = sample(channels);
+    double best = 1e30;
+    for (int round = 0; round < ROUNDS; round++) {
+        AudioSamplerVoices sampler;
+        for (int v = 0; v < voices; v++) {
+            TEST_ASSERT_TRUE(sampler.play(data.data(), FRAMES, channels,
+                                          0.25f, pitch) != 0);
+        }
+        // The fade-in block, then the steady state
+        sampler.update();
+        bench::Stopwatch watch;
+        watch.time([&]() {
+            for (uint32_t block = 0; block < BLOCKS; block++) {
+                sampler.update();
+            }
+        });
+        TEST_ASSERT_EQUAL(voices, sampler.activeVoices());
+        if (watch.nanos() / BLOCKS < best) best = watch.nanos() / BLOCKS;
+
+        if (round == 0) {
+            // Not silence, so a kernel that drops the voices doesn't pass
+            // for a fast one
+            int16_t peak = 0;
+            sampler.output = [&](audio_block_t* block, unsigned char) {
+                for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) {
+                    if (abs(block->data[i]) > peak) peak = abs(block->data[i]);
+                }
+            };
+            sampler.update();
+            sampler.output = nullptr;
+            TEST_ASSERT_GREATER_THAN(3000, peak);
+        }
+    }
+
+    char what[64];
+    snprintf(what, sizeof(what), "%d voice%s %s at pitch %.2f", voices,
+             voices == 1 ? "" : "s", channels == 2 ? "stereo" : "mono",
+             pitch);
+    bench::report(what, best);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_mono(void) {
+    for (int voices : {1, 4, 8}) {
+        measure(voices, 1, 1.0f);
+        measure(voices, 1, 1.37f);
+    }
+}
+
+void test_stereo(void) {
+    for (int voices : {1, 4, 8}) {
+        measure(voices, 2, 1.0f);
+        measure(voices, 2, 1.37f);
+    }
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_mono);
+    RUN_TEST(test_stereo);
+    return UNITY_END();
+}
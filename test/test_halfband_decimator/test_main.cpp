@@ -0,0 +1,92 @@
+// Sweeps sines through the decimator and holds it to the response its
+// header documents.
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include <cmath>
+
+#include "helper/audio-extensions/halfband_decimator.h"
+
+static const double AMPLITUDE = 32000;
+
+// Output level of a sine at `frequency` (fraction of the input rate), in dB
+// relative to the input
+static double gainAt(double frequency) {
+    HalfbandDecimator decimator;
+    int16_t in[AUDIO_BLOCK_SAMPLES];
+    int16_t out[AUDIO_BLOCK_SAMPLES / 2];
+    double power = 0;
+    uint32_t samples = 0;
+    for (int block = 0; block < 100; block++) {
+        for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) {
+            uint32_t n = block * AUDIO_BLOCK_SAMPLES + i;
+            in[i] = (int16_t)lrint(AMPLITUDE *
+                                   cos(2 * M_PI * frequency * n + 0.3));
+        }
+        decimator.process(in, out, AUDIO_BLOCK_SAMPLES);
+        // Past the filter's start-up
+        if (block < 2) continue;
+        for (int i = 0; i < AUDIO_BLOCK_SAMPLES / 2; i++) {
+            power += (double)out[i] * out[i];
+            samples++;
+        }
+    }
+    return 10 * log10(power / samples / (AMPLITUDE * AMPLITUDE / 2));
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_dc_gain_is_exactly_one(void) {
+    HalfbandDecimator decimator;
+    int16_t in[AUDIO_BLOCK_SAMPLES];
+    int16_t out[AUDIO_BLOCK_SAMPLES / 2];
+    for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) in[i] = 12345;
+    for (int block = 0; block < 3; block++) {
+        decimator.process(in, out, AUDIO_BLOCK_SAMPLES);
+    }
+    for (int i = 0; i < AUDIO_BLOCK_SAMPLES / 2; i++) {
+        TEST_ASSERT_EQUAL_INT16(12345, out[i]);
+    }
+}
+
+void test_passband_is_flat_to_0_2_fs(void) {
+    for (double f = 0.005; f <= 0.2; f += 0.005) {
+        TEST_ASSERT_FLOAT_WITHIN(0.02, 0.0, gainAt(f));
+    }
+}
+
+void test_stopband(void) {
+    TEST_ASSERT_LESS_THAN_FLOAT(-56.0, gainAt(0.3));
+    for (double f = 0.305; f < 0.5; f += 0.0025) {
+        TEST_ASSERT_LESS_THAN_FLOAT(-75.0, gainAt(f));
+    }
+}
+
+void test_full_scale_saturates(void) {
+    HalfbandDecimator decimator;
+    int16_t in[AUDIO_BLOCK_SAMPLES];
+    int16_t out[AUDIO_BLOCK_SAMPLES / 2];
+    // Steps between the rails overshoot, the output has to clip
+    for (int block = 0; block < 4; block++) {
+        for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) {
+            in[i] = (i / 16) % 2 ? 32767 : -32768;
+        }
+        decimator.process(in, out, AUDIO_BLOCK_SAMPLES);
+    }
+    bool clipped = false;
+    for (int i = 0; i < AUDIO_BLOCK_SAMPLES / 2; i++) {
+        if (out[i] == 32767 || out[i] == -32768) clipped = true;
+    }
+    TEST_ASSERT_TRUE(clipped);
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_dc_gain_is_exactly_one);
+    RUN_TEST(test_passband_is_flat_to_0_2_fs);
+    RUN_TEST(test_stopband);
+    RUN_TEST(test_full_scale_saturates);
+    return UNITY_END();
+}
@@ -0,0 +1,119 @@
+// Encodes blocks of awkward input and checks they decode bit-exact, within
+// the frame size the writer budgets for.
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include <cmath>
+
+#include "helper/LosslessCodec.hpp"
+
+static const size_t MAX_SAMPLES = AUDIO_BLOCK_SAMPLES * 2;
+
+typedef int16_t (*Signal)(uint32_t n, unsigned channel);
+
+static uint32_t noiseState = 1;
+
+static int16_t noise(uint32_t, unsigned) {
+    noiseState = noiseState * 1664525u + 1013904223u;
+    return (int16_t)(noiseState >> 16);
+}
+static int16_t silence(uint32_t, unsigned) { return 0; }
+static int16_t fullScalePositive(uint32_t, unsigned) { return 32767; }
+static int16_t fullScaleNegative(uint32_t, unsigned) { return -32768; }
+// Every residual as large as it can get
+static int16_t alternatingExtremes(uint32_t n, unsigned channel) {
+    return ((n + channel) & 1) ? 32767 : -32768;
+}
+static int16_t fullScaleSquare(uint32_t n, unsigned channel) {
+    return ((n / 7 + channel) & 1) ? 32767 : -32768;
+}
+static int16_t sine(uint32_t n, unsigned channel) {
+    return (int16_t)lrint(32767 * sin(n * (0.031 + channel * 0.017)));
+}
+// Wraps from +32767 to -32768 every few samples
+static int16_t sawtooth(uint32_t n, unsigned channel) {
+    return (int16_t)(uint16_t)(n * 9001 + channel * 12345);
+}
+
+// Runs `blocks` consecutive blocks of `signal` through the codec
+static void roundTrip(Signal signal, uint16_t channels, uint32_t blocks) {
+    int16_t input[MAX_SAMPLES];
+    int16_t output[MAX_SAMPLES];
+    uint8_t frame[LosslessCodec::maxFrameBytes(2)];
+    const size_t samples = AUDIO_BLOCK_SAMPLES * channels;
+
+    for (uint32_t block = 0; block < blocks; block++) {
+        for (size_t i = 0; i < samples; i++) {
+            input[i] = signal(block * AUDIO_BLOCK_SAMPLES + i / channels,
+                              i % channels);
+        }
+        size_t bytes = LosslessCodec::encodeFrame(input, channels, frame);
+        TEST_ASSERT_LESS_OR_EQUAL(LosslessCodec::maxFrameBytes(channels),
+                                  bytes);
+        size_t length = frame[0] | (frame[1] << 8);
+        TEST_ASSERT_EQUAL_size_t(bytes - 2, length);
+
+        memset(output, 0x55, sizeof(output));
+        TEST_ASSERT_TRUE(
+            LosslessCodec::decodeFrame(frame + 2, length, channels, output));
+        TEST_ASSERT_EQUAL_INT16_ARRAY(input, output, samples);
+    }
+}
+
+void setUp(void) { noiseState = 1; }
+
+void tearDown(void) {}
+
+void test_random(void) {
+    roundTrip(noise, 1, 200);
+    roundTrip(noise, 2, 200);
+}
+
+void test_silence(void) {
+    roundTrip(silence, 1, 4);
+    roundTrip(silence, 2, 4);
+
+    // And it should pay off: one bit per sample
+    int16_t input[MAX_SAMPLES] = {};
+    uint8_t frame[LosslessCodec::maxFrameBytes(2)];
+    TEST_ASSERT_LESS_OR_EQUAL(2 + 2 * (1 + AUDIO_BLOCK_SAMPLES / 8),
+                              LosslessCodec::encodeFrame(input, 2, frame));
+}
+
+void test_full_scale(void) {
+    for (uint16_t channels = 1; channels <= 2; channels++) {
+        roundTrip(fullScalePositive, channels, 4);
+        roundTrip(fullScaleNegative, channels, 4);
+        roundTrip(alternatingExtremes, channels, 4);
+        roundTrip(fullScaleSquare, channels, 16);
+    }
+}
+
+void test_music_like(void) {
+    roundTrip(sine, 1, 50);
+    roundTrip(sine, 2, 50);
+    roundTrip(sawtooth, 1, 20);
+    roundTrip(sawtooth, 2, 20);
+}
+
+void test_damaged_frame_is_refused(void) {
+    int16_t input[MAX_SAMPLES];
+    int16_t output[MAX_SAMPLES];
+    uint8_t frame[LosslessCodec::maxFrameBytes(2)];
+    for (size_t i = 0; i < AUDIO_BLOCK_SAMPLES; i++) input[i] = sine(i, 0);
+    LosslessCodec::encodeFrame(input, 1, frame);
+
+    // Cut short, the residuals run past the end
+    TEST_ASSERT_FALSE(LosslessCodec::decodeFrame(frame + 2, 3, 1, output));
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_random);
+    RUN_TEST(test_silence);
+    RUN_TEST(test_full_scale);
+    RUN_TEST(test_music_like);
+    RUN_TEST(test_damaged_frame_is_refused);
+    return UNITY_END();
+}
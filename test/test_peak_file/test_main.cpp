@@ -0,0 +1,106 @@
+// Writes peak sidecars long enough for the overview to halve a few times and
+// checks that every overview peak still matches the level 0 peaks it covers.
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include <vector>
+
+#include "helper/PeakFileWriter.hpp"
+
+static const char* PEAK_PATH = "/RECORDINGS/take.pks";
+
+// A different, known min and max in every block
+static void fillBlock(uint32_t block, unsigned channels, int16_t* samples) {
+    for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) samples[i] = 0;
+    for (unsigned c = 0; c < channels; c++) {
+        uint32_t x = (block * 2 + c) * 2654435761u;
+        samples[c] = -(int16_t)(x >> 17);
+        samples[channels + c] = (int16_t)((x >> 2) & 0x7fff);
+    }
+}
+
+static void checkOverview(unsigned channels, uint32_t blocks) {
+    PeakFileWriter writer;
+    TEST_ASSERT_TRUE(writer.open(PEAK_PATH, blocks, channels));
+    int16_t samples[AUDIO_BLOCK_SAMPLES];
+    for (uint32_t block = 0; block < blocks; block++) {
+        fillBlock(block, channels, samples);
+        writer.addBlock(samples);
+    }
+    TEST_ASSERT_TRUE(writer.close());
+
+    const std::vector<uint8_t>& file = mock::card.contents(PEAK_PATH);
+    PeakFileFooter footer;
+    TEST_ASSERT_TRUE(file.size() >= sizeof(footer));
+    memcpy(&footer, &file[file.size() - sizeof(footer)], sizeof(footer));
+    TEST_ASSERT_EQUAL_UINT32(blocks, footer.peakCount);
+
+    const uint32_t framesPerBlock = AUDIO_BLOCK_SAMPLES / channels;
+    const uint32_t stride = footer.overviewSamplesPerPeak / framesPerBlock;
+    TEST_ASSERT_TRUE(stride > 1);
+    TEST_ASSERT_EQUAL_UINT32((blocks + stride - 1) / stride,
+                             footer.overviewCount);
+    TEST_ASSERT_EQUAL_size_t(
+        (footer.peakCount + footer.overviewCount) * channels * 4 +
+            sizeof(footer),
+        file.size());
+
+    const int16_t* level0 = (const int16_t*)file.data();
+    const int16_t* overview = level0 + footer.peakCount * channels * 2;
+    for (uint32_t i = 0; i < footer.overviewCount; i++) {
+        for (unsigned c = 0; c < channels; c++) {
+            int16_t minVal = 32767;
+            int16_t maxVal = -32768;
+            for (uint32_t b = i * stride; b < min((i + 1) * stride, blocks);
+                 b++) {
+                minVal = min(minVal, level0[(b * channels + c) * 2]);
+                maxVal = max(maxVal, level0[(b * channels + c) * 2 + 1]);
+            }
+            const int16_t* peak = overview + (i * channels + c) * 2;
+            if (peak[0] != minVal || peak[1] != maxVal) {
+                char message[80];
+                snprintf(message, sizeof(message),
+                         "overview peak %u channel %u differs", (unsigned)i,
+                         c);
+                TEST_FAIL_MESSAGE(message);
+            }
+        }
+    }
+}
+
+void setUp(void) {
+    mock::reset();
+    mock::card.reset();
+    SD.mkdir("/RECORDINGS");
+}
+
+void tearDown(void) {}
+
+void test_mono_overview_after_halvings(void) {
+    checkOverview(1, PEAK_OVERVIEW_POINTS * 5 + 3);
+}
+
+void test_stereo_overview_after_halvings(void) {
+    checkOverview(2, PEAK_OVERVIEW_POINTS * 3 + 1);
+}
+
+// One block past a full overview, the partial peak close() adds has no
+// room until the overview halves
+void test_mono_take_ending_past_a_full_overview(void) {
+    checkOverview(1, PEAK_OVERVIEW_POINTS * 2 + 1);
+}
+
+void test_stereo_take_ending_past_a_full_overview(void) {
+    checkOverview(2, PEAK_OVERVIEW_POINTS + 1);
+    checkOverview(2, PEAK_OVERVIEW_POINTS * 2 + 1);
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_mono_overview_after_halvings);
+    RUN_TEST(test_stereo_overview_after_halvings);
+    RUN_TEST(test_mono_take_ending_past_a_full_overview);
+    RUN_TEST(test_stereo_take_ending_past_a_full_overview);
+    return UNITY_END();
+}
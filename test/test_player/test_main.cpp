@@ -0,0 +1,254 @@
+// The player's control calls queue commands for update() and read its
+// state back from a snapshot, both checked here with the audio and software
+// interrupts run by hand. The file handles it shares with the sketch are
+// checked too: Teensy's File reference counts aren't atomic and refill()
+// takes and drops its copies in the software interrupt, so every copy the
+// sketch side makes or drops has to happen with the card held, when
+// refill() stays off it.
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include <cmath>
+
+#include "helper/AudioDiagnostics.h"
+#include "helper/WavFileWriter.hpp"
+#include "helper/audio-extensions/play_sd_wav_extended.h"
+
+static const char* WAV_PATH = "/take.wav";
+static const uint32_t FRAMES = 44100;
+
+// Global like the sketch's, it keeps its buffers from one test to the next
+static AudioPlaySdWavExtended player;
+
+// Reference changes made from the sketch without the card held
+static uint32_t unheld;
+
+static void put16(std::vector<uint8_t>& out, uint16_t value) {
+    out.push_back(value & 0xFF);
+    out.push_back(value >> 8);
+}
+
+static void put32(std::vector<uint8_t>& out, uint32_t value) {
+    put16(out, value & 0xFFFF);
+    put16(out, value >> 16);
+}
+
+static void writeWav() {
+    std::vector<uint8_t> wav;
+    wav.insert(wav.end(), {'R', 'I', 'F', 'F'});
+    put32(wav, 36 + FRAMES * 2);
+    wav.insert(wav.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' '});
+    put32(wav, 16);
+    put16(wav, 1);
+    put16(wav, 1);
+    put32(wav, 44100);
+    put32(wav, 44100 * 2);
+    put16(wav, 2);
+    put16(wav, 16);
+    wav.insert(wav.end(), {'d', 'a', 't', 'a'});
+    put32(wav, FRAMES * 2);
+    for (uint32_t n = 0; n < FRAMES; n++) {
+        put16(wav, (int16_t)lrint(16000 * sin(2 * M_PI * 440 * n / 44100)));
+    }
+
+    File file = SD.open(WAV_PATH, FILE_WRITE_BEGIN);
+    file.write(wav.data(), wav.size());
+    file.close();
+}
+
+static void audioUpdate() {
+    mock::inAudioInterrupt = true;
+    player.update();
+    mock::inAudioInterrupt = false;
+}
+
+// Blocks of audio with refill() running after each, as it would
+static void play(int blocks) {
+    for (int i = 0; i < blocks; i++) {
+        audioUpdate();
+        mock::runSoftwareInterrupt();
+    }
+}
+
+// Left channel of every block the next update transmits
+static std::vector<int16_t> playBlock() {
+    std::vector<int16_t> played;
+    player.output = [&](audio_block_t* block, unsigned char channel) {
+        if (channel == 0) {
+            played.insert(played.end(), block->data,
+                          block->data + AUDIO_BLOCK_SAMPLES);
+        }
+    };
+    play(1);
+    player.output = nullptr;
+    return played;
+}
+
+static int16_t fileSample(uint32_t frame) {
+    const uint8_t* p = mock::card.contents(WAV_PATH).data() + 44 + frame * 2;
+    return (int16_t)(p[0] | (p[1] << 8));
+}
+
+void setUp(void) {
+    mock::reset();
+    mock::card.reset();
+    writeWav();
+    unheld = 0;
+    mock::fileReferenceChanged = []() {
+        if (!mock::inSoftwareInterrupt && !mock::inAudioInterrupt &&
+            !WavFileWriter::isCardLocked()) {
+            unheld++;
+        }
+    };
+}
+
+void tearDown(void) { mock::fileReferenceChanged = nullptr; }
+
+// Reads reflect the calls queued since the last block straight away
+void test_state_reads_see_queued_calls(void) {
+    TEST_ASSERT_TRUE(player.play(WAV_PATH));
+    TEST_ASSERT_TRUE(player.isPlaying());
+    TEST_ASSERT_FALSE(player.isStopped());
+    play(8);
+
+    TEST_ASSERT_TRUE(player.togglePlayPause());
+    TEST_ASSERT_TRUE(player.isPaused());
+    TEST_ASSERT_FALSE(player.isPlaying());
+    TEST_ASSERT_TRUE(player.seekSamples(20000));
+    TEST_ASSERT_EQUAL_UINT32(20000, player.positionSamples());
+    play(2);
+    TEST_ASSERT_TRUE(player.isPaused());
+    TEST_ASSERT_EQUAL_UINT32(20000, player.positionSamples());
+
+    TEST_ASSERT_TRUE(player.togglePlayPause());
+    TEST_ASSERT_TRUE(player.isPlaying());
+    TEST_ASSERT_TRUE(player.stop());
+    TEST_ASSERT_TRUE(player.isStopped());
+    TEST_ASSERT_FALSE(player.isPlaying());
+    play(2);
+    TEST_ASSERT_TRUE(player.isStopped());
+}
+
+// Commands queued between two blocks take effect from the first sample of
+// the second
+void test_commands_land_on_the_next_block(void) {
+    TEST_ASSERT_TRUE(player.play(WAV_PATH));
+    play(8);
+    // Native rate 16 bit, the output is the file itself
+    uint32_t frame = player.positionSamples();
+    std::vector<int16_t> block = playBlock();
+    TEST_ASSERT_EQUAL(AUDIO_BLOCK_SAMPLES, block.size());
+    TEST_ASSERT_EQUAL_INT16(fileSample(frame), block[0]);
+    frame += AUDIO_BLOCK_SAMPLES;
+
+    // The gain ramps across the next block and holds from the one after
+    TEST_ASSERT_TRUE(player.setVolume(0.5f));
+    block = playBlock();
+    TEST_ASSERT_EQUAL_INT16(fileSample(frame), block[0]);
+    frame += AUDIO_BLOCK_SAMPLES;
+    block = playBlock();
+    for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) {
+        TEST_ASSERT_INT_WITHIN(1, fileSample(frame + i) / 2, block[i]);
+    }
+
+    // A seek starts the next block played at the frame asked for, fading
+    // in across it
+    TEST_ASSERT_TRUE(player.setVolume(1.0f));
+    play(1);
+    TEST_ASSERT_TRUE(player.seekSamples(30000));
+    do {
+        block = playBlock();
+    } while (block.empty());
+    TEST_ASSERT_EQUAL_INT16(0, block[0]);
+    block = playBlock();
+    for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) {
+        TEST_ASSERT_EQUAL_INT16(fileSample(30000 + AUDIO_BLOCK_SAMPLES + i),
+                                block[i]);
+    }
+
+    // Nothing comes out of the block after a stop
+    TEST_ASSERT_TRUE(player.stop());
+    TEST_ASSERT_TRUE(playBlock().empty());
+}
+
+// With update() stalled the ring fills up. What doesn't fit is refused,
+// counted, and leaves the player as it was.
+void test_full_ring_refuses_commands(void) {
+    TEST_ASSERT_TRUE(player.play(WAV_PATH));
+    play(4);
+    uint32_t dropped = audioDiagnostics.getPlayerCommandsDropped();
+    int queued = 0;
+    while (player.setVolume(1.0f)) queued++;
+    TEST_ASSERT_TRUE(queued > 0);
+    TEST_ASSERT_EQUAL_UINT32(dropped + 1,
+                             audioDiagnostics.getPlayerCommandsDropped());
+
+    TEST_ASSERT_FALSE(player.stop());
+    TEST_ASSERT_FALSE(player.togglePlayPause());
+    TEST_ASSERT_FALSE(player.setSpeed(2.0f));
+    TEST_ASSERT_FALSE(player.setLooping(true));
+    TEST_ASSERT_FALSE(player.seekSamples(1000));
+    TEST_ASSERT_FALSE(player.play(WAV_PATH));
+    TEST_ASSERT_EQUAL_UINT32(dropped + 7,
+                             audioDiagnostics.getPlayerCommandsDropped());
+    TEST_ASSERT_TRUE(player.isPlaying());
+
+    // The refused stop never happened
+    play(2);
+    TEST_ASSERT_TRUE(player.isPlaying());
+    TEST_ASSERT_TRUE(player.stop());
+    play(2);
+    TEST_ASSERT_TRUE(player.isStopped());
+}
+
+void test_play_by_path(void) {
+    TEST_ASSERT_TRUE(player.play(WAV_PATH));
+    play(8);
+    TEST_ASSERT_TRUE(player.isPlaying());
+    // A second play replaces the first while it's running
+    TEST_ASSERT_TRUE(player.play(WAV_PATH));
+    play(8);
+    TEST_ASSERT_TRUE(player.isPlaying());
+    player.stop();
+    play(2);
+    TEST_ASSERT_EQUAL_UINT32(0, unheld);
+}
+
+void test_shared_handle(void) {
+    File file;
+    AudioSampleInfo info;
+    {
+        SdCardLock cardLock;
+        file = SD.open(WAV_PATH);
+        TEST_ASSERT_TRUE(AudioPlaySdWavExtended::readInfo(file, info));
+    }
+
+    TEST_ASSERT_TRUE(player.play(file, info, 0, info.dataBytes, 1.0f));
+    play(8);
+    TEST_ASSERT_TRUE(player.isPlaying());
+    TEST_ASSERT_TRUE(player.playRegion(file, info, 1000, 9000, true, 1.0f));
+    play(8);
+    TEST_ASSERT_TRUE(player.isPlaying());
+    player.stop();
+    play(2);
+    TEST_ASSERT_FALSE(player.isPlaying());
+    // refill() has let go of its copies
+    TEST_ASSERT_EQUAL(1, file.useCount());
+
+    {
+        SdCardLock cardLock;
+        file = File();
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, unheld);
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_state_reads_see_queued_calls);
+    RUN_TEST(test_commands_land_on_the_next_block);
+    RUN_TEST(test_full_ring_refuses_commands);
+    RUN_TEST(test_play_by_path);
+    RUN_TEST(test_shared_handle);
+    return UNITY_END();
+}
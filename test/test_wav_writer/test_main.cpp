@@ -0,0 +1,296 @@
+// Records through the writer's ring onto a simulated card whose writes
+// stall the way slow cards do, and checks that every block makes it into
+// the file.
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include "helper/LosslessCodec.hpp"
+#include "helper/WavFileWriter.hpp"
+
+static const char* TAKE_PATH = "/RECORDINGS/take.wav";
+
+// Write latencies modelled on a slow SDHC card: a burst takes a couple of
+// milliseconds, every 16th write runs into a short garbage collection, every
+// 64th into a long one, and write 200 into the worst erase seen, 700 ms
+static uint32_t slowCardLatency(uint32_t sectors) {
+    uint32_t write = mock::card.writes;
+    uint32_t micros = 1200 + sectors * 12;
+    if (write % 16 == 15) micros += 40000;
+    if (write % 64 == 63) micros += 250000;
+    if (write == 200) micros += 700000;
+    return micros;
+}
+
+// Deterministic noise, different for every frame and channel
+static int16_t inputSample(uint64_t frame, unsigned channel) {
+    uint32_t x = (uint32_t)(frame * 2 + channel) * 2654435761u;
+    x ^= x >> 15;
+    return (int16_t)(x * 2246822519u >> 16);
+}
+
+// Feeds the sink one block per input each audio update, from the first
+// update after it's attached
+struct Input {
+    AudioRecordSink& sink;
+    unsigned channels;
+    uint64_t frames = 0;
+
+    Input(AudioRecordSink& target, unsigned count)
+        : sink(target), channels(count) {}
+
+    void attach() {
+        mock::audioInterrupt = [this]() { update(); };
+    }
+
+    void update() {
+        for (unsigned c = 0; c < channels; c++) {
+            audio_block_t* block = AudioStream::allocate();
+            for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++) {
+                block->data[i] = inputSample(frames + i, c);
+            }
+            sink.receive(block, c);
+        }
+        frames += AUDIO_BLOCK_SAMPLES;
+        sink.update();
+    }
+};
+
+// The sketch does nothing but wait while the writer works off the
+// software interrupt
+static void recordFor(uint32_t seconds) {
+    uint64_t end = mock::now + (uint64_t)seconds * 1000000;
+    while (mock::now < end) delay(1);
+}
+
+static uint32_t readLE32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t wavDataBytes(const std::vector<uint8_t>& file) {
+    TEST_ASSERT_TRUE(file.size() >= WavFileWriter::HEADER_BYTES);
+    return readLE32(&file[WavFileWriter::HEADER_BYTES - 4]);
+}
+
+// Every frame fed in from `first` on, in order, and nothing else
+static void checkWav(const std::vector<uint8_t>& file, unsigned channels,
+                     uint64_t frames, uint64_t first = 0) {
+    uint32_t dataBytes = wavDataBytes(file);
+    TEST_ASSERT_EQUAL_UINT64(frames * channels * 2, dataBytes);
+    TEST_ASSERT_EQUAL_UINT64(WavFileWriter::HEADER_BYTES + dataBytes,
+                             file.size());
+
+    const uint8_t* data = &file[WavFileWriter::HEADER_BYTES];
+    for (uint64_t frame = 0; frame < frames; frame++) {
+        for (unsigned c = 0; c < channels; c++) {
+            const uint8_t* p = data + (frame * channels + c) * 2;
+            int16_t sample = (int16_t)(p[0] | (p[1] << 8));
+            if (sample != inputSample(first + frame, c)) {
+                char message[80];
+                snprintf(message, sizeof(message),
+                         "frame %llu channel %u differs",
+                         (unsigned long long)frame, c);
+                TEST_FAIL_MESSAGE(message);
+            }
+        }
+    }
+}
+
+static void checkLossless(const std::vector<uint8_t>& file,
+                          unsigned channels, uint64_t frames) {
+    LosslessHeader header;
+    TEST_ASSERT_TRUE(file.size() >= LosslessCodec::HEADER_BYTES);
+    memcpy(&header, file.data(), sizeof(header));
+    TEST_ASSERT_TRUE(LosslessCodec::isHeader(file.data()));
+    TEST_ASSERT_EQUAL_UINT64(frames, header.totalFrames);
+    TEST_ASSERT_EQUAL_UINT64(LosslessCodec::HEADER_BYTES + header.dataBytes,
+                             file.size());
+
+    size_t at = LosslessCodec::HEADER_BYTES;
+    int16_t samples[AUDIO_BLOCK_SAMPLES * 2];
+    // One frame per block of every channel
+    for (uint64_t frame = 0; frame < frames; frame += AUDIO_BLOCK_SAMPLES) {
+        TEST_ASSERT_TRUE(at + 2 <= file.size());
+        size_t length = file[at] | (file[at + 1] << 8);
+        TEST_ASSERT_TRUE(LosslessCodec::decodeFrame(&file[at + 2], length,
+                                                    channels, samples));
+        at += 2 + length;
+        for (unsigned i = 0; i < AUDIO_BLOCK_SAMPLES * channels; i++) {
+            TEST_ASSERT_EQUAL_INT16(
+                inputSample(frame + i / channels, i % channels), samples[i]);
+        }
+    }
+    TEST_ASSERT_EQUAL_size_t(file.size(), at);
+}
+
+static void recordThroughSlowCard(WavFileWriter::Format format,
+                                  unsigned channels) {
+    AudioRecordSink sink;
+    WavFileWriter writer(sink);
+    writer.setFormat(format);
+    mock::card.writeLatency = slowCardLatency;
+
+    TEST_ASSERT_TRUE(writer.open(TAKE_PATH, 44100, channels));
+    Input input(sink, channels);
+    input.attach();
+    recordFor(30);
+    // What comes in while close() runs isn't part of the take
+    mock::audioInterrupt = nullptr;
+    TEST_ASSERT_TRUE(writer.close());
+
+    TEST_ASSERT_EQUAL_UINT32(0, writer.getOverruns());
+    TEST_ASSERT_EQUAL_UINT32(0, writer.getDroppedBlocks());
+    // The 700 ms stall really did put the ring to work
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(0.7 * 44100 / AUDIO_BLOCK_SAMPLES,
+                                        writer.getRingHighWater() / channels);
+
+    if (format == WavFileWriter::FORMAT_LOSSLESS) {
+        checkLossless(mock::card.contents(TAKE_PATH), channels, input.frames);
+    } else {
+        checkWav(mock::card.contents(TAKE_PATH), channels, input.frames);
+    }
+}
+
+void setUp(void) {
+    mock::reset();
+    mock::card.reset();
+    SD.mkdir("/RECORDINGS");
+}
+
+void tearDown(void) {}
+
+void test_mono_survives_slow_card(void) {
+    recordThroughSlowCard(WavFileWriter::FORMAT_WAV, 1);
+}
+
+void test_stereo_survives_slow_card(void) {
+    recordThroughSlowCard(WavFileWriter::FORMAT_WAV, 2);
+}
+
+void test_lossless_stereo_survives_slow_card(void) {
+    recordThroughSlowCard(WavFileWriter::FORMAT_LOSSLESS, 2);
+}
+
+// What loop() gets up to while a take runs: display transfers that block for
+// hundreds of milliseconds, directory scans that hold the card, and the live
+// screen's two second error delay. Nothing in it calls the writer.
+static void busyLoopFor(uint32_t seconds) {
+    uint64_t end = mock::now + (uint64_t)seconds * 1000000;
+    uint32_t pass = 0;
+    while (mock::now < end) {
+        mock::advance(450000);
+        {
+            SdCardLock cardLock;
+            mock::advance(150000);
+        }
+        if (++pass % 8 == 0) delay(2000);
+    }
+}
+
+void test_writer_keeps_up_while_loop_blocks(void) {
+    AudioRecordSink sink;
+    WavFileWriter writer(sink);
+    mock::card.writeLatency = slowCardLatency;
+
+    TEST_ASSERT_TRUE(writer.open(TAKE_PATH, 44100, 2));
+    Input input(sink, 2);
+    input.attach();
+    busyLoopFor(30);
+    mock::audioInterrupt = nullptr;
+    TEST_ASSERT_TRUE(writer.close());
+
+    TEST_ASSERT_EQUAL_UINT32(0, writer.getOverruns());
+    TEST_ASSERT_EQUAL_UINT32(0, writer.getDroppedBlocks());
+    checkWav(mock::card.contents(TAKE_PATH), 2, input.frames);
+}
+
+// The pre-roll held while armed goes to the card a burst at a time, like
+// live audio, so the player's refill never waits behind one huge write
+void test_preroll_drains_in_bursts(void) {
+    AudioRecordSink sink;
+    WavFileWriter writer(sink);
+    uint32_t largestWrite = 0;
+    mock::card.writeLatency = [&](uint32_t sectors) -> uint32_t {
+        if (sectors > largestWrite) largestWrite = sectors;
+        return 1200 + sectors * 12;
+    };
+
+    Input input(sink, 2);
+    input.attach();
+    writer.arm(44100, 2);
+    recordFor(5);
+    TEST_ASSERT_TRUE(writer.open(TAKE_PATH, 44100, 2));
+    uint64_t openedAt = input.frames;
+    recordFor(5);
+    mock::audioInterrupt = nullptr;
+    TEST_ASSERT_TRUE(writer.close());
+
+    TEST_ASSERT_EQUAL_UINT32(0, writer.getOverruns());
+    TEST_ASSERT_EQUAL_UINT32(0, writer.getDroppedBlocks());
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(WAV_WRITER_FLUSH_KB * 1024 / 512,
+                                     largestWrite);
+
+    // A second of stereo pre-roll ahead of what came in after open()
+    const std::vector<uint8_t>& file = mock::card.contents(TAKE_PATH);
+    uint64_t frames = wavDataBytes(file) / 4;
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(44100 * 0.9,
+                                        frames - (input.frames - openedAt));
+    checkWav(file, 2, frames, input.frames - frames);
+}
+
+// What open() and close() write from the sketch goes out with the card held,
+// so the player's refill can't cut in halfway through a transfer
+void test_sketch_side_writes_hold_the_card(void) {
+    AudioRecordSink sink;
+    WavFileWriter writer(sink);
+    uint32_t unheld = 0;
+    mock::card.writeLatency = [&](uint32_t sectors) -> uint32_t {
+        if (!mock::inSoftwareInterrupt && !WavFileWriter::isCardLocked()) {
+            unheld++;
+        }
+        return 1200 + sectors * 12;
+    };
+
+    TEST_ASSERT_TRUE(writer.open(TAKE_PATH, 44100, 1));
+    Input input(sink, 1);
+    input.attach();
+    recordFor(3);
+    mock::audioInterrupt = nullptr;
+    TEST_ASSERT_TRUE(writer.close());
+
+    TEST_ASSERT_EQUAL_UINT32(0, unheld);
+    TEST_ASSERT_FALSE(WavFileWriter::isCardLocked());
+    checkWav(mock::card.contents(TAKE_PATH), 1, input.frames);
+}
+
+// A stall longer than the whole ring has to show up as sink overruns
+void test_stall_beyond_ring_is_counted(void) {
+    AudioRecordSink sink;
+    WavFileWriter writer(sink);
+    mock::card.writeLatency = [](uint32_t sectors) -> uint32_t {
+        return mock::card.writes == 20 ? 5000000 : 1000 + sectors * 12;
+    };
+
+    TEST_ASSERT_TRUE(writer.open(TAKE_PATH, 44100, 2));
+    Input input(sink, 2);
+    input.attach();
+    recordFor(10);
+    mock::audioInterrupt = nullptr;
+    writer.close();
+
+    TEST_ASSERT_GREATER_THAN_UINT32(0, writer.getOverruns());
+    // The extent had room, so nothing was lost on the writer's side
+    TEST_ASSERT_EQUAL_UINT32(0, writer.getDroppedBlocks());
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_mono_survives_slow_card);
+    RUN_TEST(test_stereo_survives_slow_card);
+    RUN_TEST(test_lossless_stereo_survives_slow_card);
+    RUN_TEST(test_writer_keeps_up_while_loop_blocks);
+    RUN_TEST(test_preroll_drains_in_bursts);
+    RUN_TEST(test_sketch_side_writes_hold_the_card);
+    RUN_TEST(test_stall_beyond_ring_is_counted);
+    return UNITY_END();
+}